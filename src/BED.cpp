@@ -10,11 +10,17 @@
 #include <sstream>
 #include <exception>
 #include <stdexcept>
+#include <unordered_map>
 
 using std::ifstream;
 using std::string;
 
 namespace rnaseqc {
+    namespace {
+        //Intervals are numbered after the features of the annotation, without registering them in its tables, which may be mapped
+        std::unordered_map<string, featureID> bedIDs;
+    }
+    
     ifstream& extractBED(ifstream &input, Feature &out)
     {
         try
@@ -31,8 +37,13 @@ namespace rnaseqc {
                 out.start = std::stoull(buffer) + 1;
                 tokenizer >> buffer; //stop
                 out.end = std::stoull(buffer) + 1;
-                out.feature_id = line; // add a dummy exon_id for mapping interval intersections later
+                auto entry = bedIDs.find(line); // add a dummy exon_id for mapping interval intersections later
+                if (entry == bedIDs.end()) entry = bedIDs.emplace(line, static_cast<featureID>(featureNames.size() + bedIDs.size())).first;
+                out.feature_id = entry->second;
+                out.gene_id = out.feature_id;
                 out.type = FeatureType::Exon;
+                out.strand = Strand::Unknown;
+                out.ribosomal = false;
                 break;
             }
         }
@@ -7,14 +7,257 @@
 //
 
 #include "BamReader.h"
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 
 namespace rnaseqc {
-    bool SeqlibReader::next(SeqLib::BamRecord &read)
+    bool isStream(const std::string &filepath)
     {
-        // Must uncomment before adding multithreading
-        //    std::lock_guard<SeqlibReader> guard(*this);
-        bool ok = this->bam.GetNextRecord(read);
+        if (filepath == "-") return true;
+        struct stat info;
+        return stat(filepath.c_str(), &info) == 0 && S_ISFIFO(info.st_mode);
+    }
+    
+    std::string Alignment::CigarString() const
+    {
+        std::string cigar;
+        const uint32_t *ops = this->Cigar();
+        for (uint32_t i = 0; i < this->CigarSize(); ++i) cigar += std::to_string(bam_cigar_oplen(ops[i])) + bam_cigar_opchr(ops[i]);
+        return cigar;
+    }
+    
+    const char* Alignment::GetZTag(const std::string &tag) const
+    {
+        uint8_t *data = bam_aux_get(this->record, tag.c_str());
+        return data == nullptr ? nullptr : bam_aux2Z(data);
+    }
+    
+    bool Alignment::GetIntTag(const std::string &tag, int32_t &value) const
+    {
+        uint8_t *data = bam_aux_get(this->record, tag.c_str());
+        if (data == nullptr) return false;
+        switch (*data)
+        {
+            case 'c':
+            case 'C':
+            case 's':
+            case 'S':
+            case 'i':
+            case 'I':
+                value = bam_aux2i(data);
+                return true;
+            default:
+                return false;
+        }
+    }
+    
+    SeqlibReader::~SeqlibReader()
+    {
+        this->stopReading(); // The read-ahead thread must be finished with the file before it's closed
+        this->stopPrefetching();
+        if (this->iterator != nullptr) hts_itr_destroy(this->iterator);
+        if (this->index != nullptr) hts_idx_destroy(this->index);
+        if (this->header != nullptr) bam_hdr_destroy(this->header);
+        if (this->file != nullptr) sam_close(this->file);
+        // The pool must outlive the file which uses it
+        if (this->pool.pool != nullptr && !this->sharedPool) hts_tpool_destroy(this->pool.pool);
+    }
+    
+    bool SeqlibReader::open(std::string filepath)
+    {
+        this->file = sam_open(filepath.c_str(), "r");
+        if (this->file == nullptr) return false;
+        if (this->reference.length()) hts_set_fai_filename(this->file, this->reference.c_str());
+        if (this->pool.pool != nullptr) hts_set_opt(this->file, HTS_OPT_THREAD_POOL, &this->pool);
+        if (hts_get_format(this->file)->format == cram) hts_set_opt(this->file, CRAM_OPT_REQUIRED_FIELDS, SAM_REQUIRED_FIELDS);
+        this->seekable = hts_get_format(this->file)->format == bam && !isStream(filepath);
+        if (this->prefetchWindow && this->seekable)
+        {
+            // The prefetch thread has its own descriptor, so it never touches htslib's state
+            const int fd = ::open(filepath.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd >= 0 && fstat(fd, &info) == 0) this->prefetchThread = std::thread(&SeqlibReader::prefetch, this, fd, static_cast<int64_t>(info.st_size));
+            else if (fd >= 0) ::close(fd);
+        }
+        this->header = sam_hdr_read(this->file);
+        return this->header != nullptr;
+    }
+    
+    std::string SeqlibReader::getSortOrder() const
+    {
+        if (this->header == nullptr || this->header->text == nullptr) return "";
+        const std::string text(this->header->text, this->header->l_text);
+        if (text.compare(0, 4, "@HD\t")) return ""; // @HD must be the first line, if present
+        const std::size_t end = text.find('\n');
+        std::size_t field = text.find("\tSO:");
+        if (field == std::string::npos || field > end) return "";
+        field += 4;
+        return text.substr(field, std::min(text.find('\t', field), end) - field);
+    }
+    
+    void SeqlibReader::setThreads(int threads)
+    {
+        // BAM and CRAM both hand block decompression off to the pool
+        if (threads < 1 || this->pool.pool != nullptr) return;
+        this->pool.pool = hts_tpool_init(threads);
+    }
+    
+    void SeqlibReader::shareThreads(const SeqlibReader &other)
+    {
+        if (other.pool.pool == nullptr || this->pool.pool != nullptr) return;
+        this->pool = other.pool;
+        this->sharedPool = true;
+    }
+    
+    bool SeqlibReader::loadIndex(std::string filepath)
+    {
+        if (this->file == nullptr) return false;
+        if (this->index == nullptr) this->index = sam_index_load(this->file, filepath.c_str());
+        return this->index != nullptr;
+    }
+    
+    bool SeqlibReader::setRegion(int tid, int64_t start, int64_t end)
+    {
+        if (this->index == nullptr) return false;
+        this->stopReading(); // Batches still being read belong to the old region
+        if (this->iterator != nullptr) hts_itr_destroy(this->iterator);
+        this->regionStart = tid >= 0 ? start : 0;
+        this->lastPosition = -1;
+        this->iterator = sam_itr_queryi(this->index, tid, start, end > INT_MAX ? INT_MAX : end);
+        return this->iterator != nullptr;
+    }
+    
+    bool SeqlibReader::seek(int64_t offset)
+    {
+        if (!this->seekable || offset < 0) return false;
+        this->stopReading(); // Batches still being read come from before the offset
+        if (this->iterator != nullptr) hts_itr_destroy(this->iterator);
+        this->iterator = nullptr;
+        this->regionStart = 0;
+        this->lastPosition = -1;
+        return bgzf_seek(this->file->fp.bgzf, offset, SEEK_SET) == 0;
+    }
+    
+    bool SeqlibReader::next(Alignment &read)
+    {
+        // Not locked: only one thread reads at a time (the read-ahead thread, while nextBatch() is in use)
+        auto start = std::chrono::steady_clock::now();
+        bool ok = (this->iterator != nullptr ? sam_itr_next(this->file, this->iterator, read.raw()) : sam_read1(this->file, this->header, read.raw())) >= 0;
+        while (ok && this->regionStart > 0 && read.Position() < this->regionStart) ok = sam_itr_next(this->file, this->iterator, read.raw()) >= 0;
+        read.endOffset = this->seekable ? bgzf_tell(this->file->fp.bgzf) : -1;
+        this->decodeTime += std::chrono::steady_clock::now() - start;
+        if (ok && this->seekable)
+        {
+            const int64_t position = read.endOffset >> 16; // The compressed offset of the current block
+            if (this->lastPosition >= 0 && position > this->lastPosition) this->consumedBytes += position - this->lastPosition;
+            this->lastPosition = position;
+            if (this->prefetchWindow) this->consumedPosition.store(position, std::memory_order_relaxed);
+        }
         if (ok) this->read_count++;
         return ok;
     }
+    
+    std::size_t SeqlibReader::nextBatch(std::vector<Alignment> &batch, std::size_t batchSize)
+    {
+        std::unique_lock<std::mutex> lock(this->batchLock);
+        this->freeBatches.push_back(std::move(batch)); // The caller is done with the previous batch
+        batch.clear();
+        if (!this->readAhead.joinable())
+        {
+            // Start reading ahead from the current position
+            while (this->freeBatches.size() < READ_AHEAD_BATCHES) this->freeBatches.push_back(std::vector<Alignment>());
+            this->readyBatches.clear();
+            this->readAheadDone = false;
+            this->stopReadAhead = false;
+            this->readAhead = std::thread(&SeqlibReader::fillBatches, this, batchSize);
+        }
+        else this->batchFree.notify_one();
+        this->batchReady.wait(lock, [this]{return this->readyBatches.size() || this->readAheadDone;});
+        if (this->readyBatches.empty())
+        {
+            // Reached the end. The next call will start reading again (after a call to setRegion(), for instance)
+            lock.unlock();
+            this->readAhead.join();
+            return 0;
+        }
+        batch.swap(this->readyBatches.front().first);
+        std::size_t count = this->readyBatches.front().second;
+        this->readyBatches.pop_front();
+        return count;
+    }
+    
+    void SeqlibReader::fillBatches(std::size_t batchSize)
+    {
+        while (true)
+        {
+            std::vector<Alignment> batch;
+            {
+                std::unique_lock<std::mutex> lock(this->batchLock);
+                this->batchFree.wait(lock, [this]{return this->freeBatches.size() || this->stopReadAhead;});
+                if (this->stopReadAhead) break;
+                batch.swap(this->freeBatches.front());
+                this->freeBatches.pop_front();
+            }
+            if (batch.size() < batchSize) batch.resize(batchSize);
+            std::size_t count = 0;
+            while (count < batchSize && this->next(batch[count])) ++count;
+            {
+                std::lock_guard<std::mutex> guard(this->batchLock);
+                if (count) this->readyBatches.push_back(std::make_pair(std::move(batch), count));
+                else this->freeBatches.push_back(std::move(batch));
+                if (count < batchSize) this->readAheadDone = true;
+            }
+            this->batchReady.notify_one();
+            if (count < batchSize) break;
+        }
+    }
+    
+    void SeqlibReader::stopReading()
+    {
+        if (!this->readAhead.joinable()) return;
+        {
+            std::lock_guard<std::mutex> guard(this->batchLock);
+            this->stopReadAhead = true;
+        }
+        this->batchFree.notify_all();
+        this->readAhead.join();
+    }
+    
+    void SeqlibReader::prefetch(int fd, int64_t size)
+    {
+        std::vector<char> buffer(PREFETCH_BLOCK_SIZE);
+        const int64_t window = static_cast<int64_t>(std::max(this->prefetchWindow, PREFETCH_BLOCK_SIZE));
+        int64_t next = 0; // Offset of the next block to read
+        while (!this->stopPrefetch.load())
+        {
+            const int64_t consumed = this->consumedPosition.load(std::memory_order_relaxed);
+            // Start over from the decoder's position if it moved outside of the window, as it does when switching regions.
+            // The last block read may end up to one block past the window
+            if (next < consumed || next > consumed + window + static_cast<int64_t>(PREFETCH_BLOCK_SIZE)) next = consumed - consumed % PREFETCH_BLOCK_SIZE;
+            if (next >= std::min(consumed + window, size))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2)); // Far enough ahead for now
+                continue;
+            }
+            const std::size_t length = static_cast<std::size_t>(std::min<int64_t>(PREFETCH_BLOCK_SIZE, size - next));
+#ifdef POSIX_FADV_WILLNEED
+            posix_fadvise(fd, next, length, POSIX_FADV_WILLNEED);
+#endif
+            const ssize_t bytes = pread(fd, buffer.data(), length, next);
+            if (bytes <= 0) break;
+            next += bytes;
+            this->prefetchedBytes += bytes;
+        }
+        ::close(fd);
+    }
+    
+    void SeqlibReader::stopPrefetching()
+    {
+        if (!this->prefetchThread.joinable()) return;
+        this->stopPrefetch = true;
+        this->prefetchThread.join();
+    }
 }
@@ -12,11 +12,104 @@
 #include <stdio.h>
 #include <mutex>
 #include <string>
-#include <SeqLib/BamReader.h>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <atomic>
 #include <SeqLib/BamHeader.h>
-#include <SeqLib/BamRecord.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
 namespace rnaseqc {
+    const std::size_t READ_BATCH_SIZE = 8192u; // Records decoded per batch by the read-ahead thread
+    const std::size_t READ_AHEAD_BATCHES = 3u; // Batches in flight: one being filled, one ready, one being processed
+    const std::size_t PREFETCH_BLOCK_SIZE = 4u << 20; // Size of each read issued by the prefetch thread. Reads start on a multiple of this size
+    // Fields decoded from CRAMs. Quality reconstruction is skipped since RNA-SeQC never uses it.
+    // The sequence is still decoded: CRAMs often don't store NM, and htslib can only rebuild it (for the mismatch metrics) from the sequence.
+    // SAM_AUX keeps NM and the chimeric/filter tags, since htslib can only select aux tags as a group
+    const int SAM_REQUIRED_FIELDS = SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_SEQ | SAM_AUX;
+    
+    bool isStream(const std::string&); // True for stdin ("-") and FIFOs, which can only be read once and can't be indexed
+    
+    class Alignment {
+        // A single htslib record. Accessors read straight from the bam1_t, so reading and filtering a record does not allocate
+        // Method names follow SeqLib::BamRecord
+        bam1_t *record;
+        mutable std::string name; // Reused buffer for Qname()
+        int64_t endOffset; // Virtual file offset just past this record, or -1 if the file can't be seeked
+        Alignment(const Alignment&) = delete;
+        friend class SeqlibReader;
+    public:
+        Alignment() : record(bam_init1()), name(), endOffset(-1) {
+            
+        }
+        
+        Alignment(Alignment &&other) noexcept : record(other.record), name(std::move(other.name)), endOffset(other.endOffset) {
+            other.record = nullptr;
+        }
+        
+        Alignment& operator=(Alignment &&other) noexcept {
+            std::swap(this->record, other.record);
+            std::swap(this->name, other.name);
+            std::swap(this->endOffset, other.endOffset);
+            return *this;
+        }
+        
+        ~Alignment() {
+            if (this->record != nullptr) bam_destroy1(this->record);
+        }
+        
+        bam1_t* raw() const {
+            return this->record;
+        }
+        
+        bool SecondaryFlag() const { return this->record->core.flag & BAM_FSECONDARY; }
+        bool QCFailFlag() const { return this->record->core.flag & BAM_FQCFAIL; }
+        bool PairedFlag() const { return this->record->core.flag & BAM_FPAIRED; }
+        bool MappedFlag() const { return !(this->record->core.flag & BAM_FUNMAP); }
+        bool MateMappedFlag() const { return !(this->record->core.flag & BAM_FMUNMAP); }
+        bool DuplicateFlag() const { return this->record->core.flag & BAM_FDUP; }
+        bool FirstFlag() const { return this->record->core.flag & BAM_FREAD1; }
+        bool ReverseFlag() const { return this->record->core.flag & BAM_FREVERSE; }
+        bool MateReverseFlag() const { return this->record->core.flag & BAM_FMREVERSE; }
+        bool ProperPair() const { return this->record->core.flag & BAM_FPROPER_PAIR; }
+        
+        int32_t ChrID() const { return this->record->core.tid; }
+        int32_t MateChrID() const { return this->record->core.mtid; }
+        int32_t Position() const { return this->record->core.pos; }
+        int32_t PositionEnd() const { return bam_endpos(this->record); }
+        int32_t MatePosition() const { return this->record->core.mpos; }
+        int32_t MapQuality() const { return this->record->core.qual; }
+        // Records without a sequence (SEQ '*') fall back to the query length of the CIGAR
+        int32_t Length() const {
+            if (this->record->core.l_qseq || !this->record->core.n_cigar) return this->record->core.l_qseq;
+            return static_cast<int32_t>(bam_cigar2qlen(this->record->core.n_cigar, bam_get_cigar(this->record)));
+        }
+        int32_t InsertSize() const { return this->record->core.isize; }
+        int64_t EndOffset() const { return this->endOffset; } // Pass to SeqlibReader::seek() to continue reading after this record
+        
+        // The returned string is overwritten by the next call
+        const std::string& Qname() const {
+            this->name.assign(bam_get_qname(this->record));
+            return this->name;
+        }
+        
+        uint32_t CigarSize() const { return this->record->core.n_cigar; }
+        const uint32_t* Cigar() const { return bam_get_cigar(this->record); } // Use bam_cigar_op and bam_cigar_oplen to read each entry
+        std::string CigarString() const;
+        
+        bool HasTag(const std::string &tag) const {
+            return bam_aux_get(this->record, tag.c_str()) != nullptr;
+        }
+        
+        const char* GetZTag(const std::string&) const; // Returns nullptr if the tag is missing or not a string
+        bool GetIntTag(const std::string&, int32_t&) const;
+    };
+    
     class SynchronizedReader {
         std::mutex mtx;
     protected:
@@ -43,29 +136,105 @@ namespace rnaseqc {
     };
     
     class SeqlibReader : public SynchronizedReader {
-        SeqLib::BamReader bam;
+        // Reads records directly through htslib so that a thread pool can be attached to the file
+        htsFile *file;
+        bam_hdr_t *header;
+        hts_idx_t *index;
+        hts_itr_t *iterator; // When set, records are read from a single region of the index
+        int64_t regionStart; // Records which start before the region are skipped, since they belong to the previous region
+        htsThreadPool pool;
+        bool sharedPool; // The pool belongs to another reader
+        bool seekable; // BAM records have BGZF virtual offsets, which can be returned to with seek()
+        std::string reference;
+        std::chrono::steady_clock::duration decodeTime; // Time spent waiting on htslib to decode records
+        // Read-ahead state for nextBatch(). Batches of records are passed back and forth so that records are reused
+        std::thread readAhead;
+        std::mutex batchLock;
+        std::condition_variable batchReady, batchFree;
+        std::deque<std::vector<Alignment> > freeBatches;
+        std::deque<std::pair<std::vector<Alignment>, std::size_t> > readyBatches;
+        bool readAheadDone, stopReadAhead;
+        void fillBatches(std::size_t); // Body of the read-ahead thread
+        void stopReading();
+        // Prefetch state. A background thread reads the file in large blocks ahead of htslib, so that htslib's small reads come from the page cache
+        std::size_t prefetchWindow; // Bytes to keep prefetched ahead of the decoder. 0 disables prefetching
+        std::thread prefetchThread;
+        std::atomic<int64_t> consumedPosition; // File offset of the block being decoded, published for the prefetch thread
+        std::atomic<bool> stopPrefetch;
+        std::atomic<uint64_t> prefetchedBytes;
+        uint64_t consumedBytes; // Compressed bytes decoded so far
+        int64_t lastPosition; // File offset of the previous block decoded, or -1 after a seek
+        void prefetch(int, int64_t); // Body of the prefetch thread
+        void stopPrefetching();
     public:
-        SeqlibReader() : bam() {
+        SeqlibReader() : file(nullptr), header(nullptr), index(nullptr), iterator(nullptr), regionStart(0), pool({nullptr, 0}), sharedPool(false), seekable(false), reference(), decodeTime(0), readAhead(), batchLock(), batchReady(), batchFree(), freeBatches(), readyBatches(), readAheadDone(false), stopReadAhead(false), prefetchWindow(0), prefetchThread(), consumedPosition(0), stopPrefetch(false), prefetchedBytes(0), consumedBytes(0), lastPosition(-1) {
         }
         
-        bool next(SeqLib::BamRecord&);
+        ~SeqlibReader();
+        
+        bool next(Alignment&);
+        
+        // Returns the previous batch to the reader and replaces it with the next batch of records, decoded on a background thread.
+        // Returns the number of valid records in the batch, or 0 once the file (or region) is exhausted.
+        // Do not mix with calls to next() until the batches are exhausted
+        std::size_t nextBatch(std::vector<Alignment>&, std::size_t batchSize = READ_BATCH_SIZE);
         
         const SeqLib::BamHeader getHeader() const {
-            return this->bam.Header();
+            return SeqLib::BamHeader(this->header);
         }
         
-        bool open(std::string filepath) {
-            this->bam.Open(filepath);
-            return this->bam.IsOpen();
-        }
+        bool open(std::string filepath); // "-" reads from stdin
+        
+        std::string getSortOrder() const; // The SO field of the @HD header line, or an empty string if it's missing
         
         void addReference(std::string filepath) {
-            this->bam.SetCramReference(filepath);
+            this->reference = filepath;
+        }
+        
+        void setThreads(int); // Attach a pool of decompression threads. Must be called before open()
+        
+        void shareThreads(const SeqlibReader&); // Use another reader's decompression pool. Must be called before open()
+        
+        // Prefetch this many bytes ahead of the decoder in large blocks on a background thread. Must be called before open(). Only BAM files are prefetched
+        void setPrefetch(std::size_t window) {
+            this->prefetchWindow = window;
+        }
+        
+        std::size_t getPrefetch() const {
+            return this->prefetchWindow;
+        }
+        
+        bool loadIndex(std::string filepath); // Load the BAI/CSI/CRAI index for the opened file
+        
+        // Restrict reading to alignments which start in [start, end) on one contig. HTS_IDX_NOCOOR selects the unplaced reads at the end of the file
+        bool setRegion(int tid, int64_t start = 0, int64_t end = INT64_MAX);
+        
+        bool canSeek() const {
+            return this->seekable;
+        }
+        
+        bool seek(int64_t); // Continue reading from a virtual offset returned by Alignment::EndOffset(). Clears any region
+        
+        double getDecodeTime() const {
+            return std::chrono::duration<double>(this->decodeTime).count();
+        }
+        
+        uint64_t getPrefetchedBytes() const {
+            return this->prefetchedBytes.load();
+        }
+        
+        uint64_t getConsumedBytes() const {
+            return this->consumedBytes;
+        }
+        
+        void addStats(const SeqlibReader &other) { // Adds the decoding time and I/O of a reader which read another part of this file
+            this->decodeTime += other.decodeTime;
+            this->prefetchedBytes += other.prefetchedBytes.load();
+            this->consumedBytes += other.consumedBytes;
         }
         
     };
     
-    typedef SeqLib::BamRecord Alignment;
 }
 
 #endif /* BamReader_h */
@@ -0,0 +1,696 @@
+//
+//  Engine.cpp
+//  RNA-SeQC
+//
+//
+
+#include "Engine.h"
+#include "Serialize.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <cstdint>
+#include <climits>
+
+using std::vector;
+using std::list;
+using std::map;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+namespace rnaseqc {
+    const string NM = "NM";
+    const unsigned int LEGACY_MAX_READ_LENGTH = 100000u;
+    const int LEGACY_SPLIT_DISTANCE = 100;
+    
+    void ReadLengthTracker::update(unsigned int alignmentSize, int length)
+    {
+        //Advance every record as if counting had started there
+        for (auto record = this->records.begin(); record != this->records.end(); ++record)
+            if (alignmentSize > static_cast<unsigned int>(record->second)) record->second = length;
+        if (this->records.empty() || alignmentSize > this->records.back().first) this->records.push_back(std::make_pair(alignmentSize, length));
+    }
+    
+    int ReadLengthTracker::replay(int readLength) const
+    {
+        //The first read larger than the incoming read length is the first one which updates it
+        for (auto record = this->records.begin(); record != this->records.end(); ++record)
+            if (record->first > static_cast<unsigned int>(readLength)) return record->second;
+        return readLength;
+    }
+    
+    void ReadLengthTracker::save(std::ostream &out) const
+    {
+        writeBinary(out, this->records);
+    }
+    
+    void ReadLengthTracker::load(std::istream &in)
+    {
+        readBinary(in, this->records);
+    }
+    
+    void saveOptions(std::ostream &out, const Options &options)
+    {
+        writeBinary(out, static_cast<int32_t>(options.orientation));
+        writeBinary(out, options.chimericDistance);
+        writeBinary(out, options.fragmentSamples);
+        writeBinary(out, options.baseMismatchThreshold);
+        writeBinary(out, options.mappingQualityThreshold);
+        writeBinary(out, options.coverageMask);
+        writeBinary(out, options.biasOffset);
+        writeBinary(out, options.biasWindow);
+        writeBinary(out, options.biasLength);
+        writeBinary(out, options.detectionThreshold);
+        writeBinary(out, options.legacy);
+        writeBinary(out, options.excludeChimeric);
+        writeBinary(out, options.unpaired);
+        writeBinary(out, options.tags);
+        writeBinary(out, options.chimericTag);
+    }
+    
+    void loadOptions(std::istream &in, Options &options)
+    {
+        int32_t orientation;
+        readBinary(in, orientation);
+        options.orientation = static_cast<Strand>(orientation);
+        readBinary(in, options.chimericDistance);
+        readBinary(in, options.fragmentSamples);
+        readBinary(in, options.baseMismatchThreshold);
+        readBinary(in, options.mappingQualityThreshold);
+        readBinary(in, options.coverageMask);
+        readBinary(in, options.biasOffset);
+        readBinary(in, options.biasWindow);
+        readBinary(in, options.biasLength);
+        readBinary(in, options.detectionThreshold);
+        readBinary(in, options.legacy);
+        readBinary(in, options.excludeChimeric);
+        readBinary(in, options.unpaired);
+        readBinary(in, options.tags);
+        readBinary(in, options.chimericTag);
+        options.strictSort = false;
+        options.verbosity = 0;
+    }
+    
+    bool operator==(const Options &a, const Options &b)
+    {
+        return a.orientation == b.orientation && a.chimericDistance == b.chimericDistance && a.fragmentSamples == b.fragmentSamples && a.baseMismatchThreshold == b.baseMismatchThreshold && a.mappingQualityThreshold == b.mappingQualityThreshold && a.coverageMask == b.coverageMask && a.biasOffset == b.biasOffset && a.biasWindow == b.biasWindow && a.biasLength == b.biasLength && a.detectionThreshold == b.detectionThreshold && a.legacy == b.legacy && a.excludeChimeric == b.excludeChimeric && a.unpaired == b.unpaired && a.tags == b.tags && a.chimericTag == b.chimericTag;
+    }
+    
+    SampleState::SampleState(const Options &opts, map<chrom, ContigFeatures> &featureMap, map<chrom, ContigFeatures> &bedMap, const string &coverageFile, bool writeCoverage, bool resume) : options(opts), partial(false), features(featureMap), bedFeatures(bedMap), counter(), counts(), bias(opts.biasOffset, opts.biasWindow, opts.biasLength, opts.detectionThreshold), baseCoverage(coverageFile, opts.coverageMask, writeCoverage, bias, resume), fragments(), fragmentSizes(), doFragmentSize(opts.fragmentSamples), readLength(0), readLengths(), alignmentCount(0ull), current_chrom(0), last_position(0), sorted_tid(0), sorted_position(0), mapped(false), classified(false), contigFinished(false), blocks(), hits(), scratch(&this->counts.exonCounts), contigIDs(), contigFeatures(nullptr), contigBedFeatures(nullptr), featuresChrom(0), processor(selectProcessor(opts))
+    {
+        
+    }
+    
+    SampleState::SampleState(const Options &opts, map<chrom, ContigFeatures> &featureMap, map<chrom, ContigFeatures> &bedMap) : options(opts), partial(true), features(featureMap), bedFeatures(bedMap), counter(), counts(), bias(opts.biasOffset, opts.biasWindow, opts.biasLength, opts.detectionThreshold), baseCoverage(opts.coverageMask, bias), fragments(), fragmentSizes(), doFragmentSize(opts.fragmentSamples), readLength(0), readLengths(), alignmentCount(0ull), current_chrom(0), last_position(0), sorted_tid(0), sorted_position(0), mapped(false), classified(false), contigFinished(false), blocks(), hits(), scratch(&this->counts.exonCounts), contigIDs(), contigFeatures(nullptr), contigBedFeatures(nullptr), featuresChrom(0), processor(selectProcessor(opts))
+    {
+        
+    }
+    
+    void SampleState::checkSorted(Alignment &alignment, SeqLib::HeaderSequenceVector &sequences)
+    {
+        // Unplaced reads (tid -1) sort after every contig
+        const int32_t tid = alignment.ChrID() < 0 ? INT32_MAX : alignment.ChrID();
+        if (tid < this->sorted_tid || (tid == this->sorted_tid && alignment.Position() < this->sorted_position))
+        {
+            std::ostringstream error;
+            error << "The input bam is not coordinate sorted. Alignment " << alignment.Qname();
+            if (alignment.ChrID() >= 0) error << " at " << sequences[alignment.ChrID()].Name << ":" << alignment.Position() + 1;
+            else error << " (unplaced)";
+            error << " (alignment #" << this->alignmentCount << ") follows ";
+            if (this->sorted_tid < INT32_MAX) error << sequences[this->sorted_tid].Name << ":" << this->sorted_position + 1;
+            else error << "the unplaced reads";
+            throw unsortedException(error.str());
+        }
+        this->sorted_tid = tid;
+        this->sorted_position = alignment.Position();
+    }
+    
+    // The options which change how every read is classified are template parameters, so the checks on them compile away
+    template <bool Legacy, bool Stranded, bool SingleEnd>
+    void SampleState::processAs(Alignment &alignment, SeqLib::HeaderSequenceVector &sequences)
+    {
+        ++this->alignmentCount;
+        if (this->options.strictSort) this->checkSorted(alignment, sequences);
+        //count metrics based on basic read data
+        if (alignment.SecondaryFlag()) this->counter.increment(Metrics::AlternativeAlignments);
+        else if (alignment.QCFailFlag()) this->counter.increment(Metrics::FailedVendorQC);
+        else if (alignment.MapQuality() < this->options.mappingQualityThreshold) this->counter.increment(Metrics::LowMappingQuality);
+        if (alignment.SecondaryFlag() || alignment.QCFailFlag()) return;
+        this->counter.increment(Metrics::QCPassedReads);
+        //raw counts:
+        if (!alignment.PairedFlag()) this->counter.increment(Metrics::UnpairedReads);
+        if (!alignment.MappedFlag()) return;
+        this->counter.increment(Metrics::MappedReads);
+        
+        if (alignment.DuplicateFlag()) this->counter.increment(Metrics::MappedDuplicateReads);
+        else this->counter.increment(Metrics::MappedUniqueReads);
+        //check length against max read length
+        unsigned int alignmentSize = alignment.PositionEnd() - alignment.Position();
+        if (Legacy && alignmentSize > LEGACY_MAX_READ_LENGTH) return;
+        if (!this->readLength) this->current_chrom = this->contigID(alignment.ChrID(), sequences);
+        this->mapped = true;
+        if (this->partial) this->readLengths.update(alignmentSize, alignment.Length());
+        if (alignmentSize > this->readLength) this->readLength = alignment.Length();
+        if (!Legacy && alignment.GetZTag(this->options.chimericTag) != nullptr)
+        {
+            this->counter.increment(Metrics::ChimericReadsTag);
+            if (this->options.excludeChimeric) return;
+        }
+        if (alignment.PairedFlag() && alignment.MateMappedFlag() )
+        {
+            if (alignment.FirstFlag()) this->counter.increment(Metrics::TotalMappedPairs);
+            if (alignment.ChrID() != alignment.MateChrID() || abs(alignment.Position() - alignment.MatePosition()) > this->options.chimericDistance || (Legacy && alignment.ChrID() > 127))
+            {
+                this->counter.increment(Metrics::ChimericReadsContig);
+                if (this->options.excludeChimeric) return;
+            }
+        }
+        //Get tag data
+        int32_t mismatches = 0;
+        if (alignment.GetIntTag(NM, mismatches))
+        {
+            if (alignment.PairedFlag())
+            {
+                if (alignment.FirstFlag())
+                {
+                    this->counter.increment(Metrics::End1MappedReads);
+                    this->counter.increment(Metrics::End1Mismatches, mismatches);
+                    this->counter.increment(Metrics::End1Bases, alignment.Length());
+                    if (alignment.DuplicateFlag()) this->counter.increment(Metrics::DuplicatePairs);
+                    else this->counter.increment(Metrics::UniqueFragments);
+                }
+                else
+                {
+                    this->counter.increment(Metrics::End2MappedReads);
+                    this->counter.increment(Metrics::End2Mismatches, mismatches);
+                    this->counter.increment(Metrics::End2Bases, alignment.Length());
+                }
+            
+            }
+            this->counter.increment(Metrics::MismatchedBases, mismatches);
+        }
+        this->counter.increment(Metrics::TotalBases, alignment.Length());
+        //generic filter tags:
+        bool discard = false;
+        for (auto tag = this->options.tags.begin(); tag != this->options.tags.end(); ++tag)
+        {
+            if (alignment.HasTag(*tag))
+            {
+                discard = true;
+                this->counter.incrementExtra("Filtered by tag: "+*tag);
+            }
+        }
+        if (discard) return;
+        
+        bool highQuality = (mismatches <= this->options.baseMismatchThreshold && (SingleEnd || alignment.ProperPair()) && alignment.MapQuality() >= this->options.mappingQualityThreshold);
+        
+        //now record intron/exon metrics by intersecting filtered reads with the list of features
+        if (alignment.ChrID() < 0 || alignment.ChrID() >= sequences.size())
+        {
+            //The read had an unrecognized RefID (one not defined in the bam's header)
+            if (this->options.verbosity) cerr << "Unrecognized RefID on alignment: " << alignment.Qname() <<endl;
+            return;
+        }
+        if (highQuality) this->counter.increment(Metrics::HighQualityReads);
+        else this->counter.increment(Metrics::LowQualityReads);
+        this->counter.increment(Metrics::ReadsUsedForCounts);
+        this->classified = true;
+        vector<Block> &blocks = this->blocks;
+        blocks.clear(); //reuse the block storage from the previous read
+        chrom chr = this->contigID(alignment.ChrID(), sequences);
+        if (chr != this->current_chrom)
+        {
+            dropFeatures(this->features[this->current_chrom], this->baseCoverage, this->counts);
+            this->current_chrom = chr;
+            this->contigFinished = true;
+        }
+        else if (this->last_position > alignment.Position())
+            cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
+        this->last_position = alignment.Position();
+        
+        if (!this->contigFeatures || chr != this->featuresChrom)
+        {
+            this->contigFeatures = &this->features[chr];
+            auto bed = this->bedFeatures.find(chr);
+            this->contigBedFeatures = bed != this->bedFeatures.end() ? &bed->second : nullptr;
+            this->featuresChrom = chr;
+        }
+        
+        //extract each cigar block from the alignment
+        unsigned int length = extractBlocks(alignment, blocks, Legacy);
+        this->counter.increment(Metrics::AlignmentBlocks, blocks.size());
+        trimFeatures(alignment, *this->contigFeatures, this->baseCoverage, this->counts); //drop features that appear before this read
+        
+        //run the read through exon metrics
+        if (Legacy) legacyExonAlignmentMetrics<Stranded, SingleEnd>(LEGACY_SPLIT_DISTANCE, *this->contigFeatures, this->counter, blocks, this->hits, alignment, length, this->options.orientation, this->baseCoverage, this->counts, highQuality);
+        else exonAlignmentMetrics<Stranded, SingleEnd>(*this->contigFeatures, this->counter, blocks, this->hits, this->scratch, alignment, length, this->options.orientation, this->baseCoverage, this->counts, highQuality);
+        
+        //if fragment size calculations were requested, we still have samples to take, and the chromosome exists within the provided bed
+        if (highQuality && this->doFragmentSize && alignment.PairedFlag() && this->contigBedFeatures)
+        {
+            this->doFragmentSize = fragmentSizeMetrics(this->doFragmentSize, *this->contigBedFeatures, this->fragments, this->fragmentSizes, blocks, this->hits, alignment);
+            if (!this->doFragmentSize)
+            {
+                //after taking all the samples we need, clean up the intervals
+                this->bedFeatures.clear();
+                this->contigBedFeatures = nullptr;
+            }
+            if (!this->doFragmentSize && !this->partial && this->options.verbosity > 1) cout << "Completed taking fragment size samples" << endl;
+        }
+    }
+    
+    SampleState::Processor SampleState::selectProcessor(const Options &options)
+    {
+        const bool stranded = options.orientation != Strand::Unknown;
+        if (options.legacy)
+        {
+            if (stranded) return options.unpaired ? &SampleState::processAs<true, true, true> : &SampleState::processAs<true, true, false>;
+            return options.unpaired ? &SampleState::processAs<true, false, true> : &SampleState::processAs<true, false, false>;
+        }
+        if (stranded) return options.unpaired ? &SampleState::processAs<false, true, true> : &SampleState::processAs<false, true, false>;
+        return options.unpaired ? &SampleState::processAs<false, false, true> : &SampleState::processAs<false, false, false>;
+    }
+    
+    chrom SampleState::contigID(int32_t tid, const SeqLib::HeaderSequenceVector &sequences)
+    {
+        if (this->contigIDs.size() != sequences.size())
+        {
+            //Contigs in the header are registered before any reads are processed, so this doesn't change the contig table
+            this->contigIDs.resize(sequences.size());
+            for (std::size_t i = 0; i < sequences.size(); ++i) this->contigIDs[i] = chromosomeMap(sequences[i].Name);
+        }
+        return tid >= 0 && static_cast<std::size_t>(tid) < this->contigIDs.size() ? this->contigIDs[tid] : 0;
+    }
+    
+    void SampleState::merge(SampleState &other)
+    {
+        this->counter.merge(other.counter);
+        this->counts.merge(other.counts);
+        this->bias.merge(other.bias);
+        this->baseCoverage.merge(other.baseCoverage);
+        //Keep the first samples in file order, as if the contigs had been read in sequence
+        for (auto size = other.fragmentSizes.begin(); size != other.fragmentSizes.end() && this->doFragmentSize; ++size)
+        {
+            this->fragmentSizes.push_back(*size);
+            --this->doFragmentSize;
+            if (!this->doFragmentSize && this->options.verbosity > 1) cout << "Completed taking fragment size samples" << endl;
+        }
+        if (!this->readLength && other.mapped) this->current_chrom = other.current_chrom;
+        this->readLength = other.readLengths.replay(this->readLength);
+        this->alignmentCount += other.alignmentCount;
+    }
+    
+    void SampleState::save(std::ostream &out) const
+    {
+        this->counter.save(out);
+        this->counts.save(out);
+        this->bias.save(out);
+        this->baseCoverage.save(out);
+        writeBinary(out, this->fragmentSizes);
+        writeBinary(out, this->readLength);
+        this->readLengths.save(out);
+        writeBinary(out, this->alignmentCount);
+        writeBinary(out, this->mapped);
+        writeBinary(out, this->classified);
+    }
+    
+    void SampleState::load(std::istream &in)
+    {
+        this->counter.load(in);
+        this->counts.load(in);
+        this->bias.load(in);
+        this->baseCoverage.load(in);
+        readBinary(in, this->fragmentSizes);
+        readBinary(in, this->readLength);
+        this->readLengths.load(in);
+        readBinary(in, this->alignmentCount);
+        readBinary(in, this->mapped);
+        readBinary(in, this->classified);
+    }
+    
+    void saveRemaining(std::ostream &out, const map<chrom, ContigFeatures> &features)
+    {
+        //Features are only ever removed from the front of each list, so the number left on each contig is enough to restore them
+        map<string, uint64_t> remaining;
+        for (auto contig = features.begin(); contig != features.end(); ++contig) remaining[getChromosomeName(contig->first)] = contig->second.size();
+        writeBinary(out, remaining);
+    }
+    
+    void restoreRemaining(std::istream &in, map<chrom, ContigFeatures> &features)
+    {
+        map<string, uint64_t> remaining;
+        readBinary(in, remaining);
+        for (auto contig = remaining.begin(); contig != remaining.end(); ++contig)
+        {
+            ContigFeatures &contigFeatures = features[chromosomeMap(contig->first)];
+            if (contigFeatures.size() < contig->second) throw fileException("The checkpoint does not match the annotation on " + contig->first);
+            contigFeatures.cursor = contigFeatures.starts.size() - contig->second;
+        }
+    }
+    
+    void SampleState::checkpoint(std::ostream &out)
+    {
+        this->save(out);
+        writeBinary(out, this->counts.fragmentTracker);
+        this->baseCoverage.checkpoint(out);
+        writeBinary(out, static_cast<uint64_t>(this->fragments.size()));
+        for (auto fragment = this->fragments.begin(); fragment != this->fragments.end(); ++fragment)
+        {
+            writeBinary(out, fragment->first);
+            writeBinary(out, std::get<EXON>(fragment->second));
+            writeBinary(out, std::get<ENDPOS>(fragment->second));
+        }
+        writeBinary(out, this->doFragmentSize);
+        writeBinary(out, this->current_chrom ? getChromosomeName(this->current_chrom) : string());
+        writeBinary(out, this->last_position);
+        writeBinary(out, this->sorted_tid);
+        writeBinary(out, this->sorted_position);
+        saveRemaining(out, this->features);
+        saveRemaining(out, this->bedFeatures);
+    }
+    
+    void SampleState::restore(std::istream &in)
+    {
+        uint64_t nFragments;
+        string chrName;
+        this->load(in);
+        readBinary(in, this->counts.fragmentTracker);
+        this->baseCoverage.restore(in);
+        readBinary(in, nFragments);
+        this->fragments.clear();
+        for (uint64_t i = 0; i < nFragments; ++i)
+        {
+            string name;
+            featureID exon;
+            coord end;
+            readBinary(in, name);
+            readBinary(in, exon);
+            readBinary(in, end);
+            this->fragments[name] = std::make_tuple(exon, end);
+        }
+        readBinary(in, this->doFragmentSize);
+        readBinary(in, chrName);
+        this->current_chrom = chrName.length() ? chromosomeMap(chrName) : 0;
+        readBinary(in, this->last_position);
+        readBinary(in, this->sorted_tid);
+        readBinary(in, this->sorted_position);
+        restoreRemaining(in, this->features);
+        restoreRemaining(in, this->bedFeatures);
+    }
+    
+    bool compRegions(const Region &a, const Region &b)
+    {
+        if (a.tid != b.tid)
+        {
+            if (a.tid < 0 || b.tid < 0) return b.tid < 0 && a.tid >= 0;
+            return a.tid < b.tid;
+        }
+        return a.start < b.start;
+    }
+    
+    vector<Region> contigRegions(const SeqLib::HeaderSequenceVector &sequences)
+    {
+        vector<Region> regions;
+        const int contigs = static_cast<int>(sequences.size());
+        for (int tid = 0; tid < contigs; ++tid) regions.push_back({tid, 0, REGION_END});
+        regions.push_back({HTS_IDX_NOCOOR, 0, REGION_END});
+        return regions;
+    }
+    
+    coord snapBoundary(const ContigFeatures &features, coord position, coord length)
+    {
+        //Returns the middle of the first intergenic gap (of at least REGION_CUT_GAP bases) which ends after the position
+        if (position <= 0) return 0;
+        if (position >= length) return REGION_END;
+        coord covered = 0; //End of the genes seen so far
+        for (std::size_t i = features.cursor; i < features.starts.size(); ++i)
+        {
+            if (features.type(i) != FeatureType::Gene) continue;
+            const coord gapStart = covered, gapEnd = static_cast<coord>(features.starts[i]) - 1;
+            if (gapEnd > position && gapEnd - gapStart >= REGION_CUT_GAP) return gapStart + (gapEnd - gapStart) / 2;
+            if (features.ends[i] > covered) covered = features.ends[i];
+        }
+        if (length - covered >= REGION_CUT_GAP && length > position) return covered + (length - covered) / 2;
+        return REGION_END;
+    }
+    
+    vector<Region> parseRegions(const vector<string> &specs, const SeqLib::HeaderSequenceVector &sequences, const map<chrom, ContigFeatures> &features)
+    {
+        vector<Region> regions;
+        const ContigFeatures none;
+        for (auto spec = specs.begin(); spec != specs.end(); ++spec)
+        {
+            if (*spec == "*")
+            {
+                regions.push_back({HTS_IDX_NOCOOR, 0, REGION_END});
+                continue;
+            }
+            size_t colon = spec->rfind(':');
+            string name = spec->substr(0, colon);
+            const int contigs = static_cast<int>(sequences.size());
+            int tid = -1;
+            for (int i = 0; i < contigs && tid < 0; ++i) if (sequences[i].Name == name) tid = i;
+            if (tid < 0 && colon != string::npos)
+            {
+                //Contig names may contain colons, so the whole region may be a contig name
+                name = *spec;
+                for (int i = 0; i < contigs && tid < 0; ++i) if (sequences[i].Name == name) tid = i;
+                if (tid >= 0) colon = string::npos;
+            }
+            if (tid < 0) throw regionException("Contig not present in the bam header: " + *spec);
+            const coord length = sequences[tid].Length;
+            coord start = 0, end = length;
+            if (colon != string::npos)
+            {
+                string range = spec->substr(colon + 1);
+                range.erase(std::remove(range.begin(), range.end(), ','), range.end());
+                const size_t dash = range.find('-');
+                try
+                {
+                    start = std::stoll(range.substr(0, dash)) - 1;
+                    if (dash != string::npos) end = std::stoll(range.substr(dash + 1));
+                }
+                catch (std::logic_error &e)
+                {
+                    throw regionException("Unable to parse region: " + *spec);
+                }
+                if (start < 0 || end <= start) throw regionException("Invalid region bounds: " + *spec);
+            }
+            auto contig = features.find(chromosomeMap(name));
+            const ContigFeatures &contigFeatures = contig != features.end() ? contig->second : none;
+            regions.push_back({tid, snapBoundary(contigFeatures, start, length), snapBoundary(contigFeatures, end, length)});
+        }
+        std::sort(regions.begin(), regions.end(), compRegions);
+        for (size_t i = 1; i < regions.size(); ++i)
+            if (regions[i].tid == regions[i-1].tid && (regions[i].tid < 0 || regions[i].start < regions[i-1].end)) throw regionException("Regions overlap on " + (regions[i].tid >= 0 ? sequences[regions[i].tid].Name : "*"));
+        return regions;
+    }
+    
+    void takeFeatures(ContigFeatures &source, ContigFeatures &destination, coord start, coord end)
+    {
+        //Moves features which start in [start, end) into the destination, keeping their order
+        bool whole = destination.starts.empty();
+        for (std::size_t i = source.cursor; whole && i < source.starts.size(); ++i)
+        {
+            const coord position = static_cast<coord>(source.starts[i]) - 1;
+            whole = position >= start && position < end;
+        }
+        if (whole)
+        {
+            //Whole contigs are handed over as they are, so that one mapped from an annotation index stays shared
+            destination.swap(source);
+            source.chromosome = destination.chromosome;
+            return;
+        }
+        ContigFeatures kept;
+        for (std::size_t i = source.cursor; i < source.starts.size(); ++i)
+        {
+            const coord position = static_cast<coord>(source.starts[i]) - 1;
+            if (position >= start && position < end) destination.append(source, i);
+            else kept.append(source, i);
+        }
+        kept.chromosome = source.chromosome;
+        source.swap(kept);
+    }
+    
+    void processRegions(const string &bamFilename, const string &reference, SeqlibReader &bam, SeqLib::HeaderSequenceVector &sequences, unsigned int workers, const vector<Region> &regions, map<chrom, ContigFeatures> &features, map<chrom, ContigFeatures> &bedFeatures, const Options &options, vector<std::unique_ptr<RegionWork> > &units)
+    {
+        //Every work unit owns the features in its region, so the shared annotation tables are only read from here on
+        for (auto region = regions.begin(); region != regions.end(); ++region)
+        {
+            std::unique_ptr<RegionWork> unit(new RegionWork());
+            unit->region = *region;
+            unit->chr = region->tid >= 0 ? chromosomeMap(sequences[region->tid].Name) : 0;
+            unit->size = region->tid >= 0 ? std::min<coord>(region->end, sequences[region->tid].Length) - region->start : -1;
+            if (region->tid >= 0)
+            {
+                auto feats = features.find(unit->chr);
+                if (feats != features.end())
+                {
+                    if (region->start == 0 && region->end == REGION_END) unit->features[unit->chr].swap(feats->second);
+                    else takeFeatures(feats->second, unit->features[unit->chr], region->start, region->end);
+                }
+                auto beds = bedFeatures.find(unit->chr);
+                if (beds != bedFeatures.end()) takeFeatures(beds->second, unit->bedFeatures[unit->chr], region->start, region->end);
+            }
+            units.push_back(std::move(unit));
+        }
+        
+        //Start with the largest regions so that a long contig does not finish last. Unplaced reads can't be sized, so they go first
+        vector<RegionWork*> schedule;
+        for (auto unit = units.begin(); unit != units.end(); ++unit) schedule.push_back(unit->get());
+        std::stable_sort(schedule.begin(), schedule.end(), [](const RegionWork *a, const RegionWork *b) {
+            if (a->size < 0 || b->size < 0) return a->size < 0 && b->size >= 0;
+            return a->size > b->size;
+        });
+        std::atomic<unsigned int> nextUnit(0u);
+        std::exception_ptr failure = nullptr;
+        std::mutex failureLock;
+        std::mutex outputLock; //Keeps progress messages from different workers on separate lines
+        
+        auto work = [&]() {
+            try
+            {
+                SeqlibReader reader;
+                if (reference.length()) reader.addReference(reference);
+                reader.shareThreads(bam);
+                reader.setPrefetch(bam.getPrefetch());
+                if (!reader.open(bamFilename)) throw fileException("Unable to open BAM file: " + bamFilename);
+                if (!reader.loadIndex(bamFilename)) throw fileException("Unable to load the index for BAM file: " + bamFilename);
+                vector<Alignment> batch;
+                for (unsigned int i = nextUnit++; i < schedule.size(); i = nextUnit++)
+                {
+                    RegionWork &unit = *schedule[i];
+                    const string name = unit.region.tid >= 0 ? sequences[unit.region.tid].Name : "*";
+                    if (!reader.setRegion(unit.region.tid, unit.region.start, unit.region.end)) throw fileException("Unable to read contig " + name + " from the index of " + bamFilename);
+                    unit.state.reset(new SampleState(options, unit.features, unit.bedFeatures));
+                    unit.state->current_chrom = unit.chr;
+                    for (size_t batchSize = reader.nextBatch(batch); batchSize; batchSize = reader.nextBatch(batch))
+                        for (size_t j = 0; j < batchSize; ++j) unit.state->process(batch[j], sequences);
+                    unit.trimOutput = unit.state->baseCoverage.takeOutput();
+                    for (auto feats = unit.features.begin(); feats != unit.features.end(); ++feats)
+                        if (feats->second.size()) dropFeatures(feats->second, unit.state->baseCoverage, unit.state->counts);
+                    unit.dropOutput = unit.state->baseCoverage.takeOutput();
+                    if (options.verbosity > 1)
+                    {
+                        std::lock_guard<std::mutex> guard(outputLock);
+                        cout << "Finished contig " << name;
+                        if (unit.region.start > 0 || unit.region.end != REGION_END) cout << " [" << unit.region.start << ", " << (unit.region.end == REGION_END ? "end" : std::to_string(unit.region.end)) << ")";
+                        cout << ": " << unit.state->alignmentCount << " alignments" << endl;
+                    }
+                }
+                std::lock_guard<SeqlibReader> guard(bam);
+                bam.addStats(reader);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(failureLock);
+                if (failure == nullptr) failure = std::current_exception();
+                nextUnit = schedule.size(); //stop the other workers
+            }
+        };
+        vector<std::thread> pool;
+        for (unsigned int i = 0; i < workers; ++i) pool.push_back(std::thread(work));
+        for (auto thread = pool.begin(); thread != pool.end(); ++thread) thread->join();
+        if (failure != nullptr) std::rethrow_exception(failure);
+    }
+        
+    void mergeRegions(vector<std::unique_ptr<RegionWork> > &units, map<chrom, ContigFeatures> &features, SampleState &output)
+    {
+        //Merge in file order. Coverage output is replayed in the order a single pass would have written it:
+        //The remaining features of a contig are written once a later region has a read run through exon metrics, or at the very end
+        map<chrom, string> leftovers;
+        for (auto unit = units.begin(); unit != units.end(); ++unit)
+        {
+            SampleState &state = *(*unit)->state;
+            output.merge(state);
+            if ((*unit)->region.tid < 0) continue;
+            if (state.classified)
+            {
+                if ((*unit)->chr != output.current_chrom)
+                {
+                    auto previous = leftovers.find(output.current_chrom);
+                    if (previous != leftovers.end())
+                    {
+                        output.baseCoverage.write(previous->second);
+                        leftovers.erase(previous);
+                    }
+                    dropFeatures(features[output.current_chrom], output.baseCoverage, output.counts);
+                }
+                else
+                {
+                    //Features left over by an earlier region of this contig are passed by the first read of this one
+                    auto previous = leftovers.find((*unit)->chr);
+                    if (previous != leftovers.end())
+                    {
+                        output.baseCoverage.write(previous->second);
+                        leftovers.erase(previous);
+                    }
+                }
+                output.baseCoverage.write((*unit)->trimOutput);
+                output.current_chrom = (*unit)->chr;
+            }
+            leftovers[(*unit)->chr] += (*unit)->dropOutput;
+            (*unit)->state.reset();
+        }
+        for (auto feats = features.begin(); feats != features.end(); ++feats)
+        {
+            auto leftover = leftovers.find(feats->first);
+            if (leftover != leftovers.end()) output.baseCoverage.write(leftover->second);
+            if (feats->second.size()) dropFeatures(feats->second, output.baseCoverage, output.counts);
+        }
+    }
+    
+    void processContigs(const string &bamFilename, const string &reference, SeqlibReader &bam, SeqLib::HeaderSequenceVector &sequences, unsigned int workers, map<chrom, ContigFeatures> &features, map<chrom, ContigFeatures> &bedFeatures, SampleState &output)
+    {
+        vector<std::unique_ptr<RegionWork> > units;
+        processRegions(bamFilename, reference, bam, sequences, workers, contigRegions(sequences), features, bedFeatures, output.options, units);
+        mergeRegions(units, features, output);
+    }
+    
+    void saveRegions(std::ostream &out, const vector<std::unique_ptr<RegionWork> > &units)
+    {
+        writeBinary(out, static_cast<uint64_t>(units.size()));
+        for (auto unit = units.begin(); unit != units.end(); ++unit)
+        {
+            writeBinary(out, (*unit)->region.tid);
+            writeBinary(out, (*unit)->region.start);
+            writeBinary(out, (*unit)->region.end);
+            (*unit)->state->save(out);
+            writeBinary(out, (*unit)->trimOutput);
+            writeBinary(out, (*unit)->dropOutput);
+        }
+    }
+    
+    void loadRegions(std::istream &in, const Options &options, const SeqLib::HeaderSequenceVector &sequences, map<chrom, ContigFeatures> &features, vector<std::unique_ptr<RegionWork> > &units)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            std::unique_ptr<RegionWork> unit(new RegionWork());
+            readBinary(in, unit->region.tid);
+            readBinary(in, unit->region.start);
+            readBinary(in, unit->region.end);
+            if (unit->region.tid >= static_cast<int>(sequences.size()) || (unit->region.tid < 0 && unit->region.tid != HTS_IDX_NOCOOR)) throw fileException("Partial state file refers to an unknown contig");
+            unit->chr = unit->region.tid >= 0 ? chromosomeMap(sequences[unit->region.tid].Name) : 0;
+            unit->size = 0;
+            //The region's features were already counted by the shard, so they're no longer left over
+            auto feats = features.find(unit->chr);
+            if (unit->region.tid >= 0 && feats != features.end()) takeFeatures(feats->second, unit->features[unit->chr], unit->region.start, unit->region.end);
+            unit->state.reset(new SampleState(options, unit->features, unit->bedFeatures));
+            unit->state->current_chrom = unit->chr;
+            unit->state->load(in);
+            readBinary(in, unit->trimOutput);
+            readBinary(in, unit->dropOutput);
+            units.push_back(std::move(unit));
+        }
+    }
+}
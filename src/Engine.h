@@ -0,0 +1,162 @@
+//
+//  Engine.h
+//  RNA-SeQC
+//
+//
+
+#ifndef Engine_h
+#define Engine_h
+
+#include "Expression.h"
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include <utility>
+#include <exception>
+#include <memory>
+#include <limits>
+#include <iostream>
+
+namespace rnaseqc {
+    struct unsortedException : public std::exception {
+        std::string error;
+        unsortedException(std::string msg) : error(msg) {};
+    };
+    
+    struct regionException : public std::exception {
+        std::string error;
+        regionException(std::string msg) : error(msg) {};
+    };
+    
+    const coord REGION_END = std::numeric_limits<coord>::max(); //The region continues to the end of its contig
+    const coord REGION_CUT_GAP = 10000; //Region boundaries are moved into the middle of an intergenic gap at least this long
+    
+    struct Options {
+        // Command line settings which control how reads are counted
+        Strand orientation;
+        int chimericDistance;
+        unsigned int fragmentSamples; //0 if no BED was provided
+        unsigned int baseMismatchThreshold;
+        unsigned int mappingQualityThreshold;
+        unsigned int coverageMask;
+        int biasOffset;
+        int biasWindow;
+        unsigned long biasLength;
+        unsigned int detectionThreshold;
+        bool legacy, excludeChimeric, unpaired;
+        bool strictSort; //Abort on the first out of order alignment instead of warning
+        std::vector<std::string> tags;
+        std::string chimericTag;
+        int verbosity;
+    };
+    
+    void saveOptions(std::ostream&, const Options&);
+    void loadOptions(std::istream&, Options&);
+    bool operator==(const Options&, const Options&); //True if both sets of options count reads the same way
+    
+    class ReadLengthTracker {
+        // Records how a contig would update the read length, for any read length left by the preceeding contigs
+        // Each record is a read which sets a new maximum alignment size, and the read length reached if counting started with that read
+        std::vector<std::pair<unsigned int, int> > records;
+    public:
+        ReadLengthTracker() : records() {
+            
+        }
+        
+        void update(unsigned int, int);
+        int replay(int) const; //Returns the read length after this contig, given the read length before it
+        void save(std::ostream&) const;
+        void load(std::istream&);
+    };
+    
+    struct SampleState {
+        // Everything recorded while reading alignments.
+        // A sample is either read by one state, or each contig is read by its own state and merged back in file order
+        const Options &options;
+        const bool partial; //This state only covers one contig and will be merged into another
+        std::map<chrom, ContigFeatures> &features, &bedFeatures;
+        Metrics counter; //main tracker for various metrics
+        FeatureCounts counts;
+        BiasCounter bias;
+        BaseCoverage baseCoverage;
+        std::map<std::string, FragmentMateEntry> fragments; //Map of alignment name -> exonID to ensure mates map to the same exon for
+        std::vector<long long> fragmentSizes; //list of fragment size samples taken so far
+        unsigned int doFragmentSize; //count of remaining fragment size samples to record
+        int readLength; //longest read encountered so far
+        ReadLengthTracker readLengths;
+        unsigned long long alignmentCount; //count of how many alignments we've seen so far
+        chrom current_chrom;
+        int32_t last_position; // For some reason, htslib has decided that this will be the datatype used for positions
+        int32_t sorted_tid, sorted_position; //Last alignment seen by the strict sort check
+        bool mapped; //At least one mapped read reached the read length check
+        bool classified; //At least one read was run through exon metrics
+        bool contigFinished; //The features of the previous contig were just dropped. Cleared by the caller
+        std::vector<Block> blocks; //aligned blocks of the current read. Reused, so decoding a read doesn't allocate
+        std::vector<std::size_t> hits; //features intersected by the current block
+        ReadScratch scratch; //everything else exon metrics needs to classify a read, kept between reads
+        std::vector<chrom> contigIDs; //BAM tid -> contig ID, built from the header by the first alignment
+        ContigFeatures *contigFeatures, *contigBedFeatures; //Features of the contig being read (null if the BED has none), looked up when the contig changes
+        chrom featuresChrom;
+        typedef void (SampleState::*Processor)(Alignment&, SeqLib::HeaderSequenceVector&);
+        Processor processor; //The instantiation of processAs for these options, chosen when the state is created
+        
+        SampleState(const Options&, std::map<chrom, ContigFeatures>&, std::map<chrom, ContigFeatures>&, const std::string&, bool, bool resume = false);
+        SampleState(const Options&, std::map<chrom, ContigFeatures>&, std::map<chrom, ContigFeatures>&); //Buffered state for a single contig
+        
+        void process(Alignment &alignment, SeqLib::HeaderSequenceVector &sequences) //Runs one alignment through all metrics
+        {
+            (this->*processor)(alignment, sequences);
+        }
+        void checkSorted(Alignment&, SeqLib::HeaderSequenceVector&); //Throws an unsortedException if the alignment is out of order
+        chrom contigID(int32_t, const SeqLib::HeaderSequenceVector&); //Contig ID of a BAM tid
+        void merge(SampleState&); //Adds the results of a contig which follows all reads seen so far
+        void save(std::ostream&) const; //Writes everything needed to merge this state later. Only valid once its features have been dropped
+        void load(std::istream&);
+        void checkpoint(std::ostream&); //Writes everything needed to resume reading from the current alignment, including features still in the window
+        void restore(std::istream&); //Restores a checkpoint into a state constructed for resuming, with freshly loaded features
+    private:
+        template <bool Legacy, bool Stranded, bool SingleEnd> void processAs(Alignment&, SeqLib::HeaderSequenceVector&);
+        static Processor selectProcessor(const Options&);
+        SampleState(const SampleState&) = delete;
+    };
+    
+    struct Region {
+        // Alignments which start within [start, end) (0-based) on one contig. HTS_IDX_NOCOOR selects the unplaced reads instead
+        int tid;
+        coord start, end;
+    };
+    
+    bool compRegions(const Region&, const Region&); //File order: by contig, then start. Unplaced reads come last
+    
+    struct RegionWork {
+        // One region of the bam, processed independently of the others
+        Region region;
+        chrom chr;
+        long long size;
+        std::map<chrom, ContigFeatures> features, bedFeatures; //Features which start in the region
+        std::unique_ptr<SampleState> state;
+        std::string trimOutput; //Coverage written while reading the region
+        std::string dropOutput; //Coverage of the features left over after the region
+    };
+    
+    std::vector<Region> contigRegions(const SeqLib::HeaderSequenceVector&); //Every contig, in file order, followed by the unplaced reads
+    
+    // Parses "contig", "contig:start-end" (1-based, inclusive) or "*" (the unplaced reads) into regions, sorted in file order.
+    // Boundaries within a contig are moved into the nearest large intergenic gap, so that every gene belongs to a single region
+    std::vector<Region> parseRegions(const std::vector<std::string>&, const SeqLib::HeaderSequenceVector&, const std::map<chrom, ContigFeatures>&);
+    
+    // Process regions of an indexed bam on a pool of workers. Each region takes ownership of the features which start inside it
+    void processRegions(const std::string&, const std::string&, SeqlibReader&, SeqLib::HeaderSequenceVector&, unsigned int, const std::vector<Region>&, std::map<chrom, ContigFeatures>&, std::map<chrom, ContigFeatures>&, const Options&, std::vector<std::unique_ptr<RegionWork> >&);
+    
+    // Merge processed regions (sorted in file order) into the output state. Features which no region owned are dropped at the end
+    void mergeRegions(std::vector<std::unique_ptr<RegionWork> >&, std::map<chrom, ContigFeatures>&, SampleState&);
+    
+    void saveRegions(std::ostream&, const std::vector<std::unique_ptr<RegionWork> >&);
+    void loadRegions(std::istream&, const Options&, const SeqLib::HeaderSequenceVector&, std::map<chrom, ContigFeatures>&, std::vector<std::unique_ptr<RegionWork> >&); //Appends the saved regions, which take ownership of their features
+    
+    // Process each contig of an indexed bam on a pool of workers, then merge the results into the output state in file order
+    void processContigs(const std::string&, const std::string&, SeqlibReader&, SeqLib::HeaderSequenceVector&, unsigned int, std::map<chrom, ContigFeatures>&, std::map<chrom, ContigFeatures>&, SampleState&);
+}
+
+#endif /* Engine_h */
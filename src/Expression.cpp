@@ -22,98 +22,93 @@ using std::pair;
 namespace rnaseqc {
     
     const set<string> blacklistedGlobins = {"HBA1", "HBA2", "HBB", "HBD", "HBG1", "HBG2", "HBE1", "HBM", "HBQ1", "HBZ", "HBBP1", "HBZP1"};
+    vector<bool> globins; //Feature ID -> whether the gene name is a blacklisted globin
+    
+    void flagGlobins()
+    {
+        globins.assign(geneNames.size(), false);
+        for (featureID id = 0; id < geneNames.size(); ++id) globins[id] = blacklistedGlobins.count(geneNames[id]) > 0;
+    }
+    
     //this actually is the legacy version, but it works out the same and makes alignment size math a little easier
-    unsigned int extractBlocks(Alignment &alignment, vector<Feature> &blocks, chrom chr, bool legacy)
+    unsigned int extractBlocks(Alignment &alignment, vector<Block> &blocks, bool legacy)
     {
         //parse the cigar string and populate the provided vector with each block of the read
-        const SeqLib::Cigar cigar = alignment.GetCigar();
-        const unsigned long cigarLen = cigar.size();
+        const uint32_t *cigar = alignment.Cigar();
+        const unsigned long cigarLen = alignment.CigarSize();
+        const Strand strand = alignment.ReverseFlag() ? Strand::Reverse : Strand::Forward;
         coord start = alignment.Position() + 1;
         unsigned int alignedSize = 0;
         for (unsigned int i = 0; i < cigarLen; ++i)
         {
-            SeqLib::CigarField current = cigar[i];
-            Feature block;
-            switch(current.Type())
+            const unsigned int length = bam_cigar_oplen(cigar[i]);
+            switch(bam_cigar_opchr(cigar[i]))
             {
                 case 'M':
                 case '=':
                 case 'X':
                     //M, =, and X blocks are aligned, so push back this block
-                    block.start = start;
-                    block.chromosome = chr;
-                    block.end = start + current.Length(); //1-based, closed
-                    block.strand = alignment.ReverseFlag() ? Strand::Reverse : Strand::Forward;
-                    blocks.push_back(block);
-                    alignedSize += current.Length();
+                    blocks.push_back({start, start + length, strand}); //1-based, closed
+                    alignedSize += length;
                 case 'N':
                 case 'D':
                     //M, =, X, N, and D blocks all advance the start position of the next block
-                    start += current.Length();
+                    start += length;
                 case 'H':
                 case 'P':
                     //            case 'S':
                 case 'I':
                     break;
                 case 'S':
-                    if (legacy) alignedSize += current.Length();
+                    if (legacy) alignedSize += length;
                     break;
                 default:
-                    std::cerr << "Bad cigar operation: " << current.Type() << " " << alignment.CigarString() <<  endl;
+                    std::cerr << "Bad cigar operation: " << bam_cigar_opchr(cigar[i]) << " " << alignment.CigarString() <<  endl;
                     throw std::invalid_argument("Unrecognized Cigar Op ");
             }
         }
         return alignedSize;
     }
     
-    void trimFeatures(Alignment &alignment, list<Feature> &features)
+    void trimFeatures(Alignment &alignment, ContigFeatures &features)
     {
         //trim intervals upstream of this block
         //Since alignments are sorted, if an alignment occurs beyond any features, these features can be dropped
-        while (!features.empty() && features.front().end < alignment.Position())
-        {
-            if (features.front().type == FeatureType::Gene) fragmentTracker.erase(features.front().feature_id);
-            features.pop_front();
-        }
+        while (!features.empty() && features.ends[features.cursor] < alignment.Position()) features.pop_front();
     }
     
-    void trimFeatures(Alignment &alignment, list<Feature> &features, BaseCoverage &coverage)
+    void trimFeatures(Alignment &alignment, ContigFeatures &features, BaseCoverage &coverage, FeatureCounts &counts)
     {
         //trim intervals upstream of this block
         //Since alignments are sorted, if an alignment occurs beyond any features, these features can be dropped
-        while (!features.empty() && features.front().end < alignment.Position())
+        while (!features.empty() && features.ends[features.cursor] < alignment.Position())
         {
-            if (features.front().type == FeatureType::Gene)
+            if (features.type(features.cursor) == FeatureType::Gene)
             {
-                coverage.compute(features.front()); //Once this gene leaves the search window, compute coverage
-                fragmentTracker.erase(features.front().feature_id);
+                coverage.compute(features.get(features.cursor)); //Once this gene leaves the search window, compute coverage
+                counts.fragmentTracker.erase(features.ids[features.cursor]);
             }
             features.pop_front();
         }
     }
     
     // After we switch chromosomes, just drop all the remaining features from the previous chromosome
-    void dropFeatures(std::list<Feature> &features, BaseCoverage &coverage)
+    void dropFeatures(ContigFeatures &features, BaseCoverage &coverage, FeatureCounts &counts)
     {
-        for (auto feat = features.begin(); feat != features.end(); ++feat) if (feat->type == FeatureType::Gene) {
-            coverage.compute(*feat);
-            fragmentTracker.erase(feat->feature_id);
+        for (std::size_t i = features.cursor; i < features.starts.size(); ++i) if (features.type(i) == FeatureType::Gene) {
+            coverage.compute(features.get(i));
+            counts.fragmentTracker.erase(features.ids[i]);
         }
         features.clear();
     }
     
-    // Get the list of features that this aligned segment intersects
-    list<Feature>* intersectBlock(Feature &block, list<Feature> &features)
+    // Get the positions of the features that this aligned segment intersects
+    void intersectBlock(const Block &block, ContigFeatures &features, vector<std::size_t> &hits)
     {
-        list<Feature> *output = new list<Feature>();
-        //since we've trimmed the beginning of the features, we start from the new beginning here
-        //There should be little overhead (at most ~1 gene worth of exons on either end of the block)
-        for (auto current = features.begin(); current != features.end() && current->start <= block.end; ++current)
-        {
-            //check that the current feature actually intersects the current block of the current alignment
-            if (intersectInterval(block, *current)) output->push_back(*current);
-        }
-        return output;
+        hits.clear(); //reuse the storage from the previous block
+        features.intersect(block.start, block.end, [&hits](std::size_t i) {
+            hits.push_back(i);
+        });
     }
     
     Strand feature_strand(Alignment &alignment, Strand orientation)
@@ -126,10 +121,9 @@ namespace rnaseqc {
     
     // Legacy version of standard alignment metrics
     // This code is really inefficient, but it's a faithful replication of the original code
-    void legacyExonAlignmentMetrics(unsigned int SPLIT_DISTANCE, map<chrom, list<Feature>> &features, Metrics &counter, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, const bool highQuality, const bool singleEnd)
+    template <bool Stranded, bool SingleEnd>
+    void legacyExonAlignmentMetrics(unsigned int SPLIT_DISTANCE, ContigFeatures &contig, Metrics &counter, vector<Block> &blocks, vector<std::size_t> &hits, Alignment &alignment, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, FeatureCounts &counts, const bool highQuality)
     {
-        string chrName = sequenceTable[alignment.ChrID()].Name;
-        chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand name
         //check for split reads by iterating over all the blocks of this read
         //    cout << "~" << alignment.Qname();
         bool split = false;
@@ -141,33 +135,34 @@ namespace rnaseqc {
         }
         
         //Bamtools uses 0-based indexing because it's the 'norm' in computer science, even though sams are 1-based
-        Feature current; //current block of the alignment (used while iterating)
+        Block current; //current block of the alignment (used while iterating)
         current.start = alignment.Position()+1; //0-based + 1 == 1-based
         current.end = alignment.PositionEnd(); //0-based, open == 1-based, closed
         
-        list<Feature> *results = intersectBlock(current, features[chr]);
+        intersectBlock(current, contig, hits);
         
-        vector<set<string> > genes; //each set is the set of genes intersected by the current block (one set per block)
+        vector<set<featureID> > genes; //each set is the set of genes intersected by the current block (one set per block)
         bool intragenic = false, transcriptPlus = false, transcriptMinus = false, ribosomal = false, doExonMetrics = false, exonic = false, legacyJunction = false, legacyNotExonic = false; //various booleans for keeping track of the alignment
         bool legacyNotSplit = false; //Legacy bug to override a read being split
-        Strand read_strand = feature_strand(alignment, orientation);
-        for (auto result = results->begin(); result != results->end(); ++result)
+        const Strand read_strand = Stranded ? feature_strand(alignment, orientation) : Strand::Unknown; //Unstranded reads match features on either strand
+        for (auto hit = hits.begin(); hit != hits.end(); ++hit)
         {
+            const std::size_t result = *hit;
             Feature exon;
             bool legacyFoundExon = false, legacyFoundGene = false, legacyTranscriptIntron = false, legacyTranscriptExon = false;
-            map<string, float> legacySplitDosage;
+            map<featureID, float> legacySplitDosage;
             legacyNotSplit = false;
-            if (result->type == FeatureType::Gene)
+            if (contig.type(result) == FeatureType::Gene)
             {
-                
-                if (result->strand == Strand::Forward) transcriptPlus = true;
-                else if (result->strand == Strand::Reverse) transcriptMinus = true;
+                const Strand strand = contig.strand(result);
+                if (strand == Strand::Forward) transcriptPlus = true;
+                else if (strand == Strand::Reverse) transcriptMinus = true;
                 for (auto block = blocks.begin(); block != blocks.end(); ++block)
                 {
-                    if (read_strand != Strand::Unknown && read_strand != result->strand) continue;
+                    if (Stranded && read_strand != strand) continue;
                     intragenic = true;
                     
-                    if (block->start > result->end) legacyNotExonic = true;
+                    if (block->start > contig.ends[result]) legacyNotExonic = true;
                     
                     bool firstexon = false;
                     legacyFoundExon = false;
@@ -175,20 +170,22 @@ namespace rnaseqc {
                     // No condition. just a scope to keep things clean
                     {
                         legacyFoundGene = true;
-                        for (auto ex = results->begin(); ex != results->end() && !firstexon ; ++ex)
+                        for (auto ex = hits.begin(); ex != hits.end() && !firstexon ; ++ex)
                         {
-                            if (ex->type == FeatureType::Exon && ex->gene_id == result->gene_id && intersectInterval(*ex, *block)  )
+                            if (contig.type(*ex) != FeatureType::Exon || contig.genes[*ex] != contig.genes[result]) continue;
+                            const Feature candidate = contig.get(*ex);
+                            if (intersectInterval(candidate, *block))
                             {
-                                if (result->ribosomal) ribosomal = true;
-                                if (partialIntersect(*ex, *block) == (block->end - block->start))
+                                if (contig.ribosomal(result)) ribosomal = true;
+                                if (partialIntersect(candidate, *block) == (block->end - block->start))
                                 {
-                                    exon = *ex;
+                                    exon = candidate;
                                     legacyTranscriptExon = true;
                                     firstexon = true;
                                     legacyFoundExon=true; //should this be part of the loop condition?  look into overlapsIntronp
-                                    baseCoverage.add(*ex, block->start, block->end);
+                                    baseCoverage.add(candidate, block->start, block->end);
                                 }
-                                else if (partialIntersect(*ex, *block) > 0)
+                                else if (partialIntersect(candidate, *block) > 0)
                                 {
                                     legacyTranscriptIntron = true;
                                 }
@@ -216,23 +213,24 @@ namespace rnaseqc {
                         {
                             for (auto coverage = legacySplitDosage.begin(); coverage != legacySplitDosage.end(); ++coverage)
                             {
-                                exonCounts[coverage->first] += coverage->second;
+                                counts.exonCounts[exonOrdinals[coverage->first]] += coverage->second;
                                 //                        cout << "\t" << coverage->first << " " << coverage->second;
                             }
                         }
                         else
                         {
                             //If read was not detected as split or the legacy bug changed it to unsplit, only record last exon
-                            exonCounts[exon.feature_id] += 1.0;
+                            counts.exonCounts[exonOrdinals[exon.feature_id]] += 1.0;
                             //                    cout << "\t" << exon.feature_id<< " 1.0";
                         }
-                        geneCounts[exon.gene_id] += 1.0;
-                        if (fragmentTracker[exon.gene_id].count(alignment.Qname()) == 0)
+                        const uint32_t gene = geneOrdinals[exon.gene_id]; //Genes without a gene line are counted, but never reported
+                        if (gene != NOT_LISTED) counts.geneCounts[gene] += 1.0;
+                        if (counts.fragmentTracker[exon.gene_id].count(alignment.Qname()) == 0)
                         {
-                            fragmentTracker[exon.gene_id].insert(alignment.Qname());
-                            geneFragmentCounts[exon.gene_id]++;
+                            counts.fragmentTracker[exon.gene_id].insert(alignment.Qname());
+                            if (gene != NOT_LISTED) counts.geneFragmentCounts[gene]++;
                         }
-                        if (!alignment.DuplicateFlag()) uniqueGeneCounts[exon.gene_id]++;
+                        if (!alignment.DuplicateFlag() && gene != NOT_LISTED) counts.uniqueGeneCounts[gene]++;
                         baseCoverage.commit(exon.gene_id);
                     }
                     doExonMetrics = true;
@@ -243,61 +241,60 @@ namespace rnaseqc {
             
         }
         //    cout << endl;
-        delete results; //clean up dynamic allocation
         
         if (legacyNotExonic || legacyJunction || !exonic) //a.k.a: No exons were detected at all on any block of the read
         {
             if (intragenic)
             {
-                counter.increment("Intronic Reads");
-                counter.increment("Intragenic Reads");
+                counter.increment(Metrics::IntronicReads);
+                counter.increment(Metrics::IntragenicReads);
                 if (highQuality){
-                    counter.increment("HQ Intronic Reads");
-                    counter.increment("HQ Intragenic Reads");
+                    counter.increment(Metrics::HQIntronicReads);
+                    counter.increment(Metrics::HQIntragenicReads);
                 }
             }
             else
             {
-                counter.increment("Intergenic Reads");
-                if (highQuality) counter.increment("HQ Intergenic Reads");
+                counter.increment(Metrics::IntergenicReads);
+                if (highQuality) counter.increment(Metrics::HQIntergenicReads);
             }
         }
         else if (doExonMetrics && !legacyJunction && !legacyNotExonic) //if exons were detected and at least one exon ended up being collected, we count this as exonic
         {
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(Metrics::ExonicReads);
+            counter.increment(Metrics::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(Metrics::HQExonicReads);
+                counter.increment(Metrics::HQIntragenicReads);
             }
-            if (split && !legacyNotSplit) counter.increment("Split Reads");
+            if (split && !legacyNotSplit) counter.increment(Metrics::SplitReads);
         }
         else if (intragenic)
         {
             //It's unclear how to properly classify these reads
             //However, the legacy tool falls back on reads being exonic
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(Metrics::ExonicReads);
+            counter.increment(Metrics::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(Metrics::HQExonicReads);
+                counter.increment(Metrics::HQIntragenicReads);
             }
         }
-        if (ribosomal) counter.increment("rRNA Reads");
+        if (ribosomal) counter.increment(Metrics::RRNAReads);
         //also record strandedness counts
-        if ((transcriptMinus ^ transcriptPlus) && (singleEnd || alignment.PairedFlag()))
+        if ((transcriptMinus ^ transcriptPlus) && (SingleEnd || alignment.PairedFlag()))
         {
-            if (singleEnd || alignment.FirstFlag())
+            if (SingleEnd || alignment.FirstFlag())
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
-                else transcriptPlus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(Metrics::End1Sense) : counter.increment(Metrics::End1Antisense);
+                else transcriptPlus ? counter.increment(Metrics::End1Sense) : counter.increment(Metrics::End1Antisense);
             }
             else
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
-                else transcriptPlus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(Metrics::End2Sense) : counter.increment(Metrics::End2Antisense);
+                else transcriptPlus ? counter.increment(Metrics::End2Sense) : counter.increment(Metrics::End2Antisense);
             }
         }
         baseCoverage.reset();
@@ -305,101 +302,140 @@ namespace rnaseqc {
     
     // New version of exon metrics
     // More efficient and less buggy
-    void exonAlignmentMetrics(map<chrom, list<Feature>> &features, Metrics &counter, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, const bool highQuality, const bool singleEnd)
+    template <bool Stranded, bool SingleEnd>
+    void exonAlignmentMetrics(ContigFeatures &contig, Metrics &counter, vector<Block> &blocks, vector<std::size_t> &hits, ReadScratch &scratch, Alignment &alignment, unsigned int length, Strand orientation, BaseCoverage &baseCoverage, FeatureCounts &counts, const bool highQuality)
     {
-        string chrName = sequenceTable[alignment.ChrID()].Name;
-        chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand name
-        
-        //Bamtools uses 0-based indexing because it's the 'norm' in computer science, even though bams are 1-based
-        Feature current; //current block of the alignment (used while iterating)
-        current.start = alignment.Position()+1; //0-based + 1 == 1-based
-        current.end = alignment.PositionEnd(); //0-based, open == 1-based, closed
-        
-        vector<set<string> > genes; //each set is the set of genes intersected by the current block (one set per block)
-        Collector exonCoverageCollector(&exonCounts); //Collects coverage counts for later (counts may be discarded)
         bool intragenic = false, transcriptPlus = false, transcriptMinus = false, ribosomal = false, doExonMetrics = false, exonic = false; //various booleans for keeping track of the alignment
         
-        Strand read_strand = feature_strand(alignment, orientation);
+        const Strand read_strand = Stranded ? feature_strand(alignment, orientation) : Strand::Unknown; //Unstranded reads match features on either strand
         
-        for (auto block = blocks.begin(); block != blocks.end(); ++block)
+        //Most reads don't touch an exon at all. If each block lies within a single segment without exons,
+        //the read can be classified from the segment map, without collecting any coverage
+        bool exonFree = !blocks.empty();
+        for (auto block = blocks.begin(); exonFree && block != blocks.end(); ++block)
         {
-            genes.push_back(set<string>()); //create a new set for this block
-            list<Feature> *results = intersectBlock(*block, features[chr]); //grab the list of intersecting features
-            for (auto result = results->begin(); result != results->end(); ++result)
+            const uint32_t segment = contig.segment(block->start, block->end);
+            exonFree = segment != ContigFeatures::NO_SEGMENT && (contig.classTags[segment] == Intergenic || contig.classTags[segment] == Intronic);
+        }
+        
+        if (exonFree)
+        {
+            for (auto block = blocks.begin(); block != blocks.end(); ++block)
             {
-                if (read_strand != Strand::Unknown && read_strand != result->strand) continue;
-                if (result->strand == Strand::Forward) transcriptPlus = true;
-                else if (result->strand == Strand::Reverse) transcriptMinus = true;
-                //else...what, exactly?
-                if (result->type == FeatureType::Exon)
-                {
-                    exonic = true;
-                    int intersectionSize = partialIntersect(*result, *block);
-                    //check that this block fully overlaps the feature
-                    //(if any bases of the block don't overlap, then the read is discarded)
-                    if (intersectionSize == block->end - block->start)
-                    {
-                        //store the exon split dosage coverage in the collector for now
-                        genes.rbegin()->insert(result->gene_id);
-                        double tmp = static_cast<double>(intersectionSize) / length;
-                        exonCoverageCollector.add(result->gene_id, result->feature_id, tmp);
-                        baseCoverage.add(*result, block->start, block->end); //provisionally add per-base coverage to this gene
-                        
-                    }
-                    
-                }
-                else if (result->type == FeatureType::Gene)
+                const uint32_t segment = contig.segment(block->start, block->end);
+                for (uint32_t i = contig.classOffsets[segment]; i < contig.classOffsets[segment + 1]; ++i)
                 {
+                    const std::size_t gene = contig.classFeatures[i];
+                    if (gene < contig.cursor) continue;
+                    const Strand strand = contig.strand(gene);
+                    if (Stranded && read_strand != strand) continue;
+                    if (strand == Strand::Forward) transcriptPlus = true;
+                    else if (strand == Strand::Reverse) transcriptMinus = true;
                     intragenic = true;
-                    //we don't record the gene name here because in terms of gene coverage and detection, we only care about exons
-                    
+                    if (contig.ribosomal(gene)) ribosomal = true;
                 }
-                if (result->ribosomal) ribosomal = true;
             }
-            delete results; //clean up dynamic allocation
+            //No genes were counted, so this can't be a globin read
+            counter.increment(Metrics::NonGlobinReads);
+            if (alignment.DuplicateFlag()) counter.increment(Metrics::NonGlobinDuplicateReads);
         }
-        
-        if (genes.size() >= 1)
+        else
         {
-            //if there was more than one block, iterate through each block's set of genes and intersect them
-            //In the end, we only care about genes that are common to each block
-            //In theory, there's only one gene per block (in most cases) but I won't limit us on that assumption
-            set<string> last = genes.front();
-            for (int i = 1; i < genes.size(); ++i)
-            {
-                set<string> tmp;
-                set_intersection(last.begin(), last.end(), genes[i].begin(), genes[i].end(), inserter(tmp, tmp.begin()));
-                last = tmp;
-            }
-            //after the intersection, iterate over the remaining genes and record their coverage
-            //at this point, "last" contains the set of genes which were unamgiguously aligned to
-            for (auto gene = last.begin(); gene != last.end(); ++gene)
+            Collector &exonCoverageCollector = scratch.exonCoverage;
+            exonCoverageCollector.reset();
+            if (scratch.blockGenes.size() < blocks.size()) scratch.blockGenes.resize(blocks.size());
+            for (auto block = blocks.begin(); block != blocks.end(); ++block)
             {
-                if (highQuality) {
-                    if (exonCoverageCollector.queryGene(*gene))
+                vector<featureID> &blockGenes = scratch.blockGenes[block - blocks.begin()]; //the genes intersected by the current block (one per block)
+                blockGenes.clear();
+                intersectBlock(*block, contig, hits); //grab the intersecting features
+                for (auto hit = hits.begin(); hit != hits.end(); ++hit)
+                {
+                    const Strand strand = contig.strand(*hit);
+                    if (Stranded && read_strand != strand) continue;
+                    if (strand == Strand::Forward) transcriptPlus = true;
+                    else if (strand == Strand::Reverse) transcriptMinus = true;
+                    //else...what, exactly?
+                    const FeatureType type = contig.type(*hit);
+                    if (type == FeatureType::Exon)
                     {
-                        geneCounts[*gene]++;
-                        if (fragmentTracker[*gene].count(alignment.Qname()) == 0)
+                        exonic = true;
+                        const Feature result = contig.get(*hit);
+                        int intersectionSize = partialIntersect(result, *block);
+                        //check that this block fully overlaps the feature
+                        //(if any bases of the block don't overlap, then the read is discarded)
+                        if (intersectionSize == block->end - block->start)
                         {
-                            fragmentTracker[*gene].insert(alignment.Qname());
-                            geneFragmentCounts[*gene]++;
+                            //store the exon split dosage coverage in the collector for now
+                            auto pos = std::lower_bound(blockGenes.begin(), blockGenes.end(), result.gene_id);
+                            if (pos == blockGenes.end() || *pos != result.gene_id) blockGenes.insert(pos, result.gene_id);
+                            double tmp = static_cast<double>(intersectionSize) / length;
+                            exonCoverageCollector.add(result.gene_id, result.feature_id, tmp);
+                            baseCoverage.add(result, block->start, block->end); //provisionally add per-base coverage to this gene
+                        
                         }
-                        if (!alignment.DuplicateFlag()) uniqueGeneCounts[*gene]++;
+                        
                     }
-                    exonCoverageCollector.collect(*gene); //collect and keep exon coverage for this gene
-                    baseCoverage.commit(*gene); //keep the per-base coverage recorded on this gene
+                    else if (type == FeatureType::Gene)
+                    {
+                        intragenic = true;
+                        //we don't record the gene name here because in terms of gene coverage and detection, we only care about exons
+                    
+                    }
+                    if (contig.ribosomal(*hit)) ribosomal = true;
                 }
-                doExonMetrics = true;
             }
-            //check if this is a globin read
-            set<string> globinIntersection, unambiguousGeneNames;
-            for (const string& gene_id : last) unambiguousGeneNames.insert(geneNames[gene_id]); // translate set of gene_ids to set of gene names
-            set_intersection(unambiguousGeneNames.begin(), unambiguousGeneNames.end(), blacklistedGlobins.begin(), blacklistedGlobins.end(), inserter(globinIntersection, globinIntersection.begin()));
-            if (globinIntersection.empty())
+            
+            if (blocks.size() >= 1)
             {
-                // no unambiguous intersections with globins
-                counter.increment("Non-Globin Reads");
-                if (alignment.DuplicateFlag()) counter.increment("Non-Globin Duplicate Reads");
+                //if there was more than one block, iterate through each block's set of genes and intersect them
+                //In the end, we only care about genes that are common to each block
+                //In theory, there's only one gene per block (in most cases) but I won't limit us on that assumption
+                vector<featureID> &last = scratch.commonGenes;
+                last.assign(scratch.blockGenes.front().begin(), scratch.blockGenes.front().end());
+                for (std::size_t i = 1; i < blocks.size() && !last.empty(); ++i) //once no gene is left, later blocks can't add one back
+                {
+                    //Both lists are sorted, so the intersection can be merged in place
+                    const vector<featureID> &genes = scratch.blockGenes[i];
+                    auto kept = last.begin();
+                    auto other = genes.begin();
+                    for (auto gene = last.begin(); gene != last.end() && other != genes.end(); ++gene)
+                    {
+                        while (other != genes.end() && *other < *gene) ++other;
+                        if (other != genes.end() && *other == *gene) *kept++ = *gene;
+                    }
+                    last.erase(kept, last.end());
+                }
+                //after the intersection, iterate over the remaining genes and record their coverage
+                //at this point, "last" contains the set of genes which were unamgiguously aligned to
+                for (auto gene = last.begin(); gene != last.end(); ++gene)
+                {
+                    if (highQuality) {
+                        if (exonCoverageCollector.queryGene(*gene))
+                        {
+                            const uint32_t ordinal = geneOrdinals[*gene]; //Genes without a gene line are counted, but never reported
+                            if (ordinal != NOT_LISTED) counts.geneCounts[ordinal]++;
+                            if (counts.fragmentTracker[*gene].count(alignment.Qname()) == 0)
+                            {
+                                counts.fragmentTracker[*gene].insert(alignment.Qname());
+                                if (ordinal != NOT_LISTED) counts.geneFragmentCounts[ordinal]++;
+                            }
+                            if (!alignment.DuplicateFlag() && ordinal != NOT_LISTED) counts.uniqueGeneCounts[ordinal]++;
+                        }
+                        exonCoverageCollector.collect(*gene); //collect and keep exon coverage for this gene
+                        baseCoverage.commit(*gene); //keep the per-base coverage recorded on this gene
+                    }
+                    doExonMetrics = true;
+                }
+                //check if this is a globin read
+                bool globin = false;
+                for (auto gene = last.begin(); gene != last.end() && !globin; ++gene) globin = *gene < globins.size() && globins[*gene];
+                if (!globin)
+                {
+                    // no unambiguous intersections with globins
+                    counter.increment(Metrics::NonGlobinReads);
+                    if (alignment.DuplicateFlag()) counter.increment(Metrics::NonGlobinDuplicateReads);
+                }
             }
         }
         
@@ -407,27 +443,27 @@ namespace rnaseqc {
         {
             if (intragenic)
             {
-                counter.increment("Intronic Reads");
-                counter.increment("Intragenic Reads");
+                counter.increment(Metrics::IntronicReads);
+                counter.increment(Metrics::IntragenicReads);
                 if (highQuality){
-                    counter.increment("HQ Intronic Reads");
-                    counter.increment("HQ Intragenic Reads");
+                    counter.increment(Metrics::HQIntronicReads);
+                    counter.increment(Metrics::HQIntragenicReads);
                 }
             }
             else
             {
-                counter.increment("Intergenic Reads");
-                if (highQuality) counter.increment("HQ Intergenic Reads");
+                counter.increment(Metrics::IntergenicReads);
+                if (highQuality) counter.increment(Metrics::HQIntergenicReads);
             }
         }
         else if (doExonMetrics) //if exons were detected and at least one exon ended up being collected, we count this as exonic
         {
-            counter.increment("Exonic Reads");
-            counter.increment("Intragenic Reads");
+            counter.increment(Metrics::ExonicReads);
+            counter.increment(Metrics::IntragenicReads);
             if (highQuality)
             {
-                counter.increment("HQ Exonic Reads");
-                counter.increment("HQ Intragenic Reads");
+                counter.increment(Metrics::HQExonicReads);
+                counter.increment(Metrics::HQIntragenicReads);
             }
         }
         else
@@ -435,56 +471,67 @@ namespace rnaseqc {
             //It's unclear how to properly classify these reads
             //They had exon coverage, but aligned to multiple genes
             //Any exon and gene coverage they had was discarded and not recorded
-            counter.increment("Ambiguous Reads");
-            if (highQuality) counter.increment("HQ Ambiguous Reads");
+            counter.increment(Metrics::AmbiguousReads);
+            if (highQuality) counter.increment(Metrics::HQAmbiguousReads);
         }
-        if (ribosomal) counter.increment("rRNA Reads");
+        if (ribosomal) counter.increment(Metrics::RRNAReads);
         //also record strandedness counts
         //TODO: check standing metrics.  Counts are probably off because of null intron/exon calls
-        if ((transcriptMinus ^ transcriptPlus) && (singleEnd || alignment.PairedFlag()))
+        if ((transcriptMinus ^ transcriptPlus) && (SingleEnd || alignment.PairedFlag()))
         {
-            if (singleEnd || alignment.FirstFlag())
+            if (SingleEnd || alignment.FirstFlag())
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
-                else transcriptPlus ? counter.increment("End 1 Sense") : counter.increment("End 1 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(Metrics::End1Sense) : counter.increment(Metrics::End1Antisense);
+                else transcriptPlus ? counter.increment(Metrics::End1Sense) : counter.increment(Metrics::End1Antisense);
             }
             else
             {
-                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
-                else transcriptPlus ? counter.increment("End 2 Sense") : counter.increment("End 2 Antisense");
+                if (alignment.ReverseFlag()) transcriptMinus ? counter.increment(Metrics::End2Sense) : counter.increment(Metrics::End2Antisense);
+                else transcriptPlus ? counter.increment(Metrics::End2Sense) : counter.increment(Metrics::End2Antisense);
             }
         }
         baseCoverage.reset();
     }
     
+    template void exonAlignmentMetrics<false, false>(ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, ReadScratch&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void exonAlignmentMetrics<false, true>(ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, ReadScratch&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void exonAlignmentMetrics<true, false>(ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, ReadScratch&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void exonAlignmentMetrics<true, true>(ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, ReadScratch&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void legacyExonAlignmentMetrics<false, false>(unsigned int, ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void legacyExonAlignmentMetrics<false, true>(unsigned int, ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void legacyExonAlignmentMetrics<true, false>(unsigned int, ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    template void legacyExonAlignmentMetrics<true, true>(unsigned int, ContigFeatures&, Metrics&, vector<Block>&, vector<std::size_t>&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
+    
     // Estimate fragment size in a read pair
-    unsigned int fragmentSizeMetrics(unsigned int doFragmentSize, map<chrom, list<Feature>> *bedFeatures, map<string, FragmentMateEntry> &fragments, map<long long, unsigned long> &fragmentSizes, vector<Feature> &blocks, Alignment &alignment, SeqLib::HeaderSequenceVector &sequenceTable)
+    unsigned int fragmentSizeMetrics(unsigned int doFragmentSize, ContigFeatures &contig, map<string, FragmentMateEntry> &fragments, vector<long long> &fragmentSizes, vector<Block> &blocks, vector<std::size_t> &hits, Alignment &alignment)
     {
-        string chrName = sequenceTable[alignment.ChrID()].Name;
-        chrom chr = chromosomeMap(chrName); //generate the chromosome shorthand referemce
         bool firstBlock = true, sameExon = true; //for keeping track of the alignment state
-        string exonName = ""; // the name of the intersected exon from the bed
+        featureID exonName = 0; // the ID of the intersected exon from the bed
+        bool foundExon = false;
         
-        trimFeatures(alignment, (*bedFeatures)[chr]); //trim out the features to speed up intersections
+        trimFeatures(alignment, contig); //trim out the features to speed up intersections
         for (auto block = blocks.begin(); sameExon && block != blocks.end(); ++block)
         {
             //for each block, intersect it with the bed file features
-            list<Feature> *results = intersectBlock(*block, (*bedFeatures)[chr]);
-            if (results->size() == 1 && (partialIntersect(results->front(), *block) == (block->end - block->start))) //if the block intersected more than one exon, it's immediately disqualified
+            intersectBlock(*block, contig, hits);
+            if (hits.size() == 1 && (partialIntersect(contig.get(hits.front()), *block) == (block->end - block->start))) //if the block intersected more than one exon, it's immediately disqualified
             {
-                if (firstBlock) exonName = results->begin()->feature_id; //record the exon name on the first pass
-                else if (exonName != results->begin()->feature_id) //ensure the same exon name on subsequent passes
+                if (firstBlock)
+                {
+                    //record the exon on the first pass
+                    exonName = contig.ids[hits.front()];
+                    foundExon = true;
+                }
+                else if (exonName != contig.ids[hits.front()]) //ensure the same exon name on subsequent passes
                 {
                     sameExon = false;
-                    delete results;
                     break;
                 }
             }
             else sameExon = false;
-            delete results; //clean up dynamic allocation
             firstBlock = false;
         }
-        if (sameExon && exonName.size()) //if all blocks intersected the same exon, take a fragment size sample
+        if (sameExon && foundExon) //if all blocks intersected the same exon, take a fragment size sample
         {
             //both mates in a pair have to intersected the same exon in order for the pair to qualify for the sample
             auto fragment = fragments.find(alignment.Qname());
@@ -504,14 +551,9 @@ namespace rnaseqc {
                 // 4) This read must not start at the same point as the mate. If so, without this check, the pair may be arbitrarily discarded or kept depending on sort order
                 if (alignment.MateReverseFlag() || !alignment.ReverseFlag() || alignment.PositionEnd() <= std::get<ENDPOS>(fragment->second)  || alignment.Position() == alignment.MatePosition()) return doFragmentSize;
                 //This pair is useable for fragment statistics:  both pairs fully aligned to the same exon
-                fragmentSizes[abs(alignment.InsertSize())] += 1;
+                fragmentSizes.push_back(abs(alignment.InsertSize())); //samples are kept in the order they were taken
                 fragments.erase(fragment);
                 --doFragmentSize;
-                if (!doFragmentSize)
-                {
-                    delete bedFeatures; //after taking all the samples we need, clean up the dynamic allocation
-                    bedFeatures = nullptr;
-                }
             }
         }
         //return the remaining count of fragment samples to take
@@ -17,23 +17,41 @@
 
 namespace rnaseqc {
     //Utility functions
-    unsigned int extractBlocks(Alignment&, std::vector<Feature>&, chrom, bool);
+    unsigned int extractBlocks(Alignment&, std::vector<Block>&, bool);
     //unsigned int legacyExtractBlocks(BamTools::BamAlignment&, std::vector<Feature>&, chrom);
-    std::list<Feature>* intersectBlock(Feature&, std::list<Feature>&);
-    void trimFeatures(Alignment&, std::list<Feature>&);
-    void trimFeatures(Alignment&, std::list<Feature>&, BaseCoverage&);
-    void dropFeatures(std::list<Feature>&, BaseCoverage&);
+    void intersectBlock(const Block&, ContigFeatures&, std::vector<std::size_t>&); //Fills the buffer with the positions of the intersecting features, in order
+    void trimFeatures(Alignment&, ContigFeatures&);
+    void trimFeatures(Alignment&, ContigFeatures&, BaseCoverage&, FeatureCounts&);
+    void dropFeatures(ContigFeatures&, BaseCoverage&, FeatureCounts&);
+    
+    void flagGlobins(); //Marks the genes counted as globins. Called once the annotation is loaded
     
     // Definitions for fragment tracking
-    typedef std::tuple<std::string, coord> FragmentMateEntry; // Used to record mate end point
+    typedef std::tuple<featureID, coord> FragmentMateEntry; // Used to record mate end point
     const std::size_t EXON = 0, ENDPOS = 1;
     
+    struct ReadScratch {
+        // Temporaries used to classify a read. Reset, not freed, between reads, so classification doesn't allocate once they've grown
+        std::vector<std::vector<featureID> > blockGenes; //Sorted genes whose exons contain each block. Only the first (number of blocks) are used by a read
+        std::vector<featureID> commonGenes; //Genes common to every block so far, sorted
+        Collector exonCoverage; //Collects coverage counts for later (counts may be discarded)
+        
+        ReadScratch(std::vector<double> *exonCounts) : blockGenes(), commonGenes(), exonCoverage(exonCounts)
+        {
+            
+        }
+    };
+    
     //Metrics functions
-    unsigned int fragmentSizeMetrics(unsigned int, std::map<chrom, std::list<Feature>>*, std::map<std::string, FragmentMateEntry>&, std::map<long long, unsigned long>&,std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&);
+    unsigned int fragmentSizeMetrics(unsigned int, ContigFeatures&, std::map<std::string, FragmentMateEntry>&, std::vector<long long>&, std::vector<Block>&, std::vector<std::size_t>&, Alignment&);
     
-    void exonAlignmentMetrics(std::map<chrom, std::list<Feature>>&, Metrics&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool);
+    // Exon metrics are instantiated for each library type, so the per-hit loops don't check settings which are fixed for the run.
+    // Stranded must be true when the orientation is known, and SingleEnd when unpaired reads are quantified
+    template <bool Stranded, bool SingleEnd>
+    void exonAlignmentMetrics(ContigFeatures&, Metrics&, std::vector<Block>&, std::vector<std::size_t>&, ReadScratch&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
     
-    void legacyExonAlignmentMetrics(unsigned int, std::map<chrom, std::list<Feature>>&, Metrics&, std::vector<Feature>&, Alignment&, SeqLib::HeaderSequenceVector&, unsigned int, Strand, BaseCoverage&, const bool, const bool);
+    template <bool Stranded, bool SingleEnd>
+    void legacyExonAlignmentMetrics(unsigned int, ContigFeatures&, Metrics&, std::vector<Block>&, std::vector<std::size_t>&, Alignment&, unsigned int, Strand, BaseCoverage&, FeatureCounts&, const bool);
     
     Strand feature_strand(Alignment&, Strand);
 }
@@ -13,22 +13,23 @@
 
 namespace rnaseqc {
     std::map<std::string, chrom> chromosomes;
+    std::vector<std::string> chromosomeNames(1); //ID 0 is never assigned
     
-    chrom chromosomeMap(std::string chr)
+    chrom chromosomeMap(const std::string &chr)
     {
         auto entry = chromosomes.find(chr);
-        if (entry == chromosomes.end())
-        {
-            chromosomes[chr] = chromosomes.size() + 1u;
-        }
-        return chromosomes[chr];
+        if (entry != chromosomes.end()) return entry->second;
+        const chrom id = static_cast<chrom>(chromosomeNames.size());
+        chromosomes[chr] = id;
+        chromosomeNames.push_back(chr);
+        return id;
     }
     
     //Given an internal chromosome ID, get the name it corresponds to
     std::string getChromosomeName(chrom idx)
     {
-        for (auto entry = chromosomes.begin(); entry != chromosomes.end(); ++entry) if (entry->second == idx) return entry->first;
-        throw invalidContigException("Invalid chromosome index");
+        if (idx == 0 || idx >= chromosomeNames.size()) throw invalidContigException("Invalid chromosome index");
+        return chromosomeNames[idx];
     }
     
     //Get reverse complement of a sequence
@@ -15,6 +15,8 @@
 #include <map>
 #include <unordered_map>
 #include <list>
+#include <vector>
+#include <cstdint>
 #include <bioio.hpp>
 #include <exception>
 
@@ -31,15 +33,17 @@ namespace rnaseqc {
     
     typedef long long coord;
     typedef unsigned long indexType;
-    typedef unsigned short chrom;
+    typedef uint32_t chrom; //Contig IDs start at 1, in the order contigs are first seen
     
     static const double PAGE_SIZE = 1e6; // Size of each cache page (in bases)
     static const unsigned short CACHE_SIZE = 10u; // How many pages are stored in the cache
     
     extern std::map<std::string, chrom> chromosomes;
+    extern std::vector<std::string> chromosomeNames; //Indexed by contig ID
     
     enum Strand {Forward, Reverse, Unknown};
-    chrom chromosomeMap(std::string);
+    chrom chromosomeMap(const std::string&);
+    std::string getChromosomeName(chrom);
     
     class Fasta {
         // Represents an entire fasta file
@@ -10,106 +10,372 @@
 #include <exception>
 #include <stdexcept>
 #include <unordered_set>
-#include <boost/regex.hpp>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using std::ifstream;
 using std::string;
 using std::map;
+using std::vector;
 
 namespace rnaseqc {
     const string EXON_NAME = "exon";
-    const boost::regex ribosomalPattern("rRNA"); //For recognizing features which are rRNAs
-    map<string, string> geneNames, geneSeqs;
-    map<string, coord> geneLengths, geneCodingLengths, exonLengths;
-    std::map<std::string, std::vector<std::string>> exonsForGene;
-    std::vector<std::string> geneList, exonList;
-    map<string, unsigned int> exon_names;
+    const string RIBOSOMAL_TYPE = "rRNA"; //For recognizing features which are rRNAs
+    MappedStrings featureNames, geneNames;
+    std::unordered_map<string, featureID> featureIDs; //Name -> ID, only used while parsing a GTF
+    std::vector<string> geneSeqs;
+    MappedArray<coord> geneLengths, geneCodingLengths, exonLengths;
+    MappedLists<featureID> exonsForGene;
+    MappedArray<featureID> geneList, exonList;
+    MappedArray<uint32_t> geneOrdinals, exonOrdinals;
+    map<featureID, unsigned int> exon_names;
     
+    featureID featureIndex(const string &name)
+    {
+        auto entry = featureIDs.find(name);
+        if (entry != featureIDs.end()) return entry->second;
+        const featureID id = featureNames.size();
+        featureIDs[name] = id;
+        featureNames.push_back(name);
+        geneNames.push_back(string());
+        geneSeqs.emplace_back();
+        geneLengths.push_back(0);
+        geneCodingLengths.push_back(0);
+        exonLengths.push_back(0);
+        geneOrdinals.push_back(NOT_LISTED);
+        exonOrdinals.push_back(NOT_LISTED);
+        return id;
+    }
+    
+    
+    typedef GTFReader::Token Token;
+    
+    bool Token::operator==(const char *value) const
+    {
+        return !std::strncmp(this->start, value, this->length) && value[this->length] == '\0';
+    }
+    
+    namespace {
+        const char *ATTRIBUTE_NAMES[GTFReader::NUM_ATTRIBUTES] = {"gene_id", "transcript_id", "exon_id", "gene_name", "transcript_type"};
+        
+        // Reads the next delimited field of [position, end). Like getline, this fails once the whole line has been read
+        bool nextField(const char *&position, const char *end, char delimiter, Token &field)
+        {
+            if (position >= end) return false;
+            const char *stop = static_cast<const char*>(std::memchr(position, delimiter, end - position));
+            if (stop == nullptr) stop = end;
+            field.start = position;
+            field.length = stop - position;
+            position = stop < end ? stop + 1 : end;
+            return true;
+        }
+        
+        // Returns the position just past the first newline at or after position, or end if there isn't one
+        const char* nextLine(const char *position, const char *end)
+        {
+            if (position >= end) return end;
+            const char *newline = static_cast<const char*>(std::memchr(position, '\n', end - position));
+            return newline == nullptr ? end : newline + 1;
+        }
+        
+        coord parseCoord(const Token &field)
+        {
+            coord value = 0;
+            if (field.length && field.length < 19)
+            {
+                const char *digit = field.start;
+                for (; digit < field.start + field.length && *digit >= '0' && *digit <= '9'; ++digit) value = (10 * value) + (*digit - '0');
+                if (digit == field.start + field.length) return value;
+            }
+            return std::stoull(field.str()); //Anything unusual gets the same handling as before
+        }
+        
+        // Extracts the attributes listed in ATTRIBUTE_NAMES, following the same rules as parseAttributes
+        void extractAttributes(const Token &intake, Token *attributes, bool *found)
+        {
+            std::fill(found, found + GTFReader::NUM_ATTRIBUTES, false);
+            const char *position = intake.start, *end = intake.start + intake.length;
+            Token field;
+            while (nextField(position, end, ';', field))
+            {
+                const char *stop = field.start + field.length;
+                const char *quote = static_cast<const char*>(std::memchr(field.start, '"', field.length));
+                Token key = {field.start, static_cast<std::size_t>((quote == nullptr ? stop : quote) - field.start)};
+                if (key.length) --key.length; //Drop the space before the value
+                while (key.length && (*key.start == ' ' || *key.start == '\t'))
+                {
+                    ++key.start;
+                    --key.length;
+                }
+                Token value = field;
+                if (quote != nullptr)
+                {
+                    const char *close = static_cast<const char*>(std::memchr(quote + 1, '"', stop - (quote + 1)));
+                    value.start = quote + 1;
+                    value.length = (close == nullptr ? stop : close) - value.start;
+                }
+                for (int i = 0; i < GTFReader::NUM_ATTRIBUTES; ++i) if (key == ATTRIBUTE_NAMES[i])
+                {
+                    attributes[i] = value;
+                    found[i] = true;
+                }
+            }
+        }
+        
+        // Splits one line of the GTF into its fields. Throws on invalid lines
+        void tokenizeLine(const char *position, const char *lineEnd, GTFReader::Line &out)
+        {
+            out.text = {position, static_cast<std::size_t>(lineEnd - position)};
+            Token buffer;
+            //get chr#
+            if(!nextField(position, lineEnd, '\t', out.contig)) throw gtfException("Unable to parse chromosome. Invalid GTF line: " + out.text.str());
+            //get track name
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse track. Invalid GTF line: " + out.text.str());
+            //get feature type
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse feature type. Invalid GTF line: " + out.text.str());
+            if (buffer == "exon") out.type = FeatureType::Exon;
+            else if (buffer == "gene") out.type = FeatureType::Gene;
+            else if (buffer == "transcript") out.type = FeatureType::Transcript;
+            else out.type = FeatureType::Other;
+            //get start pos
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse start. Invalid GTF line: " + out.text.str());
+            out.start = parseCoord(buffer);
+            //get stop pos
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse end. Invalid GTF line: " + out.text.str());
+            out.end = parseCoord(buffer);
+            //get score
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse score. Invalid GTF line: " + out.text.str());
+            //get strand
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse strand. Invalid GTF line: " + out.text.str());
+            switch(buffer.length ? buffer.start[0] : '\0')
+            {
+                case '+':
+                    out.strand = Strand::Forward;
+                    break;
+                case '-':
+                    out.strand = Strand::Reverse;
+                    break;
+                default:
+                    out.strand = Strand::Unknown;
+            }
+            //get frame
+            if(!nextField(position, lineEnd, '\t', buffer)) throw gtfException("Unable to parse frame. Invalid GTF line: " + out.text.str());
+            //get attributes
+            if(!nextField(position, lineEnd, '\n', buffer)) throw gtfException("Unable to parse attributes. Invalid GTF line: " + out.text.str());
+            extractAttributes(buffer, out.attributes, out.found);
+        }
+        
+        // Tokenizes every feature line of [position, end), which must start at the beginning of a line.
+        // Stops after the first line which can't be tokenized
+        void tokenizeChunk(const char *position, const char *end, std::vector<GTFReader::Line> &lines)
+        {
+            lines.clear();
+            while (position < end)
+            {
+                const char *next = nextLine(position, end);
+                const char *lineEnd = next[-1] == '\n' ? next - 1 : next;
+                if(position < lineEnd && position[0] == '#') //not a feature line
+                {
+                    position = next;
+                    continue;
+                }
+                lines.emplace_back();
+                try
+                {
+                    tokenizeLine(position, lineEnd, lines.back());
+                }
+                catch (...)
+                {
+                    lines.back().error = std::current_exception();
+                    return;
+                }
+                position = next;
+            }
+        }
+    }
+    
+    GTFReader::GTFReader(const string &filename, unsigned int threads) : data(nullptr), position(nullptr), end(nullptr), mappedSize(0u), stream(nullptr), buffer(), isOpen(false), good(false), finished(false), threads(threads), chunks(), chunk(0u), line(0u), contig(), contigID(0), feature(featureIndex("")), gene(feature), ribosomal(false), name()
+    {
+        struct stat info;
+        unsigned char magic[2];
+        // Plain text files are mapped. Anything gzipped, or which can't be mapped, is streamed through htslib.
+        // Only regular files are opened here, since a FIFO opened twice would lose whatever the first open read
+        if (!stat(filename.c_str(), &info) && S_ISREG(info.st_mode))
+        {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            if (!(pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b))
+            {
+                void *mapped = info.st_size ? mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+                if (mapped != MAP_FAILED)
+                {
+                    if (info.st_size) madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+                    this->data = this->position = static_cast<const char*>(mapped);
+                    this->end = this->data + info.st_size;
+                    this->mappedSize = info.st_size;
+                    this->finished = true;
+                }
+            }
+            ::close(fd);
+        }
+        if (!this->finished)
+        {
+            this->stream = bgzf_open(filename.c_str(), "r");
+            if (this->stream == nullptr) return;
+            if (threads && bgzf_compression(this->stream) == bgzf) bgzf_mt(this->stream, threads, 256); //Decompress bgzip blocks in parallel
+        }
+        this->isOpen = this->good = true;
+    }
     
-    ifstream& operator>>(ifstream &in, Feature &out)
+    GTFReader::~GTFReader()
     {
-        static std::unordered_set<std::string> geneIds, exonIds;
+        if (this->mappedSize) munmap(const_cast<char*>(this->data), this->mappedSize);
+        if (this->stream != nullptr) bgzf_close(this->stream);
+    }
+    
+    void GTFReader::fill(std::size_t size)
+    {
+        std::size_t length = this->end - this->position;
+        if (length) std::memmove(this->buffer.data(), this->position, length);
+        if (this->buffer.size() < size) this->buffer.resize(size);
+        while (!this->finished && length < size)
+        {
+            const ssize_t bytes = bgzf_read(this->stream, this->buffer.data() + length, size - length);
+            if (bytes < 0) throw gtfException("Unable to decompress the GTF");
+            if (bytes == 0) this->finished = true;
+            length += bytes;
+        }
+        this->data = this->position = this->buffer.data();
+        this->end = this->data + length;
+    }
+    
+    bool GTFReader::tokenize()
+    {
+        const std::size_t nChunks = this->threads + 1u;
+        const char *limit = this->end;
+        if (this->stream != nullptr)
+        {
+            // Stream a batch of text, ending at the last complete line
+            std::size_t size = nChunks * GTF_CHUNK_SIZE;
+            this->fill(size);
+            while (!this->finished && std::find(this->position, this->end, '\n') == this->end) this->fill(size *= 2); //Lines longer than a batch
+            limit = this->end;
+            if (!this->finished) while (limit[-1] != '\n') --limit;
+        }
+        else if (this->end - this->position > static_cast<std::ptrdiff_t>(nChunks * GTF_CHUNK_SIZE)) limit = nextLine(this->position + nChunks * GTF_CHUNK_SIZE, this->end);
+        if (this->position >= limit) return false;
+        // Split the batch into chunks at line boundaries, and tokenize each on its own thread
+        this->chunks.resize(nChunks);
+        std::vector<std::thread> workers;
+        const std::size_t chunkSize = (limit - this->position) / nChunks;
+        const char *start = this->position;
+        for (std::size_t i = 0; i < nChunks; ++i)
+        {
+            const char *stop = i + 1 < nChunks ? std::max(start, nextLine(this->position + (i + 1) * chunkSize - 1, limit)) : limit;
+            if (i + 1 < nChunks) workers.emplace_back(tokenizeChunk, start, stop, std::ref(this->chunks[i]));
+            else tokenizeChunk(start, stop, this->chunks[i]);
+            start = stop;
+        }
+        for (auto worker = workers.begin(); worker != workers.end(); ++worker) worker->join();
+        this->position = limit;
+        this->chunk = this->line = 0u;
+        return true;
+    }
+    
+    GTFReader& operator>>(GTFReader &in, Feature &out)
+    {
+        static std::unordered_set<featureID> geneIds, exonIds;
         try{
-            string line;
-            while(getline(in, line))
+            while (in.good)
             {
-                if(line[0] == '#') continue; //not a feature line
-                std::istringstream tokenizer(line);
-                //get chr#
-                string buffer;
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse chromosome. Invalid GTF line: " + line);
-                out.chromosome = chromosomeMap(buffer);
-                //get track name
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse track. Invalid GTF line: " + line);
-                //get feature type
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse feature type. Invalid GTF line: " + line);
-                if (buffer == "exon") out.type = FeatureType::Exon;
-                else if (buffer == "gene") out.type = FeatureType::Gene;
-                else if (buffer == "transcript") out.type = FeatureType::Transcript;
-                else out.type = FeatureType::Other;
-                //get start pos
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse start. Invalid GTF line: " + line);
-                out.start = std::stoull(buffer);
-                //get stop pos
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse end. Invalid GTF line: " + line);
-                out.end = std::stoull(buffer);
-                //get score
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse score. Invalid GTF line: " + line);
-                //get strand
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse strand. Invalid GTF line: " + line);
-                switch(buffer[0])
-                {
-                    case '+':
-                        out.strand = Strand::Forward;
-                        break;
-                    case '-':
-                        out.strand = Strand::Reverse;
-                        break;
-                    default:
-                        out.strand = Strand::Unknown;
-                }
-                //get frame
-                if(!getline(tokenizer, buffer, '\t')) throw gtfException("Unable to parse frame. Invalid GTF line: " + line);
-                //get attributes
-                if(!getline(tokenizer, buffer)) throw gtfException("Unable to parse attributes. Invalid GTF line: " + line);
-                std::map<string, string> attributes;
-                parseAttributes(buffer, attributes);
+                if (in.chunk >= in.chunks.size() || in.line >= in.chunks[in.chunk].size())
+                {
+                    if (in.chunk + 1 < in.chunks.size())
+                    {
+                        ++in.chunk;
+                        in.line = 0u;
+                    }
+                    else if (!in.tokenize()) in.good = false;
+                    continue;
+                }
+                const GTFReader::Line &line = in.chunks[in.chunk][in.line++];
+                if (line.error) std::rethrow_exception(line.error);
+                if (!(line.contig == in.contig.c_str()))
+                {
+                    in.contig.assign(line.contig.start, line.contig.length);
+                    in.contigID = chromosomeMap(in.contig);
+                }
+                out.chromosome = in.contigID;
+                out.type = line.type;
+                out.start = line.start;
+                out.end = line.end;
+                out.strand = line.strand;
+                const Token *attributes = line.attributes;
+                const bool *found = line.found;
                 if ( out.end < out.start)
                     std::cerr << "Bad feature range:" << out.start << " - " << out.end << std::endl;
-                if (out.type == FeatureType::Gene && attributes.find("gene_id") != attributes.end())
+                if (out.type == FeatureType::Gene && found[GTFReader::GeneID])
                 {
                     //Parse gene attributes
-                    out.feature_id = attributes["gene_id"];
-                    if (geneIds.count(out.feature_id)) throw gtfException(std::string("Detected non-unique Gene ID: "+out.feature_id));
-                    geneIds.insert(out.feature_id);
-                    geneLengths[out.feature_id] = out.end - out.start + 1;
-                    geneList.push_back(attributes["gene_id"]);
-                }
-                if (out.type == FeatureType::Transcript && attributes.find("transcript_id") != attributes.end()) out.feature_id = attributes["transcript_id"];
-                if (attributes.find("gene_id") != attributes.end()) out.gene_id = attributes["gene_id"];
+                    in.name.assign(attributes[GTFReader::GeneID].start, attributes[GTFReader::GeneID].length);
+                    in.feature = featureIndex(in.name);
+                    if (geneIds.count(in.feature)) throw gtfException(std::string("Detected non-unique Gene ID: "+in.name));
+                    geneIds.insert(in.feature);
+                    geneLengths.edit(in.feature) = out.end - out.start + 1;
+                    geneOrdinals.edit(in.feature) = geneList.size();
+                    geneList.push_back(in.feature);
+                }
+                if (out.type == FeatureType::Transcript && found[GTFReader::TranscriptID])
+                {
+                    in.name.assign(attributes[GTFReader::TranscriptID].start, attributes[GTFReader::TranscriptID].length);
+                    in.feature = featureIndex(in.name);
+                }
+                if (found[GTFReader::GeneID])
+                {
+                    in.name.assign(attributes[GTFReader::GeneID].start, attributes[GTFReader::GeneID].length);
+                    in.gene = featureIndex(in.name);
+                }
                 if (out.type == FeatureType::Exon)
                 {
                     //Parse exon attributes
-                    if (attributes.find("exon_id") != attributes.end())
+                    if (found[GTFReader::ExonID])
                     {
-                        out.feature_id = attributes["exon_id"];
+                        in.name.assign(attributes[GTFReader::ExonID].start, attributes[GTFReader::ExonID].length);
+                        in.feature = featureIndex(in.name);
                     }
-                    else if (attributes.find("gene_id") != attributes.end())
+                    else if (found[GTFReader::GeneID])
                     {
-                        out.feature_id = attributes["gene_id"] + "_" + std::to_string(++exon_names[attributes["gene_id"]]);
-                        std::cerr << "Unnamed exon: Gene: " << attributes["gene_id"] << " Position: [" << out.start << ", " << out.end <<  "] Inferred Exon Name: " << out.feature_id << std::endl;
+                        in.name = featureNames[in.gene] + "_" + std::to_string(++exon_names[in.gene]);
+                        in.feature = featureIndex(in.name);
+                        std::cerr << "Unnamed exon: Gene: " << featureNames[in.gene] << " Position: [" << out.start << ", " << out.end <<  "] Inferred Exon Name: " << in.name << std::endl;
                     }
-                    else throw gtfException(std::string("Exon missing exon_id and gene_id fields: " + line));
-                    if (exonIds.count(out.feature_id)) throw gtfException(std::string("Detected non-unique Exon ID: "+out.feature_id));
-                    exonIds.insert(out.feature_id);
-                    exonList.push_back(out.feature_id);
-                    geneCodingLengths[out.gene_id] += 1 + (out.end - out.start);
-                    exonLengths[out.feature_id] = 1 + (out.end - out.start);
-                }
-                if (attributes.find("transcript_type") != attributes.end()) out.transcript_type = attributes["transcript_type"];
-                if (attributes.find("gene_name") != attributes.end()) geneNames[out.feature_id] = attributes["gene_name"];
-                else if (attributes.find("gene_id") != attributes.end()) geneNames[out.feature_id] = attributes["gene_id"];
-                out.ribosomal = boost::regex_search(out.transcript_type, ribosomalPattern);
+                    else throw gtfException(std::string("Exon missing exon_id and gene_id fields: " + line.text.str()));
+                    if (exonIds.count(in.feature)) throw gtfException(std::string("Detected non-unique Exon ID: "+featureNames[in.feature]));
+                    exonIds.insert(in.feature);
+                    exonOrdinals.edit(in.feature) = exonList.size();
+                    exonList.push_back(in.feature);
+                    geneCodingLengths.edit(in.gene) += 1 + (out.end - out.start);
+                    exonLengths.edit(in.feature) = 1 + (out.end - out.start);
+                }
+                if (found[GTFReader::TranscriptType])
+                {
+                    const Token &type = attributes[GTFReader::TranscriptType];
+                    in.ribosomal = std::search(type.start, type.start + type.length, RIBOSOMAL_TYPE.begin(), RIBOSOMAL_TYPE.end()) != type.start + type.length;
+                }
+                if (found[GTFReader::GeneName]) geneNames.set(in.feature, attributes[GTFReader::GeneName].str());
+                else if (found[GTFReader::GeneID]) geneNames.set(in.feature, featureNames[in.gene]);
+                out.feature_id = in.feature;
+                out.gene_id = in.gene;
+                out.ribosomal = in.ribosomal;
                 break;
             }
             
@@ -129,6 +395,362 @@ namespace rnaseqc {
         return in;
     }
     
+    namespace {
+        const uint64_t INDEX_ALIGNMENT = 8u; //Arrays start on a multiple of this many bytes into the index, so they can be used in place
+            
+        uint64_t padding(uint64_t position)
+        {
+            return (INDEX_ALIGNMENT - position % INDEX_ALIGNMENT) % INDEX_ALIGNMENT;
+        }
+        
+        struct IndexWriter {
+            // Lays out an annotation index. Each array is its length followed by its elements, starting at an aligned offset.
+            // Tables of strings and lists are stored as an array of offsets and an array of everything end to end
+            std::ostream &out;
+            uint64_t position;
+            
+            void bytes(const void *data, std::size_t size) {
+                this->out.write(static_cast<const char*>(data), size);
+                this->position += size;
+            }
+            
+            template <typename T> void value(const T &value) {
+                static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be written directly");
+                this->bytes(&value, sizeof(T));
+            }
+            
+            template <typename T> void array(const T *values, std::size_t size) {
+                static_assert(std::is_trivially_copyable<T>::value, "Only arrays of plain values can be written directly");
+                const char zeros[INDEX_ALIGNMENT] = {};
+                this->value(static_cast<uint64_t>(size));
+                this->bytes(zeros, padding(this->position));
+                if (size) this->bytes(values, size * sizeof(T));
+            }
+            
+            template <typename T> void array(const MappedArray<T> &values) {
+                this->array(values.data(), values.size());
+            }
+            
+            template <typename Table> void strings(const Table &table) {
+                std::vector<uint64_t> offsets(1, 0u);
+                string characters;
+                for (std::size_t i = 0; i < table.size(); ++i)
+                {
+                    characters += table[i];
+                    offsets.push_back(characters.size());
+                }
+                this->array(offsets.data(), offsets.size());
+                this->array(characters.data(), characters.size());
+            }
+            
+            template <typename T> void lists(const MappedLists<T> &lists) {
+                this->array(lists.getOffsets());
+                this->array(lists.getValues());
+            }
+        };
+        
+        struct IndexReader {
+            // Reads an annotation index in place. Arrays are returned as views of the mapping, after checking that they fit in it,
+            // so a corrupt index is rejected instead of being read past its end
+            const char *start, *position, *end;
+            
+            void bytes(void *data, std::size_t size) {
+                if (size > static_cast<std::size_t>(this->end - this->position)) throw fileException("Annotation index is truncated");
+                std::memcpy(data, this->position, size);
+                this->position += size;
+            }
+            
+            template <typename T> void value(T &value) {
+                static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be read directly");
+                this->bytes(&value, sizeof(T));
+            }
+            
+            template <typename T> MappedArray<T> array() {
+                uint64_t length;
+                this->value(length);
+                const uint64_t skip = padding(this->position - this->start);
+                if (skip > static_cast<uint64_t>(this->end - this->position)) throw fileException("Annotation index is truncated");
+                this->position += skip;
+                if (length > static_cast<uint64_t>(this->end - this->position) / sizeof(T)) throw fileException("Invalid array length");
+                const T *values = reinterpret_cast<const T*>(this->position);
+                this->position += length * sizeof(T);
+                return MappedArray<T>(values, length);
+            }
+            
+            MappedArray<uint64_t> offsets(uint64_t &total) { //Offsets into an array which follows. Returns the size that array must have
+                MappedArray<uint64_t> offsets = this->array<uint64_t>();
+                if (offsets.empty() || offsets[0]) throw fileException("Invalid offsets");
+                for (std::size_t i = 1; i < offsets.size(); ++i) if (offsets[i] < offsets[i-1]) throw fileException("Invalid offsets");
+                total = offsets.back();
+                return offsets;
+            }
+            
+            MappedStrings strings() {
+                uint64_t total;
+                MappedArray<uint64_t> offsets = this->offsets(total);
+                MappedArray<char> characters = this->array<char>();
+                if (characters.size() != total) throw fileException("Invalid string table");
+                return MappedStrings(std::move(offsets), std::move(characters));
+            }
+            
+            template <typename T> MappedLists<T> lists() {
+                uint64_t total;
+                MappedArray<uint64_t> offsets = this->offsets(total);
+                MappedArray<T> values = this->array<T>();
+                if (values.size() != total) throw fileException("Invalid lists");
+                return MappedLists<T>(std::move(offsets), std::move(values));
+            }
+        };
+        
+        const uint64_t FNV_OFFSET = 14695981039346656037ull, FNV_PRIME = 1099511628211ull;
+        
+        uint64_t hashBytes(uint64_t hash, const void *data, std::size_t size)
+        {
+            const unsigned char *bytes = static_cast<const unsigned char*>(data);
+            for (std::size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * FNV_PRIME;
+            return hash;
+        }
+        
+        uint64_t hashString(uint64_t hash, const string &value)
+        {
+            const uint64_t size = value.size(); //Hashed first, so that adjacent strings can't run together
+            return hashBytes(hashBytes(hash, &size, sizeof(size)), value.data(), value.size());
+        }
+    
+        void writeContig(IndexWriter &output, chrom contig, const ContigFeatures &features)
+        {
+            output.value(contig);
+            output.value(static_cast<uint64_t>(features.cursor));
+            output.value(static_cast<int32_t>(features.indexLevel));
+            output.array(features.starts);
+            output.array(features.ends);
+            output.array(features.ids);
+            output.array(features.genes);
+            output.array(features.flags);
+            output.array(features.maxEnds);
+            output.array(features.segmentStarts);
+            output.array(features.segmentClasses);
+            output.array(features.classOffsets);
+            output.array(features.classFeatures);
+            output.array(features.classTags);
+        }
+        
+        void readContig(IndexReader &input, ContigFeatures &features)
+        {
+            //Checks everything a query could index with, so that a corrupt index can't be read out of bounds
+            uint64_t cursor;
+            int32_t indexLevel;
+            input.value(cursor);
+            input.value(indexLevel);
+            features.starts = input.array<int32_t>();
+            features.ends = input.array<int32_t>();
+            features.ids = input.array<featureID>();
+            features.genes = input.array<featureID>();
+            features.flags = input.array<uint8_t>();
+            features.maxEnds = input.array<int32_t>();
+            features.segmentStarts = input.array<coord>();
+            features.segmentClasses = input.array<uint32_t>();
+            features.classOffsets = input.array<uint32_t>();
+            features.classFeatures = input.array<uint32_t>();
+            features.classTags = input.array<uint8_t>();
+            const std::size_t size = features.starts.size(), classes = features.classTags.size();
+            if (features.ends.size() != size || features.ids.size() != size || features.genes.size() != size || features.flags.size() != size || features.maxEnds.size() != size || cursor > size) throw fileException("Invalid feature arrays");
+            if (indexLevel < -1 || indexLevel > 31 || (indexLevel >= 0 && (static_cast<uint64_t>(1) << indexLevel) > size)) throw fileException("Invalid feature tree");
+            if (features.segmentClasses.size() != features.segmentStarts.size()) throw fileException("Invalid segment map");
+            if (features.segmentStarts.empty() ? !(features.classOffsets.empty() && features.classFeatures.empty() && classes == 0) : features.classOffsets.size() != classes + 1) throw fileException("Invalid segment map");
+            for (std::size_t i = 0; i < features.classOffsets.size(); ++i)
+                if ((i ? features.classOffsets[i] < features.classOffsets[i-1] : features.classOffsets[i] != 0) || features.classOffsets[i] > features.classFeatures.size()) throw fileException("Invalid segment map");
+            if (features.classOffsets.size() && features.classOffsets.back() != features.classFeatures.size()) throw fileException("Invalid segment map");
+            for (std::size_t i = 0; i < features.classFeatures.size(); ++i) if (features.classFeatures[i] >= size) throw fileException("Invalid segment map");
+            for (std::size_t i = 0; i < classes; ++i) if (features.classTags[i] > Ambiguous) throw fileException("Invalid segment map");
+            for (std::size_t i = 0; i < features.segmentStarts.size(); ++i)
+                if (features.segmentClasses[i] >= classes || (i && features.segmentStarts[i] < features.segmentStarts[i-1])) throw fileException("Invalid segment map");
+            features.cursor = cursor;
+            features.indexLevel = indexLevel;
+        }
+    }
+    
+    bool isAnnotationIndex(const string &filename)
+    {
+        //Indexes are mapped, so only regular files can be one. Reading the magic from a FIFO would consume the start of the GTF
+        struct stat info;
+        if (stat(filename.c_str(), &info) || !S_ISREG(info.st_mode)) return false;
+        ifstream input(filename, std::ios::binary);
+        string magic(ANNOTATION_MAGIC.size(), '\0');
+        return input.read(&magic[0], magic.size()) && magic == ANNOTATION_MAGIC;
+    }
+    
+    void writeAnnotationIndex(const string &filename, const map<chrom, ContigFeatures> &features)
+    {
+        //Runs which are using an old index still have it mapped, so it's replaced rather than overwritten
+        const string partial = filename + ".partial";
+        std::ofstream output(partial, std::ios::binary);
+        if (!output.is_open()) throw fileException("Unable to open annotation index: " + filename);
+        IndexWriter index = {output, 0u};
+        index.bytes(ANNOTATION_MAGIC.data(), ANNOTATION_MAGIC.size());
+        index.value(ANNOTATION_VERSION);
+        //Contigs are written in the order they were registered, so that loading the index assigns the same IDs as parsing the GTF
+        const std::vector<string> contigs(chromosomeNames.begin() + 1, chromosomeNames.end());
+        index.strings(contigs);
+        index.strings(featureNames);
+        index.strings(geneNames);
+        index.array(geneList);
+        index.array(exonList);
+        index.array(geneOrdinals);
+        index.array(exonOrdinals);
+        index.array(geneLengths);
+        index.array(geneCodingLengths);
+        index.array(exonLengths);
+        index.lists(exonsForGene);
+        index.value(static_cast<uint64_t>(features.size()));
+        for (auto contig = features.begin(); contig != features.end(); ++contig)
+        {
+            if (contig->second.maxEnds.size() == contig->second.starts.size()) writeContig(index, contig->first, contig->second);
+            else
+            {
+                ContigFeatures indexed(contig->second);
+                indexed.index();
+                writeContig(index, contig->first, indexed);
+            }
+        }
+        output.close();
+        if (output.fail() || std::rename(partial.c_str(), filename.c_str()))
+        {
+            std::remove(partial.c_str());
+            throw fileException("Unable to write annotation index: " + filename);
+        }
+    }
+    
+    void readAnnotationIndex(const string &filename, map<chrom, ContigFeatures> &features)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw fileException("Unable to open annotation index: " + filename);
+        struct stat info;
+        void *mapped = (fstat(fd, &info) || !info.st_size) ? MAP_FAILED : mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) throw fileException("Unable to map annotation index: " + filename);
+        madvise(mapped, info.st_size, MADV_WILLNEED);
+        try
+        {
+            IndexReader input = {static_cast<const char*>(mapped), static_cast<const char*>(mapped), static_cast<const char*>(mapped) + info.st_size};
+            string magic(ANNOTATION_MAGIC.size(), '\0');
+            uint32_t version;
+            try
+            {
+                input.bytes(&magic[0], magic.size());
+                input.value(version);
+            }
+            catch (fileException &e)
+            {
+                throw fileException("Not an RNA-SeQC annotation index: " + filename);
+            }
+            if (magic != ANNOTATION_MAGIC) throw fileException("Not an RNA-SeQC annotation index: " + filename);
+            if (version != ANNOTATION_VERSION) throw fileException("Unsupported annotation index version (" + std::to_string(version) + "). Rebuild it with rnaseqc index-annotation: " + filename);
+            try
+            {
+                //The tables are only made visible once the whole index has been checked, so that a corrupt index can still be unmapped
+                const MappedStrings contigs = input.strings();
+                std::vector<chrom> contigIDs;
+                for (std::size_t i = 0; i < contigs.size(); ++i) contigIDs.push_back(chromosomeMap(contigs[i]));
+                MappedStrings names = input.strings(), symbols = input.strings();
+                MappedArray<featureID> genes = input.array<featureID>(), exons = input.array<featureID>();
+                MappedArray<uint32_t> ordinals[2] = {input.array<uint32_t>(), input.array<uint32_t>()}; //Of genes, then exons
+                MappedArray<coord> lengths = input.array<coord>(), codingLengths = input.array<coord>(), exonSizes = input.array<coord>();
+                MappedLists<featureID> geneExons = input.lists<featureID>();
+                const std::size_t nFeatures = names.size();
+                if (symbols.size() != nFeatures || ordinals[0].size() != nFeatures || ordinals[1].size() != nFeatures || lengths.size() != nFeatures || codingLengths.size() != nFeatures || exonSizes.size() != nFeatures || geneExons.size() != nFeatures) throw fileException("Invalid feature tables");
+                const MappedArray<featureID> *lists[2] = {&genes, &exons};
+                for (int table = 0; table < 2; ++table)
+                {
+                    const MappedArray<featureID> &list = *lists[table];
+                    for (uint32_t i = 0; i < list.size(); ++i) if (list[i] >= nFeatures || ordinals[table][list[i]] != i) throw fileException("Invalid feature list");
+                    for (featureID id = 0; id < nFeatures; ++id) if (ordinals[table][id] != NOT_LISTED && (ordinals[table][id] >= list.size() || list[ordinals[table][id]] != id)) throw fileException("Invalid feature list");
+                }
+                //Contigs are renumbered from the IDs of the indexing run to the IDs registered above as they're read.
+                //Lengths size the coverage of each exon, so they're checked against the features they were computed from
+                std::vector<coord> expectedCodingLengths(nFeatures, 0);
+                std::vector<uint64_t> exonCounts(nFeatures, 0u);
+                map<chrom, ContigFeatures> loaded;
+                uint64_t nContigs;
+                input.value(nContigs);
+                for (uint64_t c = 0; c < nContigs; ++c)
+                {
+                    chrom contig;
+                    input.value(contig);
+                    if (contig == 0 || contig > contigIDs.size() || loaded.count(contigIDs[contig - 1])) throw fileException("Invalid contig");
+                    ContigFeatures &contigFeatures = loaded[contigIDs[contig - 1]];
+                    readContig(input, contigFeatures);
+                    contigFeatures.chromosome = contigIDs[contig - 1];
+                    for (std::size_t i = 0; i < contigFeatures.starts.size(); ++i)
+                    {
+                        const featureID id = contigFeatures.ids[i];
+                        const coord length = 1 + (static_cast<coord>(contigFeatures.ends[i]) - contigFeatures.starts[i]);
+                        if (id >= nFeatures || contigFeatures.genes[i] >= nFeatures || (contigFeatures.type(i) == FeatureType::Exon && ordinals[1][id] == NOT_LISTED)) throw fileException("Invalid feature");
+                        if (contigFeatures.type(i) == FeatureType::Exon)
+                        {
+                            if (exonSizes[id] != length) throw fileException("Invalid exon length");
+                            expectedCodingLengths[contigFeatures.genes[i]] += length;
+                            if (i >= contigFeatures.cursor) ++exonCounts[contigFeatures.genes[i]];
+                        }
+                        else if (contigFeatures.type(i) == FeatureType::Gene && ordinals[0][id] != NOT_LISTED && lengths[id] != length) throw fileException("Invalid gene length");
+                    }
+                }
+                if (input.position != input.end) throw fileException("Unexpected data after the features");
+                if (!std::equal(expectedCodingLengths.begin(), expectedCodingLengths.end(), codingLengths.begin())) throw fileException("Invalid coding lengths");
+                for (featureID gene = 0; gene < nFeatures; ++gene)
+                {
+                    const MappedLists<featureID>::List geneExonList = geneExons[gene];
+                    if (geneExonList.size() != exonCounts[gene]) throw fileException("Invalid exon lists");
+                    for (auto exon = geneExonList.begin(); exon != geneExonList.end(); ++exon) if (*exon >= nFeatures || ordinals[1][*exon] == NOT_LISTED) throw fileException("Invalid exon lists");
+                }
+                featureNames = std::move(names);
+                geneNames = std::move(symbols);
+                geneList = std::move(genes);
+                exonList = std::move(exons);
+                geneOrdinals = std::move(ordinals[0]);
+                exonOrdinals = std::move(ordinals[1]);
+                geneLengths = std::move(lengths);
+                geneCodingLengths = std::move(codingLengths);
+                exonLengths = std::move(exonSizes);
+                exonsForGene = std::move(geneExons);
+                features.swap(loaded);
+                featureIDs.clear(); //Names are only looked up while parsing a GTF
+                geneSeqs.clear(); //Filled in if a FASTA is provided
+            }
+            catch (fileException &e)
+            {
+                throw fileException("Annotation index is truncated or corrupt: " + filename);
+            }
+        }
+        catch (...)
+        {
+            munmap(mapped, info.st_size);
+            throw;
+        }
+        //The tables point into the mapping now, so it stays mapped for the rest of the run
+    }
+    
+    uint64_t annotationChecksum(const map<chrom, ContigFeatures> &features)
+    {
+        //FNV-1a over names rather than IDs, so a GTF and its index give the same checksum
+        uint64_t hash = FNV_OFFSET;
+        for (auto contig = features.begin(); contig != features.end(); ++contig)
+        {
+            const ContigFeatures &contigFeatures = contig->second;
+            hash = hashString(hash, getChromosomeName(contig->first));
+            for (std::size_t i = 0; i < contigFeatures.starts.size(); ++i)
+            {
+                hash = hashString(hash, featureNames[contigFeatures.ids[i]]);
+                hash = hashString(hash, featureNames[contigFeatures.genes[i]]);
+                hash = hashBytes(hash, &contigFeatures.starts[i], sizeof(int32_t));
+                hash = hashBytes(hash, &contigFeatures.ends[i], sizeof(int32_t));
+                hash = hashBytes(hash, &contigFeatures.flags[i], sizeof(uint8_t));
+            }
+        }
+        for (auto gene = geneList.begin(); gene != geneList.end(); ++gene) hash = hashString(hash, geneNames[*gene]);
+        return hash;
+    }
+    
     std::map<std::string,std::string>& parseAttributes(std::string &intake, std::map<std::string,std::string> &attributes)
     {
         std::istringstream tokenizer(intake);
@@ -146,6 +768,178 @@ namespace rnaseqc {
         return attributes;
     }
     
+    namespace {
+        int32_t clampCoord(coord position)
+        {
+            return static_cast<int32_t>(std::max<coord>(std::min<coord>(position, std::numeric_limits<int32_t>::max()), std::numeric_limits<int32_t>::min()));
+        }
+    }
+    
+    void ContigFeatures::push_back(const Feature &feature)
+    {
+        this->starts.push_back(clampCoord(feature.start));
+        this->ends.push_back(clampCoord(feature.end));
+        this->ids.push_back(feature.feature_id);
+        this->genes.push_back(feature.gene_id);
+        this->flags.push_back(static_cast<uint8_t>(feature.strand) | static_cast<uint8_t>(feature.type << TYPE_SHIFT) | (feature.ribosomal ? RIBOSOMAL : 0u) | (feature.start == feature.end ? SINGLE_BASE : 0u));
+        this->chromosome = feature.chromosome;
+    }
+    
+    void ContigFeatures::append(const ContigFeatures &other, std::size_t i)
+    {
+        this->starts.push_back(other.starts[i]);
+        this->ends.push_back(other.ends[i]);
+        this->ids.push_back(other.ids[i]);
+        this->genes.push_back(other.genes[i]);
+        this->flags.push_back(other.flags[i]);
+        this->chromosome = other.chromosome;
+    }
+    
+    Feature ContigFeatures::get(std::size_t i) const
+    {
+        Feature feature;
+        feature.start = this->starts[i];
+        feature.end = this->ends[i];
+        feature.chromosome = this->chromosome;
+        feature.strand = this->strand(i);
+        feature.type = this->type(i);
+        feature.feature_id = this->ids[i];
+        feature.gene_id = this->genes[i];
+        feature.ribosomal = this->flags[i] & RIBOSOMAL;
+        return feature;
+    }
+    
+    void ContigFeatures::clear()
+    {
+        ContigFeatures empty;
+        empty.chromosome = this->chromosome;
+        this->swap(empty);
+    }
+    
+    void ContigFeatures::swap(ContigFeatures &other)
+    {
+        this->starts.swap(other.starts);
+        this->ends.swap(other.ends);
+        this->ids.swap(other.ids);
+        this->genes.swap(other.genes);
+        this->flags.swap(other.flags);
+        this->maxEnds.swap(other.maxEnds);
+        this->segmentStarts.swap(other.segmentStarts);
+        this->segmentClasses.swap(other.segmentClasses);
+        this->classOffsets.swap(other.classOffsets);
+        this->classFeatures.swap(other.classFeatures);
+        this->classTags.swap(other.classTags);
+        std::swap(this->cursor, other.cursor);
+        std::swap(this->chromosome, other.chromosome);
+        std::swap(this->indexLevel, other.indexLevel);
+    }
+    
+    void ContigFeatures::index()
+    {
+        //Built in memory and then moved in, since the arrays of a mapped contig are read-only
+        const std::size_t n = this->starts.size();
+        vector<int32_t> maxEnds(n, 0);
+        this->segmentStarts.clear();
+        this->segmentClasses.clear();
+        this->classOffsets.clear();
+        this->classFeatures.clear();
+        this->classTags.clear();
+        this->indexLevel = -1;
+        for (std::size_t i = 0; i < n; ++i) if (this->ends[i] < this->starts[i] || (i && this->starts[i] < this->starts[i-1]))
+        {
+            this->maxEnds = std::move(maxEnds);
+            return;
+        }
+        if (!n)
+        {
+            this->maxEnds.clear();
+            return;
+        }
+        this->indexSegments();
+        //Leaves are the even positions. Each level up, a node's subtree spans 2^level features on either side of it
+        std::size_t lastNode = 0;
+        int32_t lastEnd = 0; //Furthest end under the rightmost node of the level below, which stands in for missing right children
+        for (std::size_t i = 0; i < n; i += 2)
+        {
+            lastNode = i;
+            maxEnds[i] = lastEnd = this->ends[i];
+        }
+        int level = 1;
+        for (; (static_cast<std::size_t>(1) << level) <= n; ++level)
+        {
+            const std::size_t offset = static_cast<std::size_t>(1) << (level - 1);
+            for (std::size_t i = (offset << 1) - 1; i < n; i += offset << 2)
+            {
+                const int32_t left = maxEnds[i - offset], right = i + offset < n ? maxEnds[i + offset] : lastEnd;
+                maxEnds[i] = std::max(this->ends[i], std::max(left, right));
+            }
+            lastNode = (lastNode >> level & 1) ? lastNode - offset : lastNode + offset;
+            if (lastNode < n && maxEnds[lastNode] > lastEnd) lastEnd = maxEnds[lastNode];
+        }
+        this->maxEnds = std::move(maxEnds);
+        this->indexLevel = level - 1;
+    }
+    
+    void ContigFeatures::indexSegments()
+    {
+        //Sweep the boundaries of the features, keeping the set of features which overlap the current position
+        const std::size_t n = this->starts.size();
+        vector<uint32_t> byEnd(n);
+        for (uint32_t i = 0; i < n; ++i) byEnd[i] = i;
+        std::stable_sort(byEnd.begin(), byEnd.end(), [this](uint32_t a, uint32_t b) {
+            return this->ends[a] < this->ends[b];
+        });
+        map<vector<uint32_t>, uint32_t> classes;
+        vector<coord> segmentStarts;
+        vector<uint32_t> segmentClasses, classOffsets, classFeatures;
+        vector<uint8_t> classTags;
+        vector<uint32_t> active; //Kept in order, so that each class lists its features as a query would find them
+        auto addSegment = [&](coord position) {
+            auto entry = classes.find(active);
+            if (entry == classes.end())
+            {
+                const uint32_t id = static_cast<uint32_t>(classes.size());
+                entry = classes.emplace(active, id).first;
+                bool gene = false;
+                featureID exonGene = 0;
+                uint8_t tag = Intergenic;
+                for (auto feature = active.begin(); feature != active.end(); ++feature)
+                {
+                    if (this->type(*feature) == FeatureType::Exon)
+                    {
+                        if (tag == Exonic && this->genes[*feature] != exonGene) tag = Ambiguous;
+                        else if (tag != Ambiguous) tag = Exonic;
+                        exonGene = this->genes[*feature];
+                    }
+                    else gene = true;
+                }
+                if (tag == Intergenic && gene) tag = Intronic;
+                classOffsets.push_back(static_cast<uint32_t>(classFeatures.size()));
+                classFeatures.insert(classFeatures.end(), active.begin(), active.end());
+                classTags.push_back(tag);
+            }
+            segmentStarts.push_back(position);
+            segmentClasses.push_back(entry->second);
+        };
+        addSegment(std::numeric_limits<coord>::min()); //Everything before the first feature
+        std::size_t nextStart = 0, nextEnd = 0;
+        while (nextEnd < n)
+        {
+            //Features end after their last base, which can be past the range of a clamped coordinate
+            const coord endBoundary = static_cast<coord>(this->ends[byEnd[nextEnd]]) + 1;
+            const coord position = nextStart < n ? std::min(static_cast<coord>(this->starts[nextStart]), endBoundary) : endBoundary;
+            for (; nextEnd < n && static_cast<coord>(this->ends[byEnd[nextEnd]]) + 1 == position; ++nextEnd) active.erase(std::lower_bound(active.begin(), active.end(), byEnd[nextEnd]));
+            for (; nextStart < n && this->starts[nextStart] == position; ++nextStart) active.insert(std::upper_bound(active.begin(), active.end(), static_cast<uint32_t>(nextStart)), static_cast<uint32_t>(nextStart));
+            addSegment(position);
+        }
+        classOffsets.push_back(static_cast<uint32_t>(classFeatures.size()));
+        this->segmentStarts = std::move(segmentStarts);
+        this->segmentClasses = std::move(segmentClasses);
+        this->classOffsets = std::move(classOffsets);
+        this->classFeatures = std::move(classFeatures);
+        this->classTags = std::move(classTags);
+    }
+    
     bool operator==(const Feature &a, const Feature &b)
     {
         if (a.start != b.start) return false;
@@ -154,7 +948,7 @@ namespace rnaseqc {
         if (a.strand != b.strand) return false;
         if (a.type != b.type) return false;
         if (a.feature_id != b.feature_id) return false;
-        return a.transcript_type == b.transcript_type;
+        return a.ribosomal == b.ribosomal;
     }
     
     bool compIntervalStart(const Feature &a, const Feature &b)
@@ -172,12 +966,12 @@ namespace rnaseqc {
         return (x >= a.start) && (x <= a.end);
     }
     
-    bool intersectInterval(const Feature &a, const Feature &b)
+    bool intersectInterval(const Feature &a, const Block &b)
     {
-        return intersectPoint(a, b.start) || intersectPoint(a, b.end) || intersectPoint(b, a.start);
+        return intersectPoint(a, b.start) || intersectPoint(a, b.end) || (a.start >= b.start && a.start <= b.end);
     }
     
-    int partialIntersect(const Feature &target, const Feature &query)
+    int partialIntersect(const Feature &target, const Block &query)
     {
         return intersectInterval(target, query) ? (
                                                    1+std::min(target.end, query.end-1) - std::max(target.start, query.start)
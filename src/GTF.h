@@ -15,8 +15,16 @@
 #include <map>
 #include <utility>
 #include <vector>
+#include <list>
+#include <cstdint>
 #include <sstream>
+#include <exception>
+#include <limits>
+#include <algorithm>
+#include <htslib/hts.h>
+#include <htslib/bgzf.h>
 #include "Fasta.h"
+#include "MappedArray.h"
 
 namespace rnaseqc {
     struct gtfException : public std::exception {
@@ -25,6 +33,9 @@ namespace rnaseqc {
     };
     
     enum FeatureType {Gene, Transcript, Exon, Other};
+    enum SegmentTag {Intergenic, Intronic, Exonic, Ambiguous}; //What overlaps a segment of the genome: nothing, only genes, exons of one gene, or exons of several genes
+    
+    typedef uint32_t featureID; //Index of a gene, transcript, or exon ID in featureNames
     
     struct Feature {
         //Represents arbitrary genome features
@@ -32,25 +43,242 @@ namespace rnaseqc {
         chrom chromosome;
         Strand strand;
         FeatureType type;
-        std::string feature_id, gene_id, transcript_type;
+        featureID feature_id, gene_id;
         bool ribosomal;
     };
     
+    struct Block {
+        // One aligned segment of a read, decoded straight from the packed cigar
+        coord start, end;
+        Strand strand;
+    };
+    
+    struct ContigFeatures {
+        // The features of one contig in parallel arrays, so that the window of features scanned for each read stays in cache.
+        // Features before the cursor have been passed by the reads and are no longer in the window.
+        // Coordinates are clamped to the range of bam positions, since no read can reach past it.
+        // Every array (including the tree and segment map) can be mapped from an annotation index; only the cursor is per run
+        MappedArray<int32_t> starts, ends;
+        MappedArray<featureID> ids, genes;
+        MappedArray<uint8_t> flags; //Strand, type, and the flags below
+        MappedArray<int32_t> maxEnds; //Implicit interval tree: the furthest end in the subtree under each feature. Rebuilt when the features change
+        // Segment map, built with the tree: the contig is cut wherever the set of overlapping features changes.
+        // Segments with the same features share a class, which lists those features in order and tags them
+        MappedArray<coord> segmentStarts;
+        MappedArray<uint32_t> segmentClasses;
+        MappedArray<uint32_t> classOffsets, classFeatures; //The features of class c are classFeatures[classOffsets[c]] up to classOffsets[c+1]
+        MappedArray<uint8_t> classTags; //SegmentTag of each class
+        std::size_t cursor;
+        chrom chromosome;
+        int indexLevel; //Height of the interval tree, or -1 to scan the features linearly
+        
+        static const uint8_t STRAND_MASK = 0x03u, TYPE_SHIFT = 2u, TYPE_MASK = 0x0cu, RIBOSOMAL = 0x10u, SINGLE_BASE = 0x20u; //SINGLE_BASE: start == end before clamping
+        static const uint32_t NO_SEGMENT = std::numeric_limits<uint32_t>::max();
+        
+        ContigFeatures() : starts(), ends(), ids(), genes(), flags(), maxEnds(), segmentStarts(), segmentClasses(), classOffsets(), classFeatures(), classTags(), cursor(0u), chromosome(0), indexLevel(-1)
+        {
+            
+        }
+        
+        std::size_t size() const { //Features left in the window
+            return this->starts.size() - this->cursor;
+        }
+        
+        bool empty() const {
+            return this->cursor >= this->starts.size();
+        }
+        
+        Strand strand(std::size_t i) const {
+            return static_cast<Strand>(this->flags[i] & STRAND_MASK);
+        }
+        
+        FeatureType type(std::size_t i) const {
+            return static_cast<FeatureType>((this->flags[i] & TYPE_MASK) >> TYPE_SHIFT);
+        }
+        
+        bool ribosomal(std::size_t i) const {
+            return this->flags[i] & RIBOSOMAL;
+        }
+        
+        void pop_front() {
+            ++this->cursor;
+        }
+        
+        void push_back(const Feature&);
+        void append(const ContigFeatures&, std::size_t); //Copies one feature of another contig, keeping its flags
+        Feature get(std::size_t) const;
+        void clear(); //Drops every feature and releases the arrays
+        void swap(ContigFeatures&);
+        void index(); //Builds the interval tree and segment map. Unsorted features (from a BED) and inverted ranges are left to a linear scan
+        void indexSegments(); //Builds the segment map. Only valid for sorted features
+        
+        void refreshIndex() {
+            if (this->maxEnds.size() != this->starts.size()) this->index();
+        }
+        
+        // Class of the segment which contains all of [start, end], or NO_SEGMENT if it crosses segments (or the features aren't indexed)
+        uint32_t segment(coord start, coord end)
+        {
+            this->refreshIndex();
+            if (this->segmentStarts.empty()) return NO_SEGMENT;
+            const std::size_t next = std::upper_bound(this->segmentStarts.begin(), this->segmentStarts.end(), start) - this->segmentStarts.begin();
+            if (next == 0 || (next < this->segmentStarts.size() && this->segmentStarts[next] <= end)) return NO_SEGMENT;
+            return this->segmentClasses[next - 1];
+        }
+        
+        // Calls found(i) for every feature in the window which intersects [start, end], in order.
+        // Intervals inside a single segment are answered from the segment map. Otherwise features are laid out as an implicit
+        // interval tree (sorted by start, with each subtree's furthest end), so a query costs O(log n + hits) no matter
+        // how many long genes are still in the window
+        template <typename Callback> void intersect(coord start, coord end, Callback &&found)
+        {
+            const std::size_t n = this->starts.size();
+            const uint32_t segmentClass = this->segment(start, end);
+            if (segmentClass != NO_SEGMENT)
+            {
+                for (uint32_t i = this->classOffsets[segmentClass]; i < this->classOffsets[segmentClass + 1]; ++i) if (this->classFeatures[i] >= this->cursor) found(this->classFeatures[i]);
+                return;
+            }
+            if (this->indexLevel < 0)
+            {
+                //Scan from the front of the window, exactly as the features were read
+                for (std::size_t i = this->cursor; i < n && this->starts[i] <= end; ++i)
+                {
+                    const coord featureStart = this->starts[i], featureEnd = this->ends[i];
+                    if ((featureStart >= start && featureStart <= end) || (featureEnd >= start && featureEnd <= end) || (start >= featureStart && start <= featureEnd)) found(i);
+                }
+                return;
+            }
+            struct Node {
+                std::size_t x; //Feature at the root of the subtree
+                int level;
+                bool leftDone;
+            } stack[64];
+            int top = 0;
+            stack[top++] = {(static_cast<std::size_t>(1) << this->indexLevel) - 1, this->indexLevel, false};
+            while (top)
+            {
+                const Node node = stack[--top];
+                if (node.level <= 3)
+                {
+                    //Small subtrees are cheaper to scan
+                    std::size_t i = node.x >> node.level << node.level, last = i + (static_cast<std::size_t>(1) << (node.level + 1)) - 1;
+                    if (last > n) last = n;
+                    for (; i < last && this->starts[i] <= end; ++i) if (this->ends[i] >= start && i >= this->cursor) found(i);
+                }
+                else if (!node.leftDone)
+                {
+                    const std::size_t left = node.x - (static_cast<std::size_t>(1) << (node.level - 1));
+                    stack[top++] = {node.x, node.level, true};
+                    if (left >= n || this->maxEnds[left] >= start) stack[top++] = {left, node.level - 1, false};
+                }
+                else if (node.x < n && this->starts[node.x] <= end)
+                {
+                    if (this->ends[node.x] >= start && node.x >= this->cursor) found(node.x);
+                    stack[top++] = {node.x + (static_cast<std::size_t>(1) << (node.level - 1)), node.level - 1, false};
+                }
+            }
+        }
+    };
+    
     //For comparing features
     bool operator==(const Feature &a, const Feature &b);
     bool compIntervalStart(const Feature&, const Feature&);
     bool compIntervalEnd(const Feature&, const Feature&);
     bool intersectPoint(const Feature&, const coord);
-    bool intersectInterval(const Feature&, const Feature&);
-    int partialIntersect(const Feature&, const Feature&);
+    bool intersectInterval(const Feature&, const Block&);
+    int partialIntersect(const Feature&, const Block&);
+    
+    
+    // Feature IDs are interned when the annotation is loaded, and the name of each is only looked up for output.
+    // Every table below is indexed by feature ID and has an entry for every name in featureNames.
+    // The tables are mapped straight from an annotation index when one is loaded
+    extern MappedStrings featureNames, geneNames;
+    extern std::vector<std::string> geneSeqs; //Only filled in when a FASTA is provided
+    extern MappedArray<coord> geneLengths, geneCodingLengths, exonLengths;
+    extern MappedArray<featureID> geneList, exonList;
+    extern MappedArray<uint32_t> geneOrdinals, exonOrdinals; //Position of each feature in geneList and exonList, or NOT_LISTED
+    
+    const uint32_t NOT_LISTED = std::numeric_limits<uint32_t>::max();
+    extern MappedLists<featureID> exonsForGene; //Exons of each gene, in the order of the features. Built once the annotation is loaded
+    
+    featureID featureIndex(const std::string&); //Returns the ID of a feature name, registering it if it's new. Only safe while parsing a GTF
+    
+    const std::size_t GTF_CHUNK_SIZE = 4u << 20; // Bytes of the GTF tokenized by each thread at a time
+    
+    class GTFReader {
+        // Reads features straight out of a memory mapped GTF.
+        // Lines are tokenized in place and only the attributes RNA-SeQC uses are extracted, so reading a feature doesn't allocate
+        // Compressed GTFs (gzip or bgzip) and FIFOs are streamed through htslib into a buffer instead.
+        // Text is tokenized in chunks, one per thread, and features are registered in file order as they are read
+    public:
+        struct Token {
+            // A field of a line, pointing into the GTF text
+            const char *start;
+            std::size_t length;
+            
+            bool operator==(const char*) const;
+            std::string str() const {
+                return std::string(this->start, this->length);
+            }
+        };
+        
+        enum Attribute {GeneID, TranscriptID, ExonID, GeneName, TranscriptType, NUM_ATTRIBUTES};
+        
+        struct Line {
+            // A tokenized feature line. Registering the feature is left to operator>>, since that depends on the lines before it
+            Token text, contig;
+            coord start, end;
+            Strand strand;
+            FeatureType type;
+            Token attributes[NUM_ATTRIBUTES];
+            bool found[NUM_ATTRIBUTES];
+            std::exception_ptr error; // Set if the line couldn't be tokenized. Raised when the line is read
+        };
+    
+    private:
+        const char *data, *position, *end;
+        std::size_t mappedSize; // 0 if the file is streamed into the buffer instead of mapped
+        BGZF *stream;
+        std::vector<char> buffer;
+        bool isOpen, good, finished; // finished: The whole stream has been read into the buffer
+        unsigned int threads; // Additional threads used to decompress and tokenize the GTF
+        std::vector<std::vector<Line> > chunks; // Lines of the current batch
+        std::size_t chunk, line; // Next line to read from the batch
+        std::string contig; // Name of the last contig seen, so that it's only looked up when it changes
+        chrom contigID;
+        featureID feature, gene; // IDs of the last feature and gene, which carry over to lines that don't set them
+        bool ribosomal; // Whether the last transcript_type was an rRNA. Also carries over
+        std::string name; // Scratch space for looking up IDs
+        void fill(std::size_t); // Moves unread text to the front of the buffer and streams more, up to the given size
+        bool tokenize(); // Tokenizes the next batch of lines. Returns false at the end of the file
+        GTFReader(const GTFReader&) = delete;
+        friend GTFReader& operator>>(GTFReader&, Feature&);
+    public:
+        GTFReader(const std::string&, unsigned int threads = 0u);
+        ~GTFReader();
+        bool is_open() const {
+            return this->isOpen;
+        }
+        
+        explicit operator bool() const {
+            return this->good;
+        }
+    };
     
+    GTFReader& operator>>(GTFReader&, Feature&);
     
-    extern std::map<std::string, std::string> geneNames, geneSeqs;
-    extern std::map<std::string, coord> geneLengths, geneCodingLengths, exonLengths;
-    extern std::vector<std::string> geneList, exonList;
-    extern std::map<std::string, std::vector<std::string>> exonsForGene;
+    const std::string ANNOTATION_MAGIC = "RNASEQC-ANNOTATION";
+    const uint32_t ANNOTATION_VERSION = 5u; //Increment whenever the layout of annotation index files changes
     
-    std::ifstream& operator>>(std::ifstream&, Feature&);
+    // Annotation index files hold the features and tables parsed from a GTF, so that runs can load them instead of parsing the GTF again.
+    // Features are stored sorted and indexed, and before legacy mode filters out single base features. Feature IDs are kept as they were assigned while parsing.
+    // Every table is laid out as an aligned array, so loading an index maps the file read-only and points the tables into it:
+    // concurrent runs share the same page cache pages instead of each holding a copy of the annotation
+    bool isAnnotationIndex(const std::string&);
+    void writeAnnotationIndex(const std::string&, const std::map<chrom, ContigFeatures>&); //Writes a new file and renames it over the old one, so runs which mapped the old index keep it
+    void readAnnotationIndex(const std::string&, std::map<chrom, ContigFeatures>&); //Registers the contigs of the index and maps the GTF tables. Must be loaded before any other features
+    uint64_t annotationChecksum(const std::map<chrom, ContigFeatures>&); //Identifies the loaded annotation, so that state files are only combined with the one they were written against
     std::map<std::string,std::string>& parseAttributes(std::string&, std::map<std::string,std::string>&);
 }
 
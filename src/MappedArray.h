@@ -0,0 +1,210 @@
+//
+//  MappedArray.h
+//  RNA-SeQC
+//
+//
+
+#ifndef MappedArray_h
+#define MappedArray_h
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+namespace rnaseqc {
+    // Annotation tables are either built in memory while parsing a GTF, or point straight into the read-only mapping of an
+    // annotation index, which stays mapped for the rest of the run. Copies of a mapped table share the mapping.
+    // Reads never check which it is. Writing to a mapped table first copies it into memory, so that only tables which
+    // actually change (like the coding lengths in legacy mode) stop being shared
+    
+    template <typename T> class MappedArray {
+        static_assert(std::is_trivially_copyable<T>::value, "Only arrays of plain values can be mapped");
+        std::vector<T> owned;
+        const T *elements; // owned.data(), or the mapping
+        std::size_t count;
+        bool mapped;
+        
+        void sync() {
+            this->elements = this->owned.data();
+            this->count = this->owned.size();
+        }
+        
+        void own() {
+            if (!this->mapped) return;
+            this->owned.assign(this->elements, this->elements + this->count);
+            this->mapped = false;
+            this->sync();
+        }
+    public:
+        MappedArray() : owned(), elements(nullptr), count(0u), mapped(false) {
+            
+        }
+        
+        MappedArray(const T *data, std::size_t size) : owned(), elements(data), count(size), mapped(true) {
+            
+        }
+        
+        MappedArray(std::vector<T> &&values) : owned(std::move(values)), elements(nullptr), count(0u), mapped(false) {
+            this->sync();
+        }
+        
+        MappedArray(const MappedArray &other) : owned(other.owned), elements(other.elements), count(other.count), mapped(other.mapped) {
+            if (!this->mapped) this->sync();
+        }
+        
+        MappedArray(MappedArray &&other) noexcept : owned(std::move(other.owned)), elements(other.elements), count(other.count), mapped(other.mapped) {
+            if (!this->mapped) this->sync();
+            other.mapped = false;
+            other.sync();
+        }
+        
+        MappedArray& operator=(MappedArray other) noexcept {
+            this->swap(other);
+            return *this;
+        }
+        
+        void swap(MappedArray &other) noexcept {
+            this->owned.swap(other.owned); // Swapping vectors keeps their buffers, so the element pointers stay valid
+            std::swap(this->elements, other.elements);
+            std::swap(this->count, other.count);
+            std::swap(this->mapped, other.mapped);
+        }
+        
+        std::size_t size() const { return this->count; }
+        bool empty() const { return !this->count; }
+        bool isMapped() const { return this->mapped; }
+        const T* data() const { return this->elements; }
+        const T* begin() const { return this->elements; }
+        const T* end() const { return this->elements + this->count; }
+        const T& operator[](std::size_t i) const { return this->elements[i]; }
+        const T& back() const { return this->elements[this->count - 1]; }
+        
+        const T& at(std::size_t i) const {
+            if (i >= this->count) throw std::out_of_range("Annotation table index out of range");
+            return this->elements[i];
+        }
+        
+        T& edit(std::size_t i) { // Writable element. Copies a mapped array into memory first
+            this->own();
+            return this->owned[i];
+        }
+        
+        void push_back(const T &value) {
+            this->own();
+            this->owned.push_back(value);
+            this->sync();
+        }
+        
+        void clear() { // Drops the elements and releases the memory
+            MappedArray empty;
+            this->swap(empty);
+        }
+    };
+    
+    class MappedStrings {
+        // A table of strings. Mapped tables hold the characters of every string end to end, and the offset of each string.
+        // Strings are returned by value, since a mapped string isn't terminated
+        std::vector<std::string> owned;
+        MappedArray<uint64_t> offsets; // String i is characters[offsets[i]] up to offsets[i+1]. Empty unless mapped
+        MappedArray<char> characters;
+        
+        void own() {
+            if (this->offsets.empty()) return;
+            std::vector<std::string> values;
+            values.reserve(this->size());
+            for (std::size_t i = 0; i < this->size(); ++i) values.push_back((*this)[i]);
+            this->owned.swap(values);
+            this->offsets.clear();
+            this->characters.clear();
+        }
+    public:
+        MappedStrings() : owned(), offsets(), characters() {
+            
+        }
+        
+        MappedStrings(MappedArray<uint64_t> &&offsets, MappedArray<char> &&characters) : owned(), offsets(std::move(offsets)), characters(std::move(characters)) {
+            
+        }
+        
+        std::size_t size() const {
+            return this->offsets.empty() ? this->owned.size() : this->offsets.size() - 1;
+        }
+        
+        std::string operator[](std::size_t i) const {
+            if (this->offsets.empty()) return this->owned[i];
+            return std::string(this->characters.data() + this->offsets[i], this->offsets[i + 1] - this->offsets[i]);
+        }
+        
+        void push_back(const std::string &value) {
+            this->own();
+            this->owned.push_back(value);
+        }
+        
+        void set(std::size_t i, const std::string &value) {
+            this->own();
+            this->owned[i] = value;
+        }
+        
+        void set(std::size_t i, std::string &&value) {
+            this->own();
+            this->owned[i] = std::move(value);
+        }
+        
+        void swap(MappedStrings &other) {
+            this->owned.swap(other.owned);
+            this->offsets.swap(other.offsets);
+            this->characters.swap(other.characters);
+        }
+    };
+    
+    template <typename T> class MappedLists {
+        // One list of values for each entry of a table, stored end to end
+        MappedArray<uint64_t> offsets; // List i is values[offsets[i]] up to offsets[i+1]
+        MappedArray<T> values;
+    public:
+        struct List {
+            const T *first, *last;
+            const T* begin() const { return this->first; }
+            const T* end() const { return this->last; }
+            std::size_t size() const { return this->last - this->first; }
+            bool empty() const { return this->first == this->last; }
+            const T& operator[](std::size_t i) const { return this->first[i]; }
+        };
+        
+        MappedLists() : offsets(), values() {
+            
+        }
+        
+        MappedLists(const std::vector<std::vector<T> > &lists) : offsets(), values() {
+            std::vector<uint64_t> ends(1, 0u);
+            std::vector<T> packed;
+            for (auto list = lists.begin(); list != lists.end(); ++list)
+            {
+                packed.insert(packed.end(), list->begin(), list->end());
+                ends.push_back(packed.size());
+            }
+            this->offsets = MappedArray<uint64_t>(std::move(ends));
+            this->values = MappedArray<T>(std::move(packed));
+        }
+        
+        MappedLists(MappedArray<uint64_t> &&offsets, MappedArray<T> &&values) : offsets(std::move(offsets)), values(std::move(values)) {
+            
+        }
+        
+        std::size_t size() const {
+            return this->offsets.empty() ? 0u : this->offsets.size() - 1;
+        }
+        
+        List operator[](std::size_t i) const {
+            return {this->values.data() + this->offsets[i], this->values.data() + this->offsets[i + 1]};
+        }
+        
+        const MappedArray<uint64_t>& getOffsets() const { return this->offsets; }
+        const MappedArray<T>& getValues() const { return this->values; }
+    };
+}
+
+#endif /* MappedArray_h */
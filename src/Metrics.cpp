@@ -7,75 +7,179 @@
 //
 
 #include "Metrics.h"
+#include "Serialize.h"
 #include <iostream>
 #include <math.h>
 #include <cmath>
 #include <unordered_set>
 #include <algorithm>
 #include <iterator>
+#include <unistd.h>
 
 namespace rnaseqc {
-    std::map<std::string, double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts; //counters for read coverage of genes and exons
-
-    std::map<std::string, std::unordered_set<std::string> > fragmentTracker; // tracks fragments encountered by each gene
-    
-    std::tuple<double, double, double> computeCoverage(std::ofstream&, const Feature&, const unsigned int, const std::map<std::string, std::vector<unsigned long> >&, std::list<double>&, BiasCounter&);
+    std::tuple<double, double, double> computeCoverage(std::ostream&, const Feature&, const MappedLists<featureID>::List&, const unsigned int, const std::map<featureID, std::vector<unsigned long> >&, std::list<double>&, BiasCounter&);
 
     void add_range(std::vector<unsigned long>&, coord, unsigned int);
 
-    void Metrics::increment(std::string key)
+    struct CounterName {
+        Metrics::Counter id;
+        const char *name;
+    };
+    
+    // Names of the counters in enum order, which is also the order they're reported in
+    constexpr CounterName counterNames[] = {
+        {Metrics::DuplicateReads, "Duplicate Reads"},
+        {Metrics::End1Antisense, "End 1 Antisense"},
+        {Metrics::End2Antisense, "End 2 Antisense"},
+        {Metrics::End1Bases, "End 1 Bases"},
+        {Metrics::End2Bases, "End 2 Bases"},
+        {Metrics::End1MappedReads, "End 1 Mapped Reads"},
+        {Metrics::End2MappedReads, "End 2 Mapped Reads"},
+        {Metrics::End1Mismatches, "End 1 Mismatches"},
+        {Metrics::End2Mismatches, "End 2 Mismatches"},
+        {Metrics::End1Sense, "End 1 Sense"},
+        {Metrics::End2Sense, "End 2 Sense"},
+        {Metrics::ExonicReads, "Exonic Reads"},
+        {Metrics::FailedVendorQC, "Failed Vendor QC"},
+        {Metrics::HighQualityReads, "High Quality Reads"},
+        {Metrics::IntergenicReads, "Intergenic Reads"},
+        {Metrics::IntragenicReads, "Intragenic Reads"},
+        {Metrics::AmbiguousReads, "Ambiguous Reads"},
+        {Metrics::IntronicReads, "Intronic Reads"},
+        {Metrics::LowMappingQuality, "Low Mapping Quality"},
+        {Metrics::LowQualityReads, "Low Quality Reads"},
+        {Metrics::MappedDuplicateReads, "Mapped Duplicate Reads"},
+        {Metrics::MappedReads, "Mapped Reads"},
+        {Metrics::MappedUniqueReads, "Mapped Unique Reads"},
+        {Metrics::MismatchedBases, "Mismatched Bases"},
+        {Metrics::NonGlobinReads, "Non-Globin Reads"},
+        {Metrics::NonGlobinDuplicateReads, "Non-Globin Duplicate Reads"},
+        {Metrics::ReadsUsedForCounts, "Reads used for Intron/Exon counts"},
+        {Metrics::RRNAReads, "rRNA Reads"},
+        {Metrics::SplitReads, "Split Reads"},
+        {Metrics::TotalBases, "Total Bases"},
+        {Metrics::TotalMappedPairs, "Total Mapped Pairs"},
+        {Metrics::TotalReads, "Total Reads"},
+        {Metrics::QCPassedReads, "Unique Mapping, Vendor QC Passed Reads"},
+        {Metrics::UnpairedReads, "Unpaired Reads"},
+        {Metrics::AlternativeAlignments, "Alternative Alignments"},
+        {Metrics::ChimericReadsTag, "Chimeric Reads_tag"},
+        {Metrics::ChimericReadsContig, "Chimeric Reads_contig"},
+        {Metrics::HQExonicReads, "HQ Exonic Reads"},
+        {Metrics::HQIntronicReads, "HQ Intronic Reads"},
+        {Metrics::HQIntergenicReads, "HQ Intergenic Reads"},
+        {Metrics::HQIntragenicReads, "HQ Intragenic Reads"},
+        {Metrics::HQAmbiguousReads, "HQ Ambiguous Reads"},
+        {Metrics::DuplicatePairs, "Duplicate Pairs"},
+        {Metrics::UniqueFragments, "Unique Fragments"},
+        {Metrics::AlignmentBlocks, "Alignment Blocks"}
+    };
+    
+    constexpr bool inEnumOrder(std::size_t i)
     {
-        this->counter[key]++;
+        return i == Metrics::NUM_COUNTERS || (counterNames[i].id == i && inEnumOrder(i + 1));
     }
 
-    void Metrics::increment(std::string key, int n)
+    static_assert(sizeof(counterNames) / sizeof(CounterName) == Metrics::NUM_COUNTERS && inEnumOrder(0), "Every counter must be named, in enum order");
+    
+    void Metrics::incrementExtra(const std::string &key)
     {
-        this->counter[key] += n;
+        this->extra[key]++;
     }
 
-    unsigned long Metrics::get(std::string key)
+    double Metrics::frac(Counter a, Counter b) const
     {
-        return this->counter[key];
+        return static_cast<double>(this->get(a)) / this->get(b);
     }
-
-    double Metrics::frac(std::string a, std::string b)
+    
+    void Metrics::merge(const Metrics &other)
     {
-        return static_cast<double>(this->get(a)) / this->get(b);
+        for (std::size_t i = 0; i < NUM_COUNTERS; ++i) this->counter[i] += other.counter[i];
+        for (auto entry = other.extra.begin(); entry != other.extra.end(); ++entry)
+            this->extra[entry->first] += entry->second;
+    }
+    
+    void Metrics::save(std::ostream &out) const
+    {
+        writeBinary(out, this->counter);
+        writeBinary(out, this->extra);
+    }
+    
+    void Metrics::load(std::istream &in)
+    {
+        readBinary(in, this->counter);
+        readBinary(in, this->extra);
+    }
+    
+    void FeatureCounts::merge(const FeatureCounts &other)
+    {
+        for (std::size_t i = 0; i < this->geneCounts.size(); ++i)
+        {
+            this->uniqueGeneCounts[i] += other.uniqueGeneCounts[i];
+            this->geneCounts[i] += other.geneCounts[i];
+            this->geneFragmentCounts[i] += other.geneFragmentCounts[i];
+        }
+        for (std::size_t i = 0; i < this->exonCounts.size(); ++i) this->exonCounts[i] += other.exonCounts[i];
+    }
+    
+    void FeatureCounts::save(std::ostream &out) const
+    {
+        writeBinary(out, this->uniqueGeneCounts);
+        writeBinary(out, this->geneCounts);
+        writeBinary(out, this->exonCounts);
+        writeBinary(out, this->geneFragmentCounts);
+    }
+    
+    void FeatureCounts::load(std::istream &in)
+    {
+        readBinary(in, this->uniqueGeneCounts);
+        readBinary(in, this->geneCounts);
+        readBinary(in, this->exonCounts);
+        readBinary(in, this->geneFragmentCounts);
+        if (this->uniqueGeneCounts.size() != geneList.size() || this->geneCounts.size() != geneList.size() || this->geneFragmentCounts.size() != geneList.size() || this->exonCounts.size() != exonList.size()) throw fileException("Partial state file does not match the annotation");
     }
 
+    void Collector::reset()
+    {
+        this->data.clear();
+        this->dirty = false;
+        this->total = 0.0;
+    }
+    
     // Add coverage to an exon
-    void Collector::add(const std::string &gene_id, const std::string &exon_id, const double coverage)
+    void Collector::add(featureID gene_id, featureID exon_id, const double coverage)
     {
         if (coverage > 0)
         {
-            this->data[gene_id].push_back(std::pair<std::string, double>(exon_id, coverage));
+            this->data.push_back({gene_id, exon_id, coverage});
             this->dirty = true;
         }
     }
 
     //Commit all the exon coverage from this gene to the global exon coverage counter
-    void Collector::collect(const std::string &gene_id)
+    void Collector::collect(featureID gene_id)
     {
-        for (auto entry = this->data[gene_id].begin(); entry != this->data[gene_id].end(); ++entry)
+        for (auto entry = this->data.begin(); entry != this->data.end(); ++entry) if (entry->gene_id == gene_id)
         {
-            (*this->target)[entry->first] += entry->second;
-            this->total += entry->second;
+            (*this->target)[exonOrdinals[entry->exon_id]] += entry->coverage;
+            this->total += entry->coverage;
         }
     }
 
     //Legacy version of the above function. Ignores the actual coverage and reports a full read count
-    void Collector::collectSingle(const std::string &gene_id)
+    void Collector::collectSingle(featureID gene_id)
     {
-        for (auto entry = this->data[gene_id].begin(); entry != this->data[gene_id].end(); ++entry)
+        for (auto entry = this->data.begin(); entry != this->data.end(); ++entry) if (entry->gene_id == gene_id)
         {
-            (*this->target)[entry->first] += 1.0;
+            (*this->target)[exonOrdinals[entry->exon_id]] += 1.0;
         }
     }
 
     //Check if there is any coverage on any exon of this gene
-    bool Collector::queryGene(const std::string &gene_id)
+    bool Collector::queryGene(featureID gene_id)
     {
-        return static_cast<bool>(this->data[gene_id].size());
+        for (auto entry = this->data.begin(); entry != this->data.end(); ++entry) if (entry->gene_id == gene_id) return true;
+        return false;
     }
 
     // Check if any coverage has been reported whatsoever
@@ -97,27 +201,25 @@ namespace rnaseqc {
         tmp.offset = start - exon.start;
         tmp.length = end - start;
         tmp.feature_id = exon.feature_id;
-        this->cache[exon.gene_id].push_back(tmp);
+        tmp.gene_id = exon.gene_id;
+        this->cache.push_back(tmp);
     }
 
     //Commit the cached coverage to this gene after deciding to count the read towards the gene
-    void BaseCoverage::commit(const std::string &gene_id)
+    void BaseCoverage::commit(featureID gene_id)
     {
         if (this->seen.count(gene_id))
         {
-            std::cerr << "Gene encountered after computing coverage " << gene_id << std::endl;
+            std::cerr << "Gene encountered after computing coverage " << featureNames[gene_id] << std::endl;
             return;
         }
-        auto beg = this->cache[gene_id].begin();
-        auto end = this->cache[gene_id].end();
-        while (beg != end)
+        for (auto beg = this->cache.begin(); beg != this->cache.end(); ++beg) if (beg->gene_id == gene_id)
         {
-            if (this->coverage.find(beg->feature_id) == this->coverage.end()) this->coverage[beg->feature_id] = std::vector<unsigned long>(exonLengths[beg->feature_id], 0ul);
+            if (this->coverage.find(beg->feature_id) == this->coverage.end()) this->coverage[beg->feature_id] = std::vector<unsigned long>(exonLengths.at(beg->feature_id), 0ul);
             //Add each coverage entry to the per-base coverage vector for the exon
             //At this stage exons each have their own vectors.
             //During the compute() step, exons get stiched together
             add_range(this->coverage[beg->feature_id], beg->offset, beg->length);
-            ++beg;
         }
     }
 
@@ -132,10 +234,12 @@ namespace rnaseqc {
         //Coverage is stored in EID -> coverage vector
         //First iterate over all exons of the gene and ensure they're filled
         //That way, stiching the exons will result in a complete transcript even for exons which haven't been seen
-        for (auto exon_id = exonsForGene[gene.feature_id].begin(); exon_id != exonsForGene[gene.feature_id].end(); ++exon_id)
-            if (this->coverage.find(*exon_id) == this->coverage.end()) this->coverage[*exon_id] = std::vector<unsigned long>(exonLengths[*exon_id], 0ul);
+        //Annotation tables are shared between contig workers, so only look up entries here
+        const MappedLists<featureID>::List exons = exonsForGene[gene.feature_id];
+        for (auto exon_id = exons.begin(); exon_id != exons.end(); ++exon_id)
+            if (this->coverage.find(*exon_id) == this->coverage.end()) this->coverage[*exon_id] = std::vector<unsigned long>(exonLengths.at(*exon_id), 0ul);
         //then compute coverage for the gene
-        std::tuple<double, double, double> results = computeCoverage(this->writer, gene, this->mask_size, this->coverage, this->exonCVs, this->bias);
+        std::tuple<double, double, double> results = computeCoverage(this->buffered ? static_cast<std::ostream&>(this->buffer) : this->writer, gene, exons, this->mask_size, this->coverage, this->exonCVs, this->bias);
         if (std::get<0>(results) != -1)
         {
             this->geneMeans.push_back(std::get<0>(results));
@@ -143,7 +247,7 @@ namespace rnaseqc {
             this->geneCVs.push_back(std::get<2>(results));
         }
         //Now clean out the coverage map to save memory
-        for (auto exon_id = exonsForGene[gene.feature_id].begin(); exon_id != exonsForGene[gene.feature_id].end(); ++exon_id)
+        for (auto exon_id = exons.begin(); exon_id != exons.end(); ++exon_id)
             this->coverage.erase(*exon_id);
         this->seen.insert(gene.feature_id);
     }
@@ -153,7 +257,82 @@ namespace rnaseqc {
         this->writer.flush();
         this->writer.close();
     }
+    
+    std::string BaseCoverage::takeOutput()
+    {
+        std::string output = this->buffer.str();
+        this->buffer.str("");
+        return output;
+    }
+    
+    void BaseCoverage::write(const std::string &output)
+    {
+        (this->buffered ? static_cast<std::ostream&>(this->buffer) : this->writer) << output;
+    }
+    
+    void BaseCoverage::merge(BaseCoverage &other)
+    {
+        this->exonCVs.splice(this->exonCVs.end(), other.exonCVs);
+        this->geneMeans.splice(this->geneMeans.end(), other.geneMeans);
+        this->geneStds.splice(this->geneStds.end(), other.geneStds);
+        this->geneCVs.splice(this->geneCVs.end(), other.geneCVs);
+    }
 
+    void BaseCoverage::save(std::ostream &out) const
+    {
+        writeBinary(out, this->exonCVs);
+        writeBinary(out, this->geneMeans);
+        writeBinary(out, this->geneStds);
+        writeBinary(out, this->geneCVs);
+    }
+    
+    void BaseCoverage::load(std::istream &in)
+    {
+        readBinary(in, this->exonCVs);
+        readBinary(in, this->geneMeans);
+        readBinary(in, this->geneStds);
+        readBinary(in, this->geneCVs);
+    }
+    
+    void writeBinary(std::ostream &out, const CoverageEntry &entry)
+    {
+        writeBinary(out, entry.offset);
+        writeBinary(out, entry.length);
+        writeBinary(out, entry.feature_id);
+        writeBinary(out, entry.gene_id);
+    }
+    
+    void readBinary(std::istream &in, CoverageEntry &entry)
+    {
+        readBinary(in, entry.offset);
+        readBinary(in, entry.length);
+        readBinary(in, entry.feature_id);
+        readBinary(in, entry.gene_id);
+    }
+    
+    void BaseCoverage::checkpoint(std::ostream &out)
+    {
+        writeBinary(out, this->cache);
+        writeBinary(out, this->coverage);
+        writeBinary(out, this->seen);
+        this->writer.flush(); //Everything before the checkpoint has to be in the file before it's resumed
+        writeBinary(out, static_cast<int64_t>(this->filename.length() ? static_cast<std::streamoff>(this->writer.tellp()) : 0));
+    }
+    
+    void BaseCoverage::restore(std::istream &in)
+    {
+        int64_t position;
+        readBinary(in, this->cache);
+        readBinary(in, this->coverage);
+        readBinary(in, this->seen);
+        readBinary(in, position);
+        if (this->filename.empty()) return;
+        //The interrupted run may have written more coverage after its last checkpoint
+        this->writer.flush();
+        if (truncate(this->filename.c_str(), position)) throw fileException("Unable to rewind the coverage output to the checkpoint: " + this->filename);
+        this->writer.seekp(position);
+    }
+    
     //Compute 3'/5' bias based on genes' per-base coverage
     void BiasCounter::computeBias(const Feature &gene, std::vector<unsigned long> &coverage)
     {
@@ -234,7 +413,7 @@ namespace rnaseqc {
     
 
     //Extract the bias for a gene
-    double BiasCounter::getBias(const std::string &geneID)
+    double BiasCounter::getBias(featureID geneID)
     {
         double cov5 = this->fiveEnd[geneID];
         double cov3 = this->threeEnd[geneID];
@@ -251,6 +430,24 @@ namespace rnaseqc {
         return this->countedGenes;
     }
 
+    void BiasCounter::merge(const BiasCounter &other)
+    {
+        for (auto entry = other.fiveEnd.begin(); entry != other.fiveEnd.end(); ++entry) this->fiveEnd[entry->first] += entry->second;
+        for (auto entry = other.threeEnd.begin(); entry != other.threeEnd.end(); ++entry) this->threeEnd[entry->first] += entry->second;
+    }
+    
+    void BiasCounter::save(std::ostream &out) const
+    {
+        writeBinary(out, this->fiveEnd);
+        writeBinary(out, this->threeEnd);
+    }
+    
+    void BiasCounter::load(std::istream &in)
+    {
+        readBinary(in, this->fiveEnd);
+        readBinary(in, this->threeEnd);
+    }
+    
 
     void add_range(std::vector<unsigned long> &coverage, coord offset, unsigned int length)
     {
@@ -260,24 +457,24 @@ namespace rnaseqc {
     }
 
     //Compute exon coverage metrics, then stich exons together and compute gene coverage metrics
-    std::tuple<double, double, double> computeCoverage(std::ofstream &writer, const Feature &gene, const unsigned int mask_size, const std::map<std::string, std::vector<unsigned long> > &coverage, std::list<double> &totalExonCV, BiasCounter &bias)
+    std::tuple<double, double, double> computeCoverage(std::ostream &writer, const Feature &gene, const MappedLists<featureID>::List &exons, const unsigned int mask_size, const std::map<featureID, std::vector<unsigned long> > &coverage, std::list<double> &totalExonCV, BiasCounter &bias)
     {
         std::vector<std::vector<bool> > coverageMask;
         std::vector<unsigned long> geneCoverage;
         unsigned int maskRemainder = mask_size;
-        for (unsigned int i = 0; i < exonsForGene[gene.feature_id].size(); ++i)
+        for (unsigned int i = 0; i < exons.size(); ++i)
         {
-            coverageMask.push_back(std::vector<bool>(exonLengths[exonsForGene[gene.feature_id][i]], true)); //First store a pre-filled mask for the exon
+            coverageMask.push_back(std::vector<bool>(exonLengths.at(exons[i]), true)); //First store a pre-filled mask for the exon
             for (unsigned int j = 0; j < coverageMask.back().size() && maskRemainder; ++j, --maskRemainder) //now, remove coverage from the front of the exon until either it, or the mask size is depleted
                 coverageMask.back()[j] = false;
         }
         maskRemainder = mask_size; //reset the exon mask to mask out the end
-        for (int i = exonsForGene[gene.feature_id].size() - 1; i >= 0 && maskRemainder; --i) //repeat the process, masking out regions from the back until the mask size is depleted
+        for (int i = exons.size() - 1; i >= 0 && maskRemainder; --i) //repeat the process, masking out regions from the back until the mask size is depleted
             for (int j = coverageMask[i].size() - 1; j >= 0 && maskRemainder; --j, --maskRemainder)
                 coverageMask[i][j] = false;
-        for (unsigned int i = 0; i < exonsForGene[gene.feature_id].size(); ++i)
+        for (unsigned int i = 0; i < exons.size(); ++i)
         {
-            const std::vector<unsigned long> &exon_coverage = coverage.at(exonsForGene[gene.feature_id][i]); //get the coverage vector for the current exon
+            const std::vector<unsigned long> &exon_coverage = coverage.at(exons[i]); //get the coverage vector for the current exon
             double exonMean = 0.0, exonStd = 0.0, exonSize = 0.0;
             std::vector<bool> mask = coverageMask[i];
 
@@ -312,7 +509,7 @@ namespace rnaseqc {
             if (geneCoverage.size()) geneCoverage.erase(geneCoverage.begin(), (mask_size > geneCoverage.size() ? geneCoverage.end() : geneCoverage.begin() + mask_size));
         }
         double size = static_cast<double>(geneCoverage.size());
-        writer << gene.feature_id << "\t";
+        writer << featureNames[gene.feature_id] << "\t";
         if (size > 0) //If there's still any coverage after applying the mask
         {
             for (auto beg = geneCoverage.begin(); beg != geneCoverage.end(); ++beg)
@@ -332,70 +529,25 @@ namespace rnaseqc {
 
 std::ofstream& operator<<(std::ofstream &stream, rnaseqc::Metrics &counter)
 {
-    std::vector<std::string> keys =  {
-        //"Alternative Alignments",
-        //"Chimeric Reads",
-        "Duplicate Reads",
-        "End 1 Antisense",
-        "End 2 Antisense",
-        "End 1 Bases",
-        "End 2 Bases",
-        "End 1 Mapped Reads",
-        "End 2 Mapped Reads",
-        "End 1 Mismatches",
-        "End 2 Mismatches",
-        "End 1 Sense",
-        "End 2 Sense",
-        "Exonic Reads",
-        "Failed Vendor QC",
-        "High Quality Reads",
-        "Intergenic Reads",
-        "Intragenic Reads",
-        "Ambiguous Reads",
-        "Intronic Reads",
-        "Low Mapping Quality",
-        "Low Quality Reads",
-        "Mapped Duplicate Reads",
-        "Mapped Reads",
-        "Mapped Unique Reads",
-        "Mismatched Bases",
-        "Non-Globin Reads",
-        "Non-Globin Duplicate Reads",
-        "Reads used for Intron/Exon counts",
-        "rRNA Reads",
-        "Split Reads",
-        "Total Bases",
-        "Total Mapped Pairs",
-        "Total Reads",
-        "Unique Mapping, Vendor QC Passed Reads",
-        "Unpaired Reads"
-    };
-    stream << "Alternative Alignments\t" << counter.get("Alternative Alignments") << std::endl;
+    using rnaseqc::Metrics;
+    stream << "Alternative Alignments\t" << counter.get(Metrics::AlternativeAlignments) << std::endl;
     stream << "Chimeric Reads\t";
-    if (counter.get("Chimeric Reads_tag"))
+    if (counter.get(Metrics::ChimericReadsTag))
     {
-        stream << counter.get("Chimeric Reads_tag") << std::endl;
-        stream << "Chimeric Alignment Rate\t" << counter.frac("Chimeric Reads_tag", "Mapped Reads") << std::endl;
+        stream << counter.get(Metrics::ChimericReadsTag) << std::endl;
+        stream << "Chimeric Alignment Rate\t" << counter.frac(Metrics::ChimericReadsTag, Metrics::MappedReads) << std::endl;
     }
     else
     {
-        stream << counter.get("Chimeric Reads_contig") << std::endl;
-        stream << "Chimeric Alignment Rate\t" << counter.frac("Chimeric Reads_contig", "Mapped Reads") << std::endl;
+        stream << counter.get(Metrics::ChimericReadsContig) << std::endl;
+        stream << "Chimeric Alignment Rate\t" << counter.frac(Metrics::ChimericReadsContig, Metrics::MappedReads) << std::endl;
 
     }
-    for (int i = 0; i < keys.size(); ++i)
-        if (keys[i] != "Split Reads" || counter.get("Split Reads"))
-            stream << keys[i] << "\t" << counter.get(keys[i]) << std::endl;
-    auto beg = counter.counter.begin();
-    auto end = counter.counter.end();
-    while (beg != end)
-    {
-        // Manually dump the counters for reads filtered by user supplied tags
-        if( beg->first.length() > 17 && beg->first.substr(0,17) == "Filtered by tag: ")
-        {
-            stream << beg->first << "\t" << beg->second << std::endl;
-        }
-        ++beg;
-    }
+    for (std::size_t i = 0; i <= Metrics::UnpairedReads; ++i)
+        if (i != Metrics::SplitReads || counter.get(Metrics::SplitReads))
+            stream << rnaseqc::counterNames[i].name << "\t" << counter.counter[i] << std::endl;
+    // Manually dump the counters for reads filtered by user supplied tags
+    for (auto entry = counter.extra.begin(); entry != counter.extra.end(); ++entry)
+        stream << entry->first << "\t" << entry->second << std::endl;
     return stream;
 }
@@ -19,6 +19,8 @@
 #include <list>
 #include <unordered_set>
 #include <iterator>
+#include <sstream>
+#include <array>
 
 namespace rnaseqc {
     class Metrics;
@@ -28,32 +30,66 @@ std::ofstream& operator<<(std::ofstream&, rnaseqc::Metrics&);
 
 namespace rnaseqc {
     class Metrics {
-        // For storing arbitrary counters
-        std::map<std::string, unsigned long> counter;
+        // For storing counters. Counters known at compile time live in a fixed array, named by the registry in Metrics.cpp
     public:
-        Metrics() : counter(){};
-        void increment(std::string);
-        void increment(std::string, int);
-        unsigned long get(std::string);
-        double frac(std::string, std::string);
+        enum Counter {
+            // Reported in the metrics table, in this order
+            DuplicateReads, End1Antisense, End2Antisense, End1Bases, End2Bases, End1MappedReads, End2MappedReads,
+            End1Mismatches, End2Mismatches, End1Sense, End2Sense, ExonicReads, FailedVendorQC, HighQualityReads,
+            IntergenicReads, IntragenicReads, AmbiguousReads, IntronicReads, LowMappingQuality, LowQualityReads,
+            MappedDuplicateReads, MappedReads, MappedUniqueReads, MismatchedBases, NonGlobinReads, NonGlobinDuplicateReads,
+            ReadsUsedForCounts, RRNAReads, SplitReads, TotalBases, TotalMappedPairs, TotalReads, QCPassedReads, UnpairedReads,
+            // Reported separately, or only used to compute rates
+            AlternativeAlignments, ChimericReadsTag, ChimericReadsContig, HQExonicReads, HQIntronicReads, HQIntergenicReads,
+            HQIntragenicReads, HQAmbiguousReads, DuplicatePairs, UniqueFragments, AlignmentBlocks,
+            NUM_COUNTERS
+        };
+    private:
+        std::array<unsigned long, NUM_COUNTERS> counter;
+        std::map<std::string, unsigned long> extra; //Counters named at runtime, such as "Filtered by tag: NH"
+    public:
+        Metrics() : counter(), extra(){};
+        void increment(Counter key)
+        {
+            this->counter[key]++;
+        }
+        void increment(Counter key, int n)
+        {
+            this->counter[key] += n;
+        }
+        void incrementExtra(const std::string&);
+        unsigned long get(Counter key) const
+        {
+            return this->counter[key];
+        }
+        double frac(Counter, Counter) const;
+        void merge(const Metrics&); //Adds another set of counters to this one
+        void save(std::ostream&) const; //Writes the counters to a partial-state file
+        void load(std::istream&);
         friend std::ofstream& ::operator<<(std::ofstream&, Metrics&);
     };
     
     class Collector {
         // For temporarily holding coverage on a read before we're ready to commit that coverage to a gene
-        std::map<std::string, std::vector<std::pair<std::string, double> > > data;
-        std::map<std::string, double> *target;
+        // Reused between reads: reset() keeps the storage, so collecting a read doesn't allocate
+        struct Entry {
+            featureID gene_id, exon_id;
+            double coverage;
+        };
+        std::vector<Entry> data; //In the order coverage was added
+        std::vector<double> *target; //Indexed by position in exonList
         bool dirty;
         double total;
     public:
-        Collector(std::map<std::string, double> *dataTarget) : data(), target(dataTarget), dirty(false), total(0.0)
+        Collector(std::vector<double> *dataTarget) : data(), target(dataTarget), dirty(false), total(0.0)
         {
             
         }
-        void add(const std::string&, const std::string&, const double);
-        void collect(const std::string&);
-        void collectSingle(const std::string&); //for legacy exon detection
-        bool queryGene(const std::string&);
+        void reset(); //Discards the coverage of the previous read
+        void add(featureID, featureID, const double);
+        void collect(featureID);
+        void collectSingle(featureID); //for legacy exon detection
+        bool queryGene(featureID);
         bool isDirty();
         double sum();
     };
@@ -62,7 +98,8 @@ namespace rnaseqc {
         // Represents a single segment of aligned read bases for base-coverage computation
         coord offset;
         unsigned int length;
-        std::string feature_id;
+        featureID feature_id;
+        featureID gene_id;
     };
     
     class BiasCounter {
@@ -72,8 +109,8 @@ namespace rnaseqc {
         const unsigned long geneLength;
         const unsigned int detectionThreshold;
         unsigned int countedGenes;
-        std::map<std::string, unsigned long> fiveEnd;
-        std::map<std::string, unsigned long> threeEnd;
+        std::map<featureID, unsigned long> fiveEnd;
+        std::map<featureID, unsigned long> threeEnd;
     public:
         BiasCounter(int offset, int windowSize, unsigned long geneLength, unsigned int detectionThreshold) : offset(offset), windowSize(windowSize), geneLength(geneLength), detectionThreshold(detectionThreshold), countedGenes(0), fiveEnd(), threeEnd()
         {
@@ -82,7 +119,10 @@ namespace rnaseqc {
         
         void computeBias(const Feature&, std::vector<unsigned long>&);
         unsigned int countGenes() const;
-        double getBias(const std::string&);
+        double getBias(featureID);
+        void merge(const BiasCounter&); //Adds coverage from another counter (computed over a disjoint set of genes)
+        void save(std::ostream&) const; //Writes the 3'/5' coverage of each gene to a partial-state file
+        void load(std::istream&);
         const unsigned int getThreshold() const {
             return this->detectionThreshold;
         }
@@ -90,27 +130,45 @@ namespace rnaseqc {
     
     class BaseCoverage {
         // For computing per-base coverage of genes
-        std::map<std::string, std::vector<CoverageEntry> > cache; //GID -> Entry<EID> tmp cache as exon hits are recorded
-        std::map<std::string, std::vector<unsigned long> > coverage; //EID -> Coverage vector for exons still in window
-        std::ofstream writer;
+        std::vector<CoverageEntry> cache; //tmp cache as exon hits are recorded. Cleared, not freed, after each read
+        std::map<featureID, std::vector<unsigned long> > coverage; //EID -> Coverage vector for exons still in window
+        const std::string filename; //Empty unless the coverage output is written to a file
+        std::fstream writer;
+        std::ostringstream buffer; //Holds coverage output for a later merge, instead of writing it to the file
+        const bool buffered;
         const unsigned int mask_size;
         std::list<double> exonCVs, geneMeans, geneStds, geneCVs;
         BiasCounter &bias;
-        std::unordered_set<std::string> seen;
+        std::unordered_set<featureID> seen;
         BaseCoverage(const BaseCoverage&) = delete; //No!
     public:
-        BaseCoverage(const std::string &filename, const unsigned int mask, bool openFile, BiasCounter &biasCounter) : coverage(), cache(), writer(openFile ? filename : "/dev/null"), mask_size(mask), exonCVs(), geneMeans(), geneStds(), geneCVs(), bias(biasCounter), seen()
+        //When resuming, the existing output file is kept, so that restore() can rewind it to the checkpoint
+        BaseCoverage(const std::string &filename, const unsigned int mask, bool openFile, BiasCounter &biasCounter, bool resume = false) : cache(), coverage(), filename(openFile ? filename : ""), writer(openFile ? filename : "/dev/null", resume && openFile ? std::ios::in | std::ios::out : std::ios::out), buffer(), buffered(false), mask_size(mask), exonCVs(), geneMeans(), geneStds(), geneCVs(), bias(biasCounter), seen()
         {
+            if ((!this->writer.is_open()) && openFile && resume) throw fileException("Unable to resume from the checkpoint, the coverage output it was saved with is missing: " + filename);
             if ((!this->writer.is_open()) && openFile) throw std::runtime_error("Unable to open BaseCoverage output file");
-            this->writer << "gene_id\tcoverage_mean\tcoverage_std\tcoverage_CV" << std::endl;
+            if (!resume) this->writer << "gene_id\tcoverage_mean\tcoverage_std\tcoverage_CV" << std::endl;
+        }
+        
+        //Buffered coverage, used by contig workers. Output is collected with takeOutput() and merged in order
+        BaseCoverage(const unsigned int mask, BiasCounter &biasCounter) : cache(), coverage(), filename(), writer(), buffer(), buffered(true), mask_size(mask), exonCVs(), geneMeans(), geneStds(), geneCVs(), bias(biasCounter), seen()
+        {
+            
         }
         
         void add(const Feature&, const coord, const coord); //Adds to the cache
-        void commit(const std::string&); //moves one gene out of the cache and adds hits to exon coverage vector
+        void commit(featureID); //moves one gene out of the cache and adds hits to exon coverage vector
         void reset(); //Empties the cache
         //    void clearCoverage(); //empties out data that won't be used
         void compute(const Feature&); //Computes the per-base coverage for all transcripts in the gene
         void close(); //Flush and close the ofstream
+        std::string takeOutput(); //Returns and clears any buffered coverage output
+        void write(const std::string&); //Appends coverage output which was buffered by another BaseCoverage
+        void merge(BaseCoverage&); //Takes the coverage summary statistics from another BaseCoverage
+        void save(std::ostream&) const; //Writes the coverage summary statistics to a partial-state file
+        void load(std::istream&);
+        void checkpoint(std::ostream&); //Writes the coverage of genes still in the window and the position of the output file
+        void restore(std::istream&); //Restores a checkpoint and discards any output written after it
         BiasCounter& getBiasCounter() const {
             return this->bias;
         }
@@ -142,8 +200,18 @@ namespace rnaseqc {
         return static_cast<double>(*iterator);
     }
     
-    extern std::map<std::string, double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts; //counters for read coverage of genes and exons
-    extern std::map<std::string, std::unordered_set<std::string> > fragmentTracker; // tracks fragments encountered by each gene
+    struct FeatureCounts {
+        // Per-sample counters for read coverage of genes and exons, indexed by position in geneList and exonList
+        std::vector<double> uniqueGeneCounts, geneCounts, exonCounts, geneFragmentCounts;
+        std::map<featureID, std::unordered_set<std::string> > fragmentTracker; // tracks fragments encountered by each gene
+        FeatureCounts() : uniqueGeneCounts(geneList.size(), 0.0), geneCounts(geneList.size(), 0.0), exonCounts(exonList.size(), 0.0), geneFragmentCounts(geneList.size(), 0.0), fragmentTracker()
+        {
+            
+        }
+        void merge(const FeatureCounts&); //Adds the counts from another sample. Fragment tracking is not merged
+        void save(std::ostream&) const; //Writes the counts to a partial-state file. Fragment tracking is not saved
+        void load(std::istream&);
+    };
 }
 
 #endif /* Metrics_h */
@@ -4,42 +4,100 @@
 
 //Include headers
 #include "BED.h"
-#include "Expression.h"
+#include "Engine.h"
+#include "Serialize.h"
 #include <string>
 #include <iostream>
 #include <stdio.h>
 #include <set>
+#include <algorithm>
 #include <cmath>
 #include <regex>
 #include <ctime>
 #include <limits.h>
 #include <math.h>
 #include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <memory>
+#include <csignal>
+#include <cstdio>
 #include "../args.hxx"
 #include <boost/filesystem.hpp>
 using namespace std;
 using namespace args;
 using namespace rnaseqc;
 
-const string NM = "NM";
 const string VERSION = "RNASeQC 2.3.6";
 const double MAD_FACTOR = 1.4826;
-const unsigned int LEGACY_MAX_READ_LENGTH = 100000u;
-const int LEGACY_SPLIT_DISTANCE = 100;
-map<string, double> tpms;
+const string PARTIAL_MAGIC = "RNASEQC-PARTIAL";
+const string CHECKPOINT_MAGIC = "RNASEQC-CHECKPOINT";
+const uint32_t STATE_VERSION = 6u; //Increment whenever the layout of partial state or checkpoint files changes
+const int TERMINATED_EXIT_CODE = 13; //SIGTERM was received and a checkpoint was saved
+
+volatile sig_atomic_t terminated = 0; //Set by the SIGTERM handler while checkpoints are enabled
+
+void handleTerminate(int)
+{
+    terminated = 1;
+}
+
+struct Sample {
+    string bam, name;
+    bool named; //The name was provided, so it's also used as the column header of the gct reports
+};
+
+struct RunSettings {
+    // Settings shared by every sample in the run, beyond the counting options
+    string outputDir, reference;
+    bool rpkm, writeCoverage;
+    unsigned int threads, workers;
+    unsigned int readAhead; //MB to prefetch ahead of the decoder
+    vector<string> regions; //If set, only these regions are read and the partial results are saved for rnaseqc merge
+    bool checkpoint, resume;
+    unsigned int checkpointInterval; //Minimum seconds between checkpoints
+    uint64_t annotation; //Checksum of the annotation, checked when partial states or checkpoints are read back
+    time_t start; //when the run began, before the GTF was parsed
+    clock_t startClock;
+};
+
+struct RunHeader {
+    // Describes the run which wrote a partial state or checkpoint file, so that it's only combined with the same run
+    string version;
+    Sample sample;
+    rnaseqc::Options options;
+    bool rpkm, writeCoverage;
+    uint64_t genes, exons, annotation;
+    vector<pair<string, int64_t> > contigs;
+};
 
-bool compGenes(const string&, const string&);
 void add_range(vector<unsigned long>&, coord, unsigned int);
 double reduceDeltaCV(list<double>&);
+vector<Sample> readManifest(const string&);
+int processSample(const Sample&, rnaseqc::Options, const RunSettings&, const SeqlibReader&, map<chrom, ContigFeatures>, map<chrom, ContigFeatures>);
+int processBatch(const vector<Sample>&, const rnaseqc::Options&, const RunSettings&, const SeqlibReader&, const map<chrom, ContigFeatures>&, const map<chrom, ContigFeatures>&, unsigned int);
+int loadAnnotation(const string&, const string&, bool, int, unsigned int, map<chrom, ContigFeatures>&);
+void writeReport(SampleState&, const Sample&, const RunSettings&);
+RunHeader describeRun(const Sample&, const rnaseqc::Options&, const RunSettings&, const SeqLib::HeaderSequenceVector&);
+bool sameRun(const RunHeader&, const RunHeader&);
+RunHeader readRunHeader(istream&, const string&, const string&);
+void writePartial(const Sample&, const rnaseqc::Options&, const RunSettings&, const SeqLib::HeaderSequenceVector&, const vector<unique_ptr<RegionWork> >&);
+void writeCheckpoint(const string&, const RunHeader&, SampleState&, int64_t);
+int64_t restoreCheckpoint(const string&, const RunHeader&, SampleState&); //Returns the offset to continue reading the bam from
+int mergeMain(int, char*[]);
+int indexMain(int, char*[]);
 
 int main(int argc, char* argv[])
 {
+    if (argc > 1 && string(argv[1]) == "merge") return mergeMain(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "index-annotation") return indexMain(argc - 1, argv + 1);
     //Set up command line syntax
     ArgumentParser parser(VERSION);
     HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
     Flag versionFlag(parser, "version", "Display the version and quit", {"version"});
-    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against");
-    Positional<string> bamFile(parser, "bam", "The input SAM/BAM file containing reads to process");
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against. May be compressed with gzip or bgzip, or an index from 'rnaseqc index-annotation'");
+    Positional<string> bamFile(parser, "bam", "The input SAM/BAM file containing reads to process. Use '-' to read a coordinate sorted BAM from stdin. With --batch, a manifest of BAM files");
     Positional<string> outputDir(parser, "output", "Output directory");
     ValueFlag<string> sampleName(parser, "sample", "The name of the current sample.  Default: The bam's filename", {'s', "sample"});
     ValueFlag<string> bedFile(parser, "BEDFILE", "Optional input BED file containing non-overlapping exons used for fragment size calculations", {"bed"});
@@ -62,6 +120,14 @@ int main(int argc, char* argv[])
     Flag outputTranscriptCoverage(parser, "coverage", "If this flag is provided, coverage statistics for each transcript will be written to a table. Otherwise, only summary coverage statistics are generated and added to the metrics table", {"coverage"});
     ValueFlag<unsigned int> coverageMaskSize(parser, "SIZE", "Sets how many bases at both ends of a transcript are masked out when computing per-base exon coverage. Default: 500bp", {"coverage-mask"});
     ValueFlag<unsigned int> detectionThreshold(parser, "threshold", "Number of counts on a gene to consider the gene 'detected'. Additionally, genes below this limit are excluded from 3' bias computation. Default: 5 reads", {'d', "detection-threshold"});
+    ValueFlag<unsigned int> decompressionThreads(parser, "THREADS", "Number of additional threads used to decompress the BAM/CRAM and to parse the GTF. Default: 0 (decompress on the main thread)", {"threads"});
+    ValueFlag<unsigned int> readAhead(parser, "MB", "Prefetch this many megabytes of the BAM ahead of the decoder, using large reads on a background thread. Helps on network and shared filesystems, where htslib's small reads are slow. Default: 0 (disabled)", {"read-ahead"});
+    ValueFlag<unsigned int> parallelContigs(parser, "WORKERS", "Number of contigs to process at once. Requires an indexed BAM/CRAM. Default: 1 (read the BAM in a single pass)", {"parallel"});
+    Flag batchMode(parser, "batch", "Treat the bam argument as a manifest of BAM files, one per line, each optionally followed by a tab and a sample name. The GTF is parsed once and shared by every sample", {"batch"});
+    ValueFlag<unsigned int> batchSamples(parser, "SAMPLES", "Number of samples from a --batch manifest to process at once. The --threads decompression pool is shared by all of them. Default: 1", {"batch-samples"});
+    ValueFlag<unsigned int> checkpointInterval(parser, "SECONDS", "Save a checkpoint to {sample}.checkpoint in the output directory at the first contig boundary after this many seconds since the last one, and when terminated by SIGTERM. Requires a BAM file", {"checkpoint"});
+    Flag resumeRun(parser, "resume", "Continue from the checkpoint in the output directory, if there is one. Output is identical to an uninterrupted run. Requires --checkpoint", {"resume"});
+    ValueFlagList<string> regions(parser, "REGION", "Only process reads which start in this region ('contig', 'contig:start-end', or '*' for unplaced reads). May be given more than once. Writes {sample}.partial for 'rnaseqc merge' instead of the reports. Requires an indexed BAM/CRAM", {"region"});
 	try
 	{
         //parse and validate the command line arguments
@@ -73,6 +139,8 @@ int main(int argc, char* argv[])
         if (!gtfFile) throw ValidationError("No GTF file provided");
         if (!bamFile) throw ValidationError("No BAM file provided");
         if (!outputDir) throw ValidationError("No output directory provided");
+        if (batchMode && sampleName) throw ValidationError("--sample can't be used with --batch. Provide sample names in the manifest instead");
+        if (!batchMode && bamFile.Get() == "-" && !sampleName) throw ValidationError("--sample is required when reading the BAM from stdin");
 
         Strand STRAND_ORIENTATION = Strand::Unknown;
         if (strandSpecific)
@@ -97,82 +165,31 @@ int main(int argc, char* argv[])
         const string chimeric_tag = chimericTag ? chimericTag.Get() : "mC";
         const string SAMPLENAME = sampleName ? sampleName.Get() : boost::filesystem::path(bamFile.Get()).filename().string();
         const unsigned int DETECTION_THRESHOLD = detectionThreshold ? detectionThreshold.Get() : 5u;
+        const unsigned int THREADS = decompressionThreads ? decompressionThreads.Get() : 0u;
+        const unsigned int WORKERS = parallelContigs ? parallelContigs.Get() : 1u;
+        const unsigned int SAMPLES = batchSamples ? batchSamples.Get() : 1u;
+        if (regions && batchMode) throw ValidationError("--region can't be used with --batch");
+        if (regions && isStream(bamFile.Get())) throw ValidationError("--region requires an indexed BAM and can't be used when streaming the BAM from stdin or a FIFO");
+        if (resumeRun && !checkpointInterval) throw ValidationError("--resume requires --checkpoint");
+        if (checkpointInterval && (batchMode || regions || WORKERS > 1)) throw ValidationError("--checkpoint can't be used with --batch, --region, or --parallel");
+        if (checkpointInterval && isStream(bamFile.Get())) throw ValidationError("--checkpoint can't be used when streaming the BAM from stdin or a FIFO");
+        if (!batchMode && isStream(bamFile.Get()) && WORKERS > 1) throw ValidationError("--parallel requires an indexed BAM and can't be used when streaming the BAM from stdin or a FIFO");
 
-        time_t t0, t1, t2; //various timestamps to record execution time
+        time_t t0, t1; //various timestamps to record execution time
         clock_t start_clock = clock(); //timer used to compute CPU time
-        map<chrom, list<Feature>> features; //map of chr -> genes/exons; parsed from GTF
-        //Parse the GTF and extract features
-        {
-            Feature line; //current feature being read from the gtf
-            ifstream reader(gtfFile.Get());
-            if (!reader.is_open())
-            {
-                cerr << "Unable to open GTF file: " << gtfFile.Get() << endl;
-                return 10;
-            }
-            
-#ifndef NO_FASTA
-            Fasta fastaReader;
-            if (fastaFile)
-            {
-                fastaReader.open(fastaFile.Get());
-                if (VERBOSITY > 1) cout << "A FASTA has been provided. This will enable GC-content statistics but will slow down the initial startup..." << endl;
-            }
-#endif
-            
-            if (VERBOSITY) cout<<"Reading GTF Features..."<<endl;
-            time(&t0);
-            while ((reader >> line))
-            {
-                if(LegacyMode.Get() && line.end == line.start)
-                {
-                    //legacy code excludes single base exons
-                    if (VERBOSITY > 1) cerr<<"Legacy mode excluded feature: " << line.feature_id << endl;
-                    if (line.type == FeatureType::Exon) geneCodingLengths[line.gene_id] -= 1;
-                    continue;
-                }
-                //Just keep genes and exons.  We don't care about transcripts or any other feature types
-                if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
-                {
-                    features[line.chromosome].push_back(line);
-#ifndef NO_FASTA
-                    //If fasta features are enabled, read the gene sequence from the fasta 
-                    if (fastaFile && line.type == FeatureType::Gene) geneSeqs[line.feature_id] = fastaReader.getSeq(line.chromosome, line.start - 1, line.end, line.strand);
-#endif
-                    
-                }
-            }
-        }
-		//ensure that the features are sorted.  This MUST be true for the exon alignment metrics
-        if (VERBOSITY > 1) cout << "Processing GTF Features..." << endl;
-        for (auto beg = features.begin(); beg != features.end(); ++beg)
-        {
-            beg->second.sort(compIntervalStart);
-            for (auto feat = beg->second.begin(); feat != beg->second.end(); ++feat)
-                if (feat->type == FeatureType::Exon) exonsForGene[feat->gene_id].push_back(feat->feature_id);
-            
-        }
+        map<chrom, ContigFeatures> features; //map of chr -> genes/exons; parsed from GTF
+        time(&t0);
+        const int annotationStatus = loadAnnotation(gtfFile.Get(), fastaFile ? fastaFile.Get() : "", LegacyMode.Get(), VERBOSITY, THREADS, features);
+        if (annotationStatus) return annotationStatus;
+        const uint64_t annotation = annotationChecksum(features);
         time(&t1); //record the time taken to parse the GTF
-        if (!(geneList.size() && exonList.size()))
-        {
-            cerr << "There were either no genes or no exons in the GTF" << endl;
-            cerr << geneList.size() << " genes parsed" << endl;
-            cerr << exonList.size() << " exons parsed" << endl;
-            return 11;
-        }
         if (VERBOSITY) cout << "Finished processing GTF in " << difftime(t1, t0) << " seconds" << endl;
 
-        //fragment size variables
-        unsigned int doFragmentSize = 0u; //count of remaining fragment size samples to record
-        map<chrom, list<Feature> > *bedFeatures = nullptr; //similar map, but parsed from BED for fragment sizes only
-        map<string, FragmentMateEntry> fragments; //Map of alignment name -> exonID to ensure mates map to the same exon for
-        map<long long, unsigned long> fragmentSizes; //list of fragment size samples taken so far
+        map<chrom, ContigFeatures> bedFeatures; //similar map, but parsed from BED for fragment sizes only
         if (bedFile) //If we were given a BED file, parse it for fragment size calculations
         {
              Feature line; //current feature being read from the bed
             if (VERBOSITY) cout << "Parsing BED intervals for fragment size computations..." << endl;
-            doFragmentSize = FRAGMENT_SIZE_SAMPLES;
-            bedFeatures = new map<chrom, list<Feature> >();
             ifstream bedReader(bedFile.Get());
             if (!bedReader.is_open())
             {
@@ -180,7 +197,7 @@ int main(int argc, char* argv[])
                 return 10;
             }
             //extract each line of the bed and insert it into the bedFeatures map
-            while (extractBED(bedReader, line)) (*bedFeatures)[line.chromosome].push_back(line);
+            while (extractBED(bedReader, line)) bedFeatures[line.chromosome].push_back(line);
             bedReader.close();
         }
 
@@ -190,451 +207,919 @@ int main(int argc, char* argv[])
             boost::filesystem::create_directories(outputDir.Get());
         }
 
-        
-        const string bamFilename = bamFile.Get();
-        SeqlibReader bam;
-        if (fastaFile) bam.addReference(fastaFile.Get());
-        if (!bam.open(bamFilename))
+        rnaseqc::Options options;
+        options.orientation = STRAND_ORIENTATION;
+        options.chimericDistance = CHIMERIC_DISTANCE;
+        options.fragmentSamples = bedFile ? FRAGMENT_SIZE_SAMPLES : 0u;
+        options.baseMismatchThreshold = BASE_MISMATCH_THRESHOLD;
+        options.mappingQualityThreshold = MAPPING_QUALITY_THRESHOLD;
+        options.coverageMask = COVERAGE_MASK;
+        options.biasOffset = BIAS_OFFSET;
+        options.biasWindow = BIAS_WINDOW;
+        options.biasLength = BIAS_LENGTH;
+        options.detectionThreshold = DETECTION_THRESHOLD;
+        options.legacy = LegacyMode.Get();
+        options.excludeChimeric = excludeChimeric.Get();
+        options.unpaired = unpaired.Get();
+        options.strictSort = false; //Set for each sample
+        options.tags = tags;
+        options.chimericTag = chimeric_tag;
+        options.verbosity = VERBOSITY;
+        RunSettings settings;
+        settings.outputDir = outputDir.Get();
+        settings.reference = fastaFile ? fastaFile.Get() : "";
+        settings.rpkm = useRPKM.Get();
+        settings.writeCoverage = outputTranscriptCoverage.Get();
+        settings.threads = THREADS;
+        settings.workers = WORKERS;
+        settings.readAhead = readAhead ? readAhead.Get() : 0u;
+        settings.regions = regions ? regions.Get() : vector<string>();
+        settings.checkpoint = static_cast<bool>(checkpointInterval);
+        settings.resume = resumeRun.Get();
+        settings.checkpointInterval = checkpointInterval ? checkpointInterval.Get() : 0u;
+        settings.annotation = annotation;
+        settings.start = t0;
+        settings.startClock = start_clock;
+        SeqlibReader pool; //Never opened. Owns the decompression threads, which are shared by every sample
+        pool.setThreads(THREADS);
+        if (batchMode) return processBatch(readManifest(bamFile.Get()), options, settings, pool, features, bedFeatures, SAMPLES);
+        return processSample({bamFile.Get(), SAMPLENAME, static_cast<bool>(sampleName)}, options, settings, pool, std::move(features), std::move(bedFeatures));
+	}
+    catch (args::Help)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (std::invalid_argument &e)
+    {
+        cerr << "Invalid argument type provided: " << e.what() << endl;
+        return 7;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (invalidContigException &e)
+    {
+        cerr << "GTF referenced a contig not present in the FASTA: " << e.error << endl;
+        return 11;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (bedException &e)
+    {
+        cerr << "Failed to parse the BED: " << e.error << endl;
+        return 11;
+    }
+    catch (unsortedException &e)
+    {
+        cerr << e.error << endl;
+        return 12;
+    }
+    catch (regionException &e)
+    {
+        cerr << "Invalid region: " << e.error << endl;
+        return 6;
+    }
+    catch (std::length_error &e)
+    {
+        cerr<<"Unable to parse the GFT lines"<<endl;
+        cerr<<e.what()<<endl;
+        return 1;
+    }
+    catch (std::range_error &e)
+    {
+        cerr<<"Invalid range"<<endl;
+        cerr<<e.what()<<endl;
+        return 2;
+    }
+    catch(std::domain_error &e)
+    {
+        cerr<<"Unable to perform string conversion"<<endl;
+        cerr<<e.what()<<endl;
+        return 3;
+    }
+    catch(ios_base::failure &e)
+    {
+        cerr << "Encountered an IO failure" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+	catch (...)
+	{
+        cerr << parser << endl;
+        cerr << "Unknown error" << endl;
+        return -1;
+	}
+
+    return 0;
+}
+
+double reduceDeltaCV(list<double> &deltaCV)
+{
+    deltaCV.sort();
+    return computeMedian(deltaCV.size(), deltaCV.begin());
+}
+
+
+
+vector<Sample> readManifest(const string &filename)
+{
+    ifstream manifest(filename);
+    if (!manifest.is_open()) throw fileException("Unable to open manifest: " + filename);
+    vector<Sample> samples;
+    set<string> names; //Each sample must have its own output files
+    string line;
+    while (getline(manifest, line))
+    {
+        if (line.length() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        const size_t tab = line.find('\t');
+        Sample sample;
+        sample.bam = line.substr(0, tab);
+        sample.named = tab != string::npos;
+        sample.name = sample.named ? line.substr(tab + 1) : boost::filesystem::path(sample.bam).filename().string();
+        if (isStream(sample.bam)) throw ValidationError("BAMs in a --batch manifest can't be streamed: " + sample.bam);
+        if (!names.insert(sample.name).second) throw ValidationError("Sample name appears twice in the manifest: " + sample.name);
+        samples.push_back(sample);
+    }
+    if (samples.empty()) throw ValidationError("The manifest does not list any BAM files: " + filename);
+    return samples;
+}
+
+int processBatch(const vector<Sample> &samples, const rnaseqc::Options &options, const RunSettings &settings, const SeqlibReader &pool, const map<chrom, ContigFeatures> &features, const map<chrom, ContigFeatures> &bedFeatures, unsigned int concurrency)
+{
+    //Contig IDs are assigned as names are first seen, so every contig is registered before samples run concurrently
+    for (auto sample = samples.begin(); sample != samples.end(); ++sample)
+    {
+        SeqlibReader reader;
+        if (!reader.open(sample->bam)) continue; //processSample will report the error
+        SeqLib::HeaderSequenceVector sequences = reader.getHeader().GetHeaderSequenceVector();
+        for (auto sequence = sequences.begin(); sequence != sequences.end(); ++sequence) chromosomeMap(sequence->Name);
+    }
+    //Each worker takes the next sample in the manifest until none are left.
+    //Every sample gets its own copy of the features, since they're consumed while reading the bam
+    vector<int> results(samples.size(), 0);
+    vector<exception_ptr> failures(samples.size(), nullptr);
+    atomic<size_t> nextSample(0);
+    vector<thread> workers;
+    const size_t nWorkers = std::max<size_t>(1, std::min<size_t>(concurrency, samples.size()));
+    for (size_t i = 0; i < nWorkers; ++i) workers.emplace_back([&]() {
+        for (size_t current = nextSample++; current < samples.size(); current = nextSample++)
         {
-            cerr << "Unable to open BAM file: " << bamFilename << endl;
-            return 10;
+            if (options.verbosity) cout << "Processing sample " << samples[current].name << " (" << current + 1 << "/" << samples.size() << ")" << endl;
+            try
+            {
+                results[current] = processSample(samples[current], options, settings, pool, features, bedFeatures);
+            }
+            catch (...)
+            {
+                failures[current] = current_exception();
+                results[current] = -1;
+            }
         }
-        Metrics counter; //main tracker for various metrics
-        int readLength = 0; //longest read encountered so far
-        
-        BiasCounter bias(BIAS_OFFSET, BIAS_WINDOW, BIAS_LENGTH, DETECTION_THRESHOLD);
-        BaseCoverage baseCoverage(outputDir.Get() + "/" + SAMPLENAME + ".coverage.tsv", COVERAGE_MASK, outputTranscriptCoverage.Get(), bias);
-        unsigned long long alignmentCount = 0ull; //count of how many alignments we've seen so far
-        chrom current_chrom = 0;
-        int32_t last_position = 0; // For some reason, htslib has decided that this will be the datatype used for positions
+    });
+    for (auto worker = workers.begin(); worker != workers.end(); ++worker) worker->join();
+    //Report every failed sample, then fail with the error of the first one
+    size_t firstFailure = samples.size();
+    for (size_t i = 0; i < samples.size(); ++i) if (results[i])
+    {
+        cerr << "Failed to process sample " << samples[i].name << ": " << samples[i].bam << endl;
+        if (firstFailure == samples.size()) firstFailure = i;
+    }
+    if (firstFailure == samples.size()) return 0;
+    if (failures[firstFailure] != nullptr) rethrow_exception(failures[firstFailure]);
+    return results[firstFailure];
+}
 
-        //Begin parsing the bam.  Each alignment is run through various sets of metrics
+int processSample(const Sample &sample, rnaseqc::Options options, const RunSettings &settings, const SeqlibReader &pool, map<chrom, ContigFeatures> features, map<chrom, ContigFeatures> bedFeatures)
+{
+    const int VERBOSITY = options.verbosity;
+    const unsigned int THREADS = settings.threads;
+    const unsigned int WORKERS = settings.workers;
+    const bool STREAM = isStream(sample.bam); //stdin and FIFOs are read once, so the sort order is checked strictly
+    const bool SHARD = settings.regions.size() > 0;
+    const string checkpointFile = settings.outputDir + "/" + sample.name + ".checkpoint";
+    const bool RESUME = settings.resume && boost::filesystem::exists(checkpointFile);
+    options.strictSort = STREAM;
+    time_t t1, t2; //various timestamps to record execution time
+    time(&t1);
+    const string bamFilename = sample.bam;
+    SeqlibReader bam;
+    if (settings.reference.length()) bam.addReference(settings.reference);
+    bam.shareThreads(pool);
+    bam.setPrefetch(static_cast<size_t>(settings.readAhead) << 20);
+    if (!bam.open(bamFilename))
+    {
+        cerr << "Unable to open BAM file: " << bamFilename << endl;
+        return 10;
+    }
+    if (STREAM && bam.getSortOrder().length() && bam.getSortOrder() != "coordinate") throw unsortedException("The input bam header declares SO:" + bam.getSortOrder() + ". Streamed input must be coordinate sorted");
+    if ((WORKERS > 1 || SHARD) && !bam.loadIndex(bamFilename))
+    {
+        cerr << "Unable to load the index for BAM file: " << bamFilename << ". An index is required for --parallel and --region" << endl;
+        return 10;
+    }
+    //Shards don't write coverage directly. It's saved with the partial results and written by rnaseqc merge
+    if (settings.checkpoint && !bam.canSeek()) throw ValidationError("--checkpoint requires a BAM file: " + bamFilename);
+    SampleState state(options, features, bedFeatures, settings.outputDir + "/" + sample.name + ".coverage.tsv", settings.writeCoverage && !SHARD, RESUME);
+    BaseCoverage &baseCoverage = state.baseCoverage;
+    
+    //Begin parsing the bam.  Each alignment is run through various sets of metrics
+    {
+        vector<Alignment> batch; //current batch of bam alignments
+        SeqLib::BamHeader header = bam.getHeader();
+        time_t report_time; //used to ensure that stdout isn't spammed if the program runs super fast
+        SeqLib::HeaderSequenceVector sequences = header.GetHeaderSequenceVector();
+        //Check the sequence dictionary for contig overlap with gtf
+        if (VERBOSITY > 1) cout<<"Checking bam header..."<<endl;
+        bool hasOverlap = false;
+        for(auto sequence = sequences.begin(); sequence != sequences.end(); ++sequence)
         {
-            Alignment alignment; //current bam alignment
-            SeqLib::BamHeader header = bam.getHeader();
-            time_t report_time; //used to ensure that stdout isn't spammed if the program runs super fast
-            SeqLib::HeaderSequenceVector sequences = header.GetHeaderSequenceVector();
-            const unsigned int nChrs = sequences.size();
-            //Check the sequence dictionary for contig overlap with gtf
-            if (VERBOSITY > 1) cout<<"Checking bam header..."<<endl;
-            bool hasOverlap = false;
-            for(auto sequence = sequences.begin(); sequence != sequences.end(); ++sequence)
+            chrom chrom = chromosomeMap(sequence->Name);
+            if (features.find(chrom) != features.end())
             {
-                chrom chrom = chromosomeMap(sequence->Name);
-                if (features.find(chrom) != features.end())
-                {
-                    hasOverlap = true;
-                    break;
-                }
+                hasOverlap = true;
+                break;
             }
-            if (!hasOverlap)
+        }
+        if (!hasOverlap)
+        {
+            cerr << "BAM file shares no contigs with GTF" << endl;
+            return 11;
+        }
+        if (VERBOSITY) cout<<"Parsing bam..."<<endl;
+        time(&report_time);
+        time(&t2);
+        if (SHARD)
+        {
+            vector<unique_ptr<RegionWork> > units;
+            processRegions(bamFilename, settings.reference, bam, sequences, std::max(WORKERS, 1u), parseRegions(settings.regions, sequences, features), features, bedFeatures, options, units);
+            writePartial(sample, options, settings, sequences, units);
+            time(&t2);
+            if (VERBOSITY) cout << "Time Elapsed: " << difftime(t2, t1) << "; Saved partial results for " << units.size() << " regions to " << settings.outputDir << "/" << sample.name << ".partial" << endl;
+            return 0;
+        }
+        if (WORKERS > 1) processContigs(bamFilename, settings.reference, bam, sequences, WORKERS, features, bedFeatures, state);
+        else
+        {
+            const RunHeader run = describeRun(sample, options, settings, sequences);
+            time_t lastCheckpoint; //Checkpoints are saved at contig boundaries, but no more often than the checkpoint interval
+            time(&lastCheckpoint);
+            if (RESUME)
             {
-                cerr << "BAM file shares no contigs with GTF" << endl;
-                return 11;
+                if (!bam.seek(restoreCheckpoint(checkpointFile, run, state))) throw fileException("Unable to seek to the checkpoint in BAM file: " + bamFilename);
+                if (VERBOSITY) cout << "Resumed from checkpoint after " << state.alignmentCount << " alignments" << endl;
             }
-            if (VERBOSITY) cout<<"Parsing bam..."<<endl;
-            time(&report_time);
-            time(&t2);
-            while (bam.next(alignment))
+            if (settings.checkpoint) signal(SIGTERM, handleTerminate);
+            //Records are decoded in batches on a separate thread while the previous batch is counted here
+            for (size_t batchSize = bam.nextBatch(batch); batchSize; batchSize = bam.nextBatch(batch))
             {
-                //try to print an update to stdout every 250,000 reads, but no more than once every 10 seconds
-                ++alignmentCount;
-                if (alignmentCount % 250000 == 0) time(&t2);
-                if (difftime(t2, report_time) >= 10)
-                {
-                    time(&report_time);
-                    if (VERBOSITY > 1) cout << "Time elapsed: " << difftime(t2, t1) << "; Alignments processed: " << alignmentCount << endl;
-                }
-                //count metrics based on basic read data
-                if (alignment.SecondaryFlag()) counter.increment("Alternative Alignments");
-                else if (alignment.QCFailFlag()) counter.increment("Failed Vendor QC");
-                else if (alignment.MapQuality() < MAPPING_QUALITY_THRESHOLD) counter.increment("Low Mapping Quality");
-                if (!(alignment.SecondaryFlag() || alignment.QCFailFlag()) /*&& alignment.MapQuality >= 255u*/)
-//                if ((LegacyMode.Get() || !alignment.SecondaryFlag()) && !alignment.QCFailFlag())
+                for (size_t i = 0; i < batchSize; ++i)
                 {
-                    counter.increment("Unique Mapping, Vendor QC Passed Reads");
-                    //raw counts:
-                    if (!alignment.PairedFlag()) counter.increment("Unpaired Reads");
-                    if (alignment.MappedFlag())
+                    state.process(batch[i], sequences);
+                    if (state.contigFinished || terminated)
                     {
-                        counter.increment("Mapped Reads");
-
-                        if (alignment.DuplicateFlag()) counter.increment("Mapped Duplicate Reads");
-                        else counter.increment("Mapped Unique Reads");
-                        //check length against max read length
-                        unsigned int alignmentSize = alignment.PositionEnd() - alignment.Position();
-                        if (LegacyMode.Get() && alignmentSize > LEGACY_MAX_READ_LENGTH) continue;
-                        if (!readLength) current_chrom = chromosomeMap(sequences[alignment.ChrID()].Name);
-                        if (alignmentSize > readLength) readLength = alignment.Length();
-                        string trash;
-                        if (!LegacyMode.Get() && alignment.GetZTag(chimeric_tag, trash))
-                        {
-                            counter.increment("Chimeric Reads_tag");
-                            if(excludeChimeric.Get()) continue;
-                        }
-                        if (alignment.PairedFlag() && alignment.MateMappedFlag() )
-                        {
-                            if (alignment.FirstFlag()) counter.increment("Total Mapped Pairs");
-                            if (alignment.ChrID() != alignment.MateChrID() || abs(alignment.Position() - alignment.MatePosition()) > CHIMERIC_DISTANCE || (LegacyMode.Get() && alignment.ChrID() > 127))
-                            {
-                                counter.increment("Chimeric Reads_contig");
-                                if(excludeChimeric.Get()) continue;
-                            }
-                        }
-                        //Get tag data
-                        int32_t mismatches = 0;
-                        if (alignment.GetIntTag(NM, mismatches))
-                        {
-                            if (alignment.PairedFlag())
-                            {
-                                if (alignment.FirstFlag())
-                                {
-                                    counter.increment("End 1 Mapped Reads");
-                                    counter.increment("End 1 Mismatches", mismatches);
-                                    counter.increment("End 1 Bases", alignment.Length());
-                                    if (alignment.DuplicateFlag())counter.increment("Duplicate Pairs");
-                                    else counter.increment("Unique Fragments");
-                                }
-                                else
-                                {
-                                    counter.increment("End 2 Mapped Reads");
-                                    counter.increment("End 2 Mismatches", mismatches);
-                                    counter.increment("End 2 Bases", alignment.Length());
-                                }
-
-                            }
-                            counter.increment("Mismatched Bases", mismatches);
-                        }
-                        counter.increment("Total Bases", alignment.Length());
-                        //generic filter tags:
-                        bool discard = false;
-                        for (auto tag = tags.begin(); tag != tags.end(); ++tag)
-                        {
-                            if (alignment.GetTag(tag->c_str(), trash))
-                            {
-                                discard = true;
-                                counter.increment("Filtered by tag: "+*tag);
-                            }
-                        }
-                        if (discard) continue;
-                        
-                        bool highQuality = (mismatches <= BASE_MISMATCH_THRESHOLD && (unpaired.Get() || alignment.ProperPair()) && alignment.MapQuality() >= MAPPING_QUALITY_THRESHOLD);
-
-                        //now record intron/exon metrics by intersecting filtered reads with the list of features
-                        if (alignment.ChrID() < 0 || alignment.ChrID() >= nChrs)
-                        {
-                            //The read had an unrecognized RefID (one not defined in the bam's header)
-                            if (VERBOSITY) cerr << "Unrecognized RefID on alignment: " << alignment.Qname() <<endl;
-                        }
-                        else
+                        state.contigFinished = false;
+                        if (settings.checkpoint && (terminated || difftime(time(nullptr), lastCheckpoint) >= settings.checkpointInterval))
                         {
-                            if (highQuality) counter.increment("High Quality Reads");
-                            else counter.increment("Low Quality Reads");
-                            counter.increment("Reads used for Intron/Exon counts");
-                            vector<Feature> blocks;
-                            string chrName = sequences[alignment.ChrID()].Name;
-                            chrom chr = chromosomeMap(chrName); //parse out a chromosome shorthand
-                            if (chr != current_chrom)
-                            {
-                                dropFeatures(features[current_chrom], baseCoverage);
-                                current_chrom = chr;
-                            }
-                            else if (last_position > alignment.Position())
-                                cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
-                            last_position = alignment.Position();
-
-                            //extract each cigar block from the alignment
-                            unsigned int length = extractBlocks(alignment, blocks, chr, LegacyMode.Get());
-                            counter.increment("Alignment Blocks", blocks.size());
-                            trimFeatures(alignment, features[chr], baseCoverage); //drop features that appear before this read
-
-                            //run the read through exon metrics
-                            if (LegacyMode.Get()) legacyExonAlignmentMetrics(LEGACY_SPLIT_DISTANCE, features, counter, blocks, alignment, sequences, length, STRAND_ORIENTATION, baseCoverage, highQuality, unpaired.Get());
-                            else exonAlignmentMetrics(features, counter, blocks, alignment, sequences, length, STRAND_ORIENTATION, baseCoverage, highQuality, unpaired.Get());
-
-                            //if fragment size calculations were requested, we still have samples to take, and the chromosome exists within the provided bed
-                            if (highQuality && doFragmentSize && alignment.PairedFlag() && bedFeatures != nullptr && bedFeatures->find(chr) != bedFeatures->end())
+                            writeCheckpoint(checkpointFile, run, state, batch[i].EndOffset());
+                            time(&lastCheckpoint);
+                            if (VERBOSITY > 1) cout << "Saved checkpoint after " << state.alignmentCount << " alignments" << endl;
+                            if (terminated)
                             {
-                                doFragmentSize = fragmentSizeMetrics(doFragmentSize, bedFeatures, fragments, fragmentSizes, blocks, alignment, sequences);
-                                if (!doFragmentSize && VERBOSITY > 1) cout << "Completed taking fragment size samples" << endl;
+                                cerr << "Terminated. Rerun with --resume to continue from alignment " << state.alignmentCount << endl;
+                                return TERMINATED_EXIT_CODE;
                             }
                         }
                     }
-
+                    //try to print an update to stdout every 250,000 reads, but no more than once every 10 seconds
+                    if (state.alignmentCount % 250000 == 0) time(&t2);
+                    if (difftime(t2, report_time) >= 10)
+                    {
+                        time(&report_time);
+                        if (VERBOSITY > 1) cout << "Time elapsed: " << difftime(t2, t1) << "; Alignments processed: " << state.alignmentCount << endl;
+                    }
                 }
-
             } //end of bam alignment loop
-        } //end of bam alignment scope
-
-        for (auto feats = features.begin(); feats != features.end(); ++feats)
-            if (feats->second.size()) dropFeatures(feats->second, baseCoverage);
+            if (settings.checkpoint) signal(SIGTERM, SIG_DFL); //Nothing left to checkpoint
+            for (auto feats = features.begin(); feats != features.end(); ++feats)
+                if (feats->second.size()) dropFeatures(feats->second, baseCoverage, state.counts);
+        }
+    } //end of bam alignment scope
+    
+    baseCoverage.close();
+    time(&t2);
+    if (VERBOSITY)
+    {
+        cout<< "Time Elapsed: " << difftime(t2, t1) << "; Alignments processed: " << state.alignmentCount << endl;
+        cout << "Total runtime: " << difftime(t2, settings.start) << "; Total CPU Time: " << (clock() - settings.startClock)/CLOCKS_PER_SEC << endl;
+        cout << "Time spent decoding alignments: " << bam.getDecodeTime() << " seconds (" << THREADS << " decompression threads)" << endl;
+        if (bam.getPrefetch())
+        {
+            const double seconds = std::max(difftime(t2, t1), 1.0), MB = 1048576.0;
+            cout << "Prefetched " << bam.getPrefetchedBytes() / MB << " MB (" << bam.getPrefetchedBytes() / MB / seconds << " MB/s); Decoded " << bam.getConsumedBytes() / MB << " MB (" << bam.getConsumedBytes() / MB / seconds << " MB/s)" << endl;
+        }
+        if (VERBOSITY > 1) cout << "Average Reads/Sec: " << static_cast<double>(state.alignmentCount) / difftime(t2, t1) << endl;
+    }
+    writeReport(state, sample, settings);
+    if (settings.checkpoint) boost::filesystem::remove(checkpointFile); //The run is complete, so there's nothing left to resume
+    return 0;
+}
 
-        baseCoverage.close();
-        time(&t2);
-        if (VERBOSITY)
+void writeReport(SampleState &state, const Sample &sample, const RunSettings &settings)
+{
+    const int VERBOSITY = state.options.verbosity;
+    const unsigned int DETECTION_THRESHOLD = state.options.detectionThreshold;
+    Metrics &counter = state.counter; //main tracker for various metrics
+    BiasCounter &bias = state.bias;
+    BaseCoverage &baseCoverage = state.baseCoverage;
+    FeatureCounts &counts = state.counts;
+    const unsigned long long alignmentCount = state.alignmentCount;
+    const int readLength = state.readLength;
+    if (VERBOSITY) cout << "Estimating library complexity..." << endl;
+    counter.increment(Metrics::TotalReads, alignmentCount);
+    double duplicates = static_cast<double>(counter.get(Metrics::DuplicatePairs));
+    double unique = static_cast<double>(counter.get(Metrics::UniqueFragments));
+    double numReads = duplicates + unique;
+    unsigned int minReads = 0u, minError = UINT_MAX;
+    if (duplicates > 0)
+    {
+        //If there are no duplicates, the estimate is useless, so skip it
+        for (double x = unique; x < 1e9; ++x)
         {
-            cout<< "Time Elapsed: " << difftime(t2, t1) << "; Alignments processed: " << alignmentCount << endl;
-            cout << "Total runtime: " << difftime(t2, t0) << "; Total CPU Time: " << (clock() - start_clock)/CLOCKS_PER_SEC << endl;
-            if (VERBOSITY > 1) cout << "Average Reads/Sec: " << static_cast<double>(alignmentCount) / difftime(t2, t1) << endl;
-            cout << "Estimating library complexity..." << endl;
+            double estimate = x * (1.0 - exp(-1.0 * numReads / x)); //lander-waterman
+            unsigned int error = static_cast<unsigned int>(fabs(estimate - unique));
+            if (error < minError)
+            {
+                minError = error;
+                minReads = static_cast<unsigned int>(x);
+            }
         }
-        counter.increment("Total Reads", alignmentCount);
-        double duplicates = static_cast<double>(counter.get("Duplicate Pairs"));
-        double unique = static_cast<double>(counter.get("Unique Fragments"));
-        double numReads = duplicates + unique;
-        unsigned int minReads = 0u, minError = UINT_MAX;
-        if (duplicates > 0)
+    }
+    
+    if (VERBOSITY) cout << "Generating report" << endl;
+    
+    //gene coverage report generation
+    unsigned int genesDetected = 0;
+    double fragmentMed = 0.0;
+    double gcBias = 0.0;
+    vector<double> ratios;
+    {
+        ofstream geneReport(settings.outputDir+"/"+sample.name+".gene_reads.gct");
+        ofstream geneRPKM(settings.outputDir+"/"+sample.name+".gene_"+(settings.rpkm ? "rpkm" : "tpm")+".gct");
+        ofstream fragmentReport(settings.outputDir+"/"+sample.name+".gene_fragments.gct");
+        vector<double> tpms(geneList.size(), 0.0);
+        geneReport << "#1.2" << endl;
+        geneRPKM << "#1.2" << endl;
+        fragmentReport << "#1.2" << endl;
+        geneReport << geneList.size() << "\t1" << endl;
+        geneRPKM << geneList.size() << "\t1" << endl;
+        fragmentReport << geneList.size() << "\t1" << endl;
+        geneReport << "Name\tDescription\t" << (sample.named ? sample.name : "Counts") << endl;
+        geneRPKM << "Name\tDescription\t" << (sample.named ? sample.name : (settings.rpkm ? "RPKM" : "TPM")) << endl;
+        geneRPKM << fixed;
+        fragmentReport << "Name\tDescription\t" << (sample.named ? sample.name : "Fragments") << endl;
+        const double scaleRPKM = static_cast<double>(counter.get(Metrics::ExonicReads)) / 1000000.0;
+        double scaleTPM = 0.0;
+        for (size_t i = 0; i < geneList.size(); ++i)
         {
-            //If there are no duplicates, the estimate is useless, so skip it
-            for (double x = unique; x < 1e9; ++x)
+            const featureID gene = geneList[i];
+            geneReport << featureNames[gene] << "\t" << geneNames[gene] << "\t" << static_cast<long>(counts.geneCounts[i]) << endl;
+            fragmentReport << featureNames[gene] << "\t" << geneNames[gene] << "\t" << static_cast<long>(counts.geneFragmentCounts[i]) << endl;
+
+#ifndef NO_FASTA
+            //If fasta features were enabled, get the gc content coverage bias from this gene
+            if (settings.reference.length() && geneCoverage[gene]) gcBias += gc(geneSeqs[gene]) / static_cast<double>(geneList.size());
+#endif
+            
+            if (settings.rpkm)
             {
-                double estimate = x * (1.0 - exp(-1.0 * numReads / x)); //lander-waterman
-                unsigned int error = static_cast<unsigned int>(fabs(estimate - unique));
-                if (error < minError)
-                {
-                    minError = error;
-                    minReads = static_cast<unsigned int>(x);
-                }
+                double RPKM = (1000.0 * counts.geneCounts[i] / scaleRPKM) / static_cast<double>(geneCodingLengths[gene]);
+                geneRPKM << featureNames[gene] << "\t" << geneNames[gene] << "\t" << RPKM << endl;
             }
+            else
+            {
+                double TPM = (1000.0 * counts.geneCounts[i]) / static_cast<double>(geneCodingLengths[gene]);
+                tpms[i] = TPM;
+                scaleTPM += TPM;
+            }
+            // Gene 'detection' depends only on unique reads, discounting duplicates
+            if (counts.uniqueGeneCounts[i] >= DETECTION_THRESHOLD) ++genesDetected;
+            double geneBias = bias.getBias(gene);
+            assert(geneBias == -1.0 || (geneBias >= 0.0 && geneBias <= 1.0));
+            if (geneBias != -1.0) ratios.push_back(geneBias);
+        }
+        geneReport.close();
+        if (!settings.rpkm)
+        {
+            scaleTPM /= 1000000.0;
+            for (size_t i = 0; i < geneList.size(); ++i)
+                geneRPKM << featureNames[geneList[i]] << "\t" << geneNames[geneList[i]] << "\t" << tpms[i] / scaleTPM << endl;
+        }
+        geneRPKM.close();
+    
+    }
+    
+    //3'/5' coverage ratio calculations
+    double ratioAvg = 0.0, ratioMedDev = 0.0, ratioMedian = 0.0, ratioStd = 0.0, ratio75 = 0.0, ratio25 = 0.0;
+    if (ratios.size())
+    {
+        vector<double> ratioDeviations;
+        sort(ratios.begin(), ratios.end());
+        ratioMedian = computeMedian(ratios.size(), ratios.begin());
+        for (auto ratio = ratios.begin(); ratio != ratios.end(); ++ratio)
+        {
+            ratioAvg += (*ratio)/static_cast<double>(ratios.size());
+            ratioDeviations.push_back(fabs((*ratio) - ratioMedian));
+        }
+        sort(ratioDeviations.begin(), ratioDeviations.end());
+        ratioMedDev = computeMedian(ratioDeviations.size(), ratioDeviations.begin()) * MAD_FACTOR;
+        for (auto ratio = ratios.begin(); ratio != ratios.end(); ++ratio)
+        {
+            ratioStd += pow((*ratio) - ratioAvg, 2.0) / static_cast<double>(ratios.size());
+        }
+        ratioStd = pow(ratioStd, 0.5); //compute the standard deviation
+        double index = .25 * ratios.size();
+        if (index > floor(index))
+        {
+            index = ceil(index);
+            ratio25 = ratios[static_cast<int>(index)];
+        }
+        else
+        {
+            index = ceil(index);
+            ratio25 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index)])/2.0;
+        }
+        index = .75 * ratios.size();
+        if (index > floor(index))
+        {
+            index = ceil(index);
+            ratio75 = ratios[static_cast<int>(index)];
+        }
+        else
+        {
+            index = ceil(index);
+            ratio75 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index)])/2.0;
+        }
+    }
+    //exon coverage report generation
+    {
+        ofstream exonReport(settings.outputDir+"/"+sample.name+".exon_reads.gct");
+        exonReport << "#1.2" << endl;
+        exonReport << count_if(counts.exonCounts.begin(), counts.exonCounts.end(), [](double count) {return count > 0.0;}) << "\t1" << endl; //Only exons with coverage
+        exonReport << "Name\tDescription\t" << (sample.named ? sample.name : "Counts") << endl;
+        exonReport << fixed;
+        for (size_t i = 0; i < exonList.size(); ++i)
+        {
+            exonReport << featureNames[exonList[i]] << "\t" << geneNames[exonList[i]] << "\t" << counts.exonCounts[i] << endl;
         }
+        exonReport.close();
+    }
+    
+    ofstream output(settings.outputDir+"/"+sample.name+".metrics.tsv");
+    //output rates and other fractions to the report
+    output << "Sample\t" << sample.name << endl;
+    output << "Mapping Rate\t" << counter.frac(Metrics::MappedReads, Metrics::QCPassedReads) << endl;
+    output << "Unique Rate of Mapped\t" << counter.frac(Metrics::MappedUniqueReads, Metrics::MappedReads) << endl;
+    output << "Duplicate Rate of Mapped\t" << counter.frac(Metrics::MappedDuplicateReads, Metrics::MappedReads) << endl;
+    output << "Duplicate Rate of Mapped, excluding Globins\t" << counter.frac(Metrics::NonGlobinDuplicateReads, Metrics::NonGlobinReads) << endl;
+    output << "Base Mismatch\t" << counter.frac(Metrics::MismatchedBases, Metrics::TotalBases) << endl;
+    output << "End 1 Mapping Rate\t"<< 2.0 * counter.frac(Metrics::End1MappedReads, Metrics::QCPassedReads) << endl;
+    output << "End 2 Mapping Rate\t"<< 2.0 * counter.frac(Metrics::End2MappedReads, Metrics::QCPassedReads) << endl;
+    output << "End 1 Mismatch Rate\t" << counter.frac(Metrics::End1Mismatches, Metrics::End1Bases) << endl;
+    output << "End 2 Mismatch Rate\t" << counter.frac(Metrics::End2Mismatches, Metrics::End2Bases) << endl;
+    output << "Expression Profiling Efficiency\t" << counter.frac(Metrics::ExonicReads, Metrics::QCPassedReads) << endl;
+    output << "High Quality Rate\t" << counter.frac(Metrics::HighQualityReads, Metrics::MappedReads) << endl;
+    output << "Exonic Rate\t" << counter.frac(Metrics::ExonicReads, Metrics::MappedReads) << endl;
+    output << "Intronic Rate\t" << counter.frac(Metrics::IntronicReads, Metrics::MappedReads) << endl;
+    output << "Intergenic Rate\t" << counter.frac(Metrics::IntergenicReads, Metrics::MappedReads) << endl;
+    output << "Intragenic Rate\t" << counter.frac(Metrics::IntragenicReads, Metrics::MappedReads) << endl;
+    output << "Ambiguous Alignment Rate\t" << counter.frac(Metrics::AmbiguousReads, Metrics::MappedReads) << endl;
+    output << "High Quality Exonic Rate\t" << counter.frac(Metrics::HQExonicReads, Metrics::HighQualityReads) << endl;
+    output << "High Quality Intronic Rate\t" << counter.frac(Metrics::HQIntronicReads, Metrics::HighQualityReads) << endl;
+    output << "High Quality Intergenic Rate\t" << counter.frac(Metrics::HQIntergenicReads, Metrics::HighQualityReads) << endl;
+    output << "High Quality Intragenic Rate\t" << counter.frac(Metrics::HQIntragenicReads, Metrics::HighQualityReads) << endl;
+    output << "High Quality Ambiguous Alignment Rate\t" << counter.frac(Metrics::HQAmbiguousReads, Metrics::HighQualityReads) << endl;
+    output << "Discard Rate\t" << static_cast<double>(counter.get(Metrics::MappedReads) - counter.get(Metrics::ReadsUsedForCounts)) / counter.get(Metrics::MappedReads) << endl;
+    output << "rRNA Rate\t" << counter.frac(Metrics::RRNAReads, Metrics::MappedReads) << endl;
+    output << "End 1 Sense Rate\t" << static_cast<double>(counter.get(Metrics::End1Sense)) / (counter.get(Metrics::End1Sense) + counter.get(Metrics::End1Antisense)) << endl;
+    output << "End 2 Sense Rate\t" << static_cast<double>(counter.get(Metrics::End2Sense)) / (counter.get(Metrics::End2Sense) + counter.get(Metrics::End2Antisense)) << endl;
+    output << "Avg. Splits per Read\t" << counter.frac(Metrics::AlignmentBlocks, Metrics::MappedReads) - 1.0 << endl;
+    //automatically dump the raw counts of all metrics to the file
+    output << counter;
+    //append metrics that were manually tracked
+    output << "Read Length\t" << readLength << endl;
+    output << "Genes Detected\t" << genesDetected << endl;
+    output << "Estimated Library Complexity\t" << minReads << endl;
+    output << "Genes used in 3' bias\t" << bias.countGenes() << endl;
+    output << "Mean 3' bias\t" << ratioAvg << endl;
+    output << "Median 3' bias\t" << ratioMedian << endl;
+    output << "3' bias Std\t" << ratioStd << endl;
+    output << "3' bias MAD_Std\t" << ratioMedDev << endl;
+    output << "3' Bias, 25th Percentile\t" << ratio25 << endl;
+    output << "3' Bias, 75th Percentile\t" << ratio75 << endl;
 
-        if (VERBOSITY) cout << "Generating report" << endl;
+#ifndef NO_FASTA
+    if (settings.reference.length()) output << "Mean Weighted GC Content\t" << gcBias << endl;
+#endif
+    
+    map<long long, unsigned long> fragmentSizes; //fragment size -> count of samples
+    for (auto size = state.fragmentSizes.begin(); size != state.fragmentSizes.end(); ++size) fragmentSizes[*size] += 1;
+    if (fragmentSizes.size())
+    {
+        //If any fragment size samples were taken, also generate a fragment size report
+        double fragmentAvg = 0.0, fragmentStd = 0.0, fragmentMedDev = 0.0;
+        // fragments stores {size -> count}
+        // But we need to unpack that into a regular list to get metrics
+        list<long long> dumb_fragment_expansion_list;
+        for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
+            for(unsigned long i = 0u; i < fragment->second; ++i) dumb_fragment_expansion_list.push_back(fragment->first);
+        dumb_fragment_expansion_list.sort();
+        double size = static_cast<double>(dumb_fragment_expansion_list.size());
+        vector<double> deviations; //list of recorded deviations from the median
+        fragmentMed = computeMedian(size, dumb_fragment_expansion_list.begin());
+        ofstream fragmentList(settings.outputDir+"/"+sample.name+".fragmentSizes.txt"); //raw list of each fragment size recorded
+        fragmentList << "Fragment Size\tCount" << endl;
+        for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
+        {
+            fragmentList << fragment->first << "\t" << fragment->second << endl; //record the fragment size into the output list
+            fragmentAvg += static_cast<double>(fragment->first * fragment->second) / size; //add this fragment's size to the mean
+            double deviation = fabs(static_cast<double>(fragment->first) - fragmentMed);
+            for(unsigned long i = 0u; i < fragment->second; ++i) deviations.push_back(deviation); //record this fragment's deviation
+        }
+        fragmentList.close();
+        sort(deviations.begin(), deviations.end()); //for the next line to work, we have to sort
+        //now compute the median absolute deviation, an estimator for standard deviation
+        fragmentMedDev = computeMedian(deviations.size(), deviations.begin()) * MAD_FACTOR;
+        //we have to iterate again now for the standard deviation calculation, now that we know the mean
+        for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
+        {
+            for(unsigned long i = 0u; i < fragment->second; ++i) fragmentStd += pow(static_cast<double>(fragment->first) - fragmentAvg, 2.0) / size;
+        }
+        fragmentStd = pow(fragmentStd, 0.5); //compute the standard deviation
+        
+        output << "Average Fragment Length\t" << fragmentAvg << endl;
+        output << "Fragment Length Median\t" << fragmentMed << endl;
+        output << "Fragment Length Std\t" << fragmentStd << endl;
+        output << "Fragment Length MAD_Std\t" << fragmentMedDev << endl;
+    }
+    
+    {
+        list<double> means = baseCoverage.getGeneMeans(), stdDevs = baseCoverage.getGeneStds(), cvs = baseCoverage.getGeneCVs();
+        const unsigned long nTranscripts = means.size();
+        means.sort();
+        stdDevs.sort();
+        auto beg = cvs.begin();
+        auto end = cvs.end();
+        while (beg != end)
+        {
+            if (std::isnan(*beg) || std::isinf(*beg)) cvs.erase(beg++);
+            else ++beg;
+        }
+        cvs.sort();
+        //You may need to disable _GLIBCXX_USE_CXX11_ABI in order to compile this program, but that ends up
+        //using the old implimentation of list which has to walk the entire sequence to determine size
+        //so we just do it once and store it in a variable
+        const unsigned long nCVS = cvs.size();
+        output << "Median of Avg Transcript Coverage\t" << computeMedian(nTranscripts, means.begin()) << endl;
+        output << "Median of Transcript Coverage Std\t" << computeMedian(nTranscripts, stdDevs.begin()) << endl;
+        output << "Median of Transcript Coverage CV\t" << (nCVS ? computeMedian(nCVS, cvs.begin()) : 0.0) << endl;
+        list<double> totalExonCV = baseCoverage.getExonCVs();
+        totalExonCV.sort();
+        const unsigned long nExonCVs = totalExonCV.size();
+        double exonMedian = nExonCVs ? computeMedian(totalExonCV.size(), totalExonCV.begin()) : 0.0;
+        vector<double> exonDeviations;
+        for (auto cv = totalExonCV.begin(); cv != totalExonCV.end(); ++cv) exonDeviations.push_back(fabs((*cv) - exonMedian));
+        sort(exonDeviations.begin(), exonDeviations.end());
+        output << "Median Exon CV\t" << exonMedian << endl;
+        output << "Exon CV MAD\t" << (nExonCVs ? computeMedian(exonDeviations.size(), exonDeviations.begin()) * MAD_FACTOR : 0.0) << endl;
+    }
+    
+    output.close();
+}
 
-        //gene coverage report generation
-        unsigned int genesDetected = 0;
-        double fragmentMed = 0.0;
-        double gcBias = 0.0;
-        vector<double> ratios;
+int loadAnnotation(const string &gtfFilename, const string &reference, bool legacy, int VERBOSITY, unsigned int threads, map<chrom, ContigFeatures> &features)
+{
+    const bool indexed = isAnnotationIndex(gtfFilename);
+    bool rebuild = !indexed; //Whether the exons of each gene need to be listed again, rather than taken from the index
+    //Parse the GTF and extract features
+    {
+#ifndef NO_FASTA
+        Fasta fastaReader;
+        if (reference.length())
         {
-            ofstream geneReport(outputDir.Get()+"/"+SAMPLENAME+".gene_reads.gct");
-            ofstream geneRPKM(outputDir.Get()+"/"+SAMPLENAME+".gene_"+(useRPKM.Get() ? "rpkm" : "tpm")+".gct");
-            ofstream fragmentReport(outputDir.Get()+"/"+SAMPLENAME+".gene_fragments.gct");
-            geneReport << "#1.2" << endl;
-            geneRPKM << "#1.2" << endl;
-            fragmentReport << "#1.2" << endl;
-            geneReport << geneList.size() << "\t1" << endl;
-            geneRPKM << geneList.size() << "\t1" << endl;
-            fragmentReport << geneList.size() << "\t1" << endl;
-            geneReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Counts") << endl;
-            geneRPKM << "Name\tDescription\t" << (sampleName ? sampleName.Get() : (useRPKM.Get() ? "RPKM" : "TPM")) << endl;
-            geneRPKM << fixed;
-            fragmentReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Fragments") << endl;
-            const double scaleRPKM = static_cast<double>(counter.get("Exonic Reads")) / 1000000.0;
-            double scaleTPM = 0.0;
-            for(auto gene = geneList.begin(); gene != geneList.end(); ++gene)
-            {
-                geneReport << *gene << "\t" << geneNames[*gene] << "\t" << static_cast<long>(geneCounts[*gene]) << endl;
-                fragmentReport << *gene << "\t" << geneNames[*gene] << "\t" << static_cast<long>(geneFragmentCounts[*gene]) << endl;
-                
+            fastaReader.open(reference);
+            if (VERBOSITY > 1) cout << "A FASTA has been provided. This will enable GC-content statistics but will slow down the initial startup..." << endl;
+        }
+#endif
+        
+        if (indexed)
+        {
+            if (VERBOSITY) cout<<"Loading annotation index..."<<endl;
+            readAnnotationIndex(gtfFilename, features);
 #ifndef NO_FASTA
-                //If fasta features were enabled, get the gc content coverage bias from this gene
-                if (fastaFile && geneCoverage[*gene]) gcBias += gc(geneSeqs[*gene]) / static_cast<double>(geneList.size());
+            if (reference.length()) geneSeqs.resize(featureNames.size());
 #endif
-                
-                if (useRPKM.Get())
+            for (auto contig = features.begin(); contig != features.end(); ++contig)
+            {
+                //Contigs stay mapped from the index unless legacy mode excludes some of their features
+                ContigFeatures &source = contig->second;
+                ContigFeatures kept;
+                kept.chromosome = source.chromosome;
+                bool excluded = false;
+                for (size_t i = source.cursor; i < source.starts.size(); ++i)
                 {
-                    double RPKM = (1000.0 * geneCounts[*gene] / scaleRPKM) / static_cast<double>(geneCodingLengths[*gene]);
-                    geneRPKM << *gene << "\t" << geneNames[*gene] << "\t" << RPKM << endl;
+                    if(legacy && (source.flags[i] & ContigFeatures::SINGLE_BASE))
+                    {
+                        //legacy code excludes single base exons
+                        if (VERBOSITY > 1) cerr<<"Legacy mode excluded feature: " << featureNames[source.ids[i]] << endl;
+                        if (source.type(i) == FeatureType::Exon) geneCodingLengths.edit(source.genes[i]) -= 1;
+                        if (!excluded) for (size_t j = source.cursor; j < i; ++j) kept.append(source, j);
+                        excluded = true;
+                        continue;
+                    }
+#ifndef NO_FASTA
+                    if (reference.length() && source.type(i) == FeatureType::Gene)
+                    {
+                        Feature gene = source.get(i);
+                        geneSeqs[gene.feature_id] = fastaReader.getSeq(gene.chromosome, gene.start - 1, gene.end, gene.strand);
+                    }
+#endif
+                    if (excluded) kept.append(source, i);
                 }
-                else
+                if (excluded)
                 {
-                    double TPM = (1000.0 * geneCounts[*gene]) / static_cast<double>(geneCodingLengths[*gene]);
-                    tpms[*gene] = TPM;
-                    scaleTPM += TPM;
+                    source.swap(kept);
+                    rebuild = true;
                 }
-                // Gene 'detection' depends only on unique reads, discounting duplicates
-                if (uniqueGeneCounts[*gene] >= DETECTION_THRESHOLD) ++genesDetected;
-                double geneBias = bias.getBias(*gene);
-                assert(geneBias == -1.0 || (geneBias >= 0.0 && geneBias <= 1.0));
-                if (geneBias != -1.0) ratios.push_back(geneBias);
-            }
-            geneReport.close();
-            if (!useRPKM.Get())
-            {
-                scaleTPM /= 1000000.0;
-                for(auto gene = geneList.begin(); gene != geneList.end(); ++gene)
-                    geneRPKM << *gene << "\t" << geneNames[*gene] << "\t" << tpms[*gene] / scaleTPM << endl;
             }
-            geneRPKM.close();
-
         }
-
-        //3'/5' coverage ratio calculations
-        double ratioAvg = 0.0, ratioMedDev = 0.0, ratioMedian = 0.0, ratioStd = 0.0, ratio75 = 0.0, ratio25 = 0.0;
-        if (ratios.size())
+        else
         {
-            vector<double> ratioDeviations;
-            sort(ratios.begin(), ratios.end());
-            ratioMedian = computeMedian(ratios.size(), ratios.begin());
-            for (auto ratio = ratios.begin(); ratio != ratios.end(); ++ratio)
-            {
-                ratioAvg += (*ratio)/static_cast<double>(ratios.size());
-                ratioDeviations.push_back(fabs((*ratio) - ratioMedian));
-            }
-            sort(ratioDeviations.begin(), ratioDeviations.end());
-            ratioMedDev = computeMedian(ratioDeviations.size(), ratioDeviations.begin()) * MAD_FACTOR;
-            for (auto ratio = ratios.begin(); ratio != ratios.end(); ++ratio)
-            {
-                ratioStd += pow((*ratio) - ratioAvg, 2.0) / static_cast<double>(ratios.size());
-            }
-            ratioStd = pow(ratioStd, 0.5); //compute the standard deviation
-            double index = .25 * ratios.size();
-            if (index > floor(index))
-            {
-                index = ceil(index);
-                ratio25 = ratios[static_cast<int>(index)];
-            }
-            else
-            {
-                index = ceil(index);
-                ratio25 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index)])/2.0;
-            }
-            index = .75 * ratios.size();
-            if (index > floor(index))
+            Feature line; //current feature being read from the gtf
+            map<chrom, list<Feature> > parsed;
+            GTFReader reader(gtfFilename, threads);
+            if (!reader.is_open())
             {
-                index = ceil(index);
-                ratio75 = ratios[static_cast<int>(index)];
+                cerr << "Unable to open GTF file: " << gtfFilename << endl;
+                return 10;
             }
-            else
+            
+            if (VERBOSITY) cout<<"Reading GTF Features..."<<endl;
+            while ((reader >> line))
             {
-                index = ceil(index);
-                ratio75 = (ratios[static_cast<int>(index)] + ratios[static_cast<int>(index)])/2.0;
+                if(legacy && line.end == line.start)
+                {
+                    //legacy code excludes single base exons
+                    if (VERBOSITY > 1) cerr<<"Legacy mode excluded feature: " << featureNames[line.feature_id] << endl;
+                    if (line.type == FeatureType::Exon) geneCodingLengths.edit(line.gene_id) -= 1;
+                    continue;
+                }
+                //Just keep genes and exons.  We don't care about transcripts or any other feature types
+                if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
+                {
+                    parsed[line.chromosome].push_back(line);
+#ifndef NO_FASTA
+                    //If fasta features are enabled, read the gene sequence from the fasta 
+                    if (reference.length() && line.type == FeatureType::Gene) geneSeqs[line.feature_id] = fastaReader.getSeq(line.chromosome, line.start - 1, line.end, line.strand);
+#endif
+            
+                }
             }
-        }
-        //exon coverage report generation
-        {
-            ofstream exonReport(outputDir.Get()+"/"+SAMPLENAME+".exon_reads.gct");
-            exonReport << "#1.2" << endl;
-            exonReport << exonCounts.size() << "\t1" << endl;
-            exonReport << "Name\tDescription\t" << (sampleName ? sampleName.Get() : "Counts") << endl;
-            exonReport << fixed;
-            for(auto exon = exonList.begin(); exon != exonList.end(); ++exon)
+            //ensure that the features are sorted.  This MUST be true for the exon alignment metrics
+            //Indexes are stored sorted and packed
+            for (auto contig = parsed.begin(); contig != parsed.end(); ++contig)
             {
-                exonReport << *exon << "\t" << geneNames[*exon] << "\t" << exonCounts[*exon] << endl;
+                contig->second.sort(compIntervalStart);
+                ContigFeatures &packed = features[contig->first];
+                packed.chromosome = contig->first;
+                for (auto feat = contig->second.begin(); feat != contig->second.end(); ++feat) packed.push_back(*feat);
+                contig->second.clear();
             }
-            exonReport.close();
         }
+    }
+    if (VERBOSITY > 1) cout << "Processing GTF Features..." << endl;
+    if (rebuild)
+    {
+        vector<vector<featureID> > exons(featureNames.size());
+        for (auto beg = features.begin(); beg != features.end(); ++beg)
+            for (size_t i = beg->second.cursor; i < beg->second.starts.size(); ++i)
+                if (beg->second.type(i) == FeatureType::Exon) exons[beg->second.genes[i]].push_back(beg->second.ids[i]);
+        exonsForGene = MappedLists<featureID>(exons);
+    }
+    //Build the lookups once, so that every sample in a batch shares them. Indexed contigs already have theirs
+    for (auto beg = features.begin(); beg != features.end(); ++beg) beg->second.refreshIndex();
+    if (!(geneList.size() && exonList.size()))
+    {
+        cerr << "There were either no genes or no exons in the GTF" << endl;
+        cerr << geneList.size() << " genes parsed" << endl;
+        cerr << exonList.size() << " exons parsed" << endl;
+        return 11;
+    }
+    flagGlobins();
+    return 0;
+}
 
-        ofstream output(outputDir.Get()+"/"+SAMPLENAME+".metrics.tsv");
-        //output rates and other fractions to the report
-        output << "Sample\t" << SAMPLENAME << endl;
-        output << "Mapping Rate\t" << counter.frac("Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "Unique Rate of Mapped\t" << counter.frac("Mapped Unique Reads", "Mapped Reads") << endl;
-        output << "Duplicate Rate of Mapped\t" << counter.frac("Mapped Duplicate Reads", "Mapped Reads") << endl;
-        output << "Duplicate Rate of Mapped, excluding Globins\t" << counter.frac("Non-Globin Duplicate Reads", "Non-Globin Reads") << endl;
-        output << "Base Mismatch\t" << counter.frac("Mismatched Bases", "Total Bases") << endl;
-        output << "End 1 Mapping Rate\t"<< 2.0 * counter.frac("End 1 Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "End 2 Mapping Rate\t"<< 2.0 * counter.frac("End 2 Mapped Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "End 1 Mismatch Rate\t" << counter.frac("End 1 Mismatches", "End 1 Bases") << endl;
-        output << "End 2 Mismatch Rate\t" << counter.frac("End 2 Mismatches", "End 2 Bases") << endl;
-        output << "Expression Profiling Efficiency\t" << counter.frac("Exonic Reads", "Unique Mapping, Vendor QC Passed Reads") << endl;
-        output << "High Quality Rate\t" << counter.frac("High Quality Reads", "Mapped Reads") << endl;
-        output << "Exonic Rate\t" << counter.frac("Exonic Reads", "Mapped Reads") << endl;
-        output << "Intronic Rate\t" << counter.frac("Intronic Reads", "Mapped Reads") << endl;
-        output << "Intergenic Rate\t" << counter.frac("Intergenic Reads", "Mapped Reads") << endl;
-        output << "Intragenic Rate\t" << counter.frac("Intragenic Reads", "Mapped Reads") << endl;
-        output << "Ambiguous Alignment Rate\t" << counter.frac("Ambiguous Reads", "Mapped Reads") << endl;
-        output << "High Quality Exonic Rate\t" << counter.frac("HQ Exonic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intronic Rate\t" << counter.frac("HQ Intronic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intergenic Rate\t" << counter.frac("HQ Intergenic Reads", "High Quality Reads") << endl;
-        output << "High Quality Intragenic Rate\t" << counter.frac("HQ Intragenic Reads", "High Quality Reads") << endl;
-        output << "High Quality Ambiguous Alignment Rate\t" << counter.frac("HQ Ambiguous Reads", "High Quality Reads") << endl;
-        output << "Discard Rate\t" << static_cast<double>(counter.get("Mapped Reads") - counter.get("Reads used for Intron/Exon counts")) / counter.get("Mapped Reads") << endl;
-        output << "rRNA Rate\t" << counter.frac("rRNA Reads", "Mapped Reads") << endl;
-        output << "End 1 Sense Rate\t" << static_cast<double>(counter.get("End 1 Sense")) / (counter.get("End 1 Sense") + counter.get("End 1 Antisense")) << endl;
-        output << "End 2 Sense Rate\t" << static_cast<double>(counter.get("End 2 Sense")) / (counter.get("End 2 Sense") + counter.get("End 2 Antisense")) << endl;
-        output << "Avg. Splits per Read\t" << counter.frac("Alignment Blocks", "Mapped Reads") - 1.0 << endl;
-        //automatically dump the raw counts of all metrics to the file
-        output << counter;
-        //append metrics that were manually tracked
-        output << "Read Length\t" << readLength << endl;
-        output << "Genes Detected\t" << genesDetected << endl;
-        output << "Estimated Library Complexity\t" << minReads << endl;
-        output << "Genes used in 3' bias\t" << bias.countGenes() << endl;
-        output << "Mean 3' bias\t" << ratioAvg << endl;
-        output << "Median 3' bias\t" << ratioMedian << endl;
-        output << "3' bias Std\t" << ratioStd << endl;
-        output << "3' bias MAD_Std\t" << ratioMedDev << endl;
-        output << "3' Bias, 25th Percentile\t" << ratio25 << endl;
-        output << "3' Bias, 75th Percentile\t" << ratio75 << endl;
-        
-#ifndef NO_FASTA
-        if (fastaFile) output << "Mean Weighted GC Content\t" << gcBias << endl;
-#endif
+RunHeader describeRun(const Sample &sample, const rnaseqc::Options &options, const RunSettings &settings, const SeqLib::HeaderSequenceVector &sequences)
+{
+    RunHeader header;
+    header.version = VERSION;
+    header.sample = sample;
+    header.options = options;
+    header.rpkm = settings.rpkm;
+    header.writeCoverage = settings.writeCoverage;
+    header.genes = geneList.size();
+    header.exons = exonList.size();
+    header.annotation = settings.annotation;
+    for (auto sequence = sequences.begin(); sequence != sequences.end(); ++sequence) header.contigs.push_back(make_pair(sequence->Name, static_cast<int64_t>(sequence->Length)));
+    return header;
+}
+
+bool sameRun(const RunHeader &a, const RunHeader &b)
+{
+    return a.version == b.version && a.sample.name == b.sample.name && a.sample.named == b.sample.named && a.options == b.options && a.rpkm == b.rpkm && a.writeCoverage == b.writeCoverage && a.genes == b.genes && a.exons == b.exons && a.annotation == b.annotation && a.contigs == b.contigs;
+}
+
+void writeRunHeader(ostream &output, const string &magic, const RunHeader &header)
+{
+    output.write(magic.data(), magic.size());
+    writeBinary(output, STATE_VERSION);
+    writeBinary(output, header.version);
+    writeBinary(output, header.sample.name);
+    writeBinary(output, header.sample.named);
+    saveOptions(output, header.options);
+    writeBinary(output, header.rpkm);
+    writeBinary(output, header.writeCoverage);
+    writeBinary(output, header.genes);
+    writeBinary(output, header.exons);
+    writeBinary(output, header.annotation);
+    writeBinary(output, header.contigs);
+}
+
+RunHeader readRunHeader(istream &input, const string &magic, const string &filename)
+{
+    RunHeader header;
+    string fileMagic(magic.size(), '\0');
+    uint32_t version;
+    if (!input.read(&fileMagic[0], fileMagic.size()) || fileMagic != magic) throw fileException("Not an RNA-SeQC " + string(magic == PARTIAL_MAGIC ? "partial state" : "checkpoint") + " file: " + filename);
+    readBinary(input, version);
+    if (version != STATE_VERSION) throw fileException("Unsupported state file version (" + to_string(version) + "): " + filename);
+    readBinary(input, header.version);
+    readBinary(input, header.sample.name);
+    readBinary(input, header.sample.named);
+    loadOptions(input, header.options);
+    readBinary(input, header.rpkm);
+    readBinary(input, header.writeCoverage);
+    readBinary(input, header.genes);
+    readBinary(input, header.exons);
+    readBinary(input, header.annotation);
+    readBinary(input, header.contigs);
+    return header;
+}
+
+void writePartial(const Sample &sample, const rnaseqc::Options &options, const RunSettings &settings, const SeqLib::HeaderSequenceVector &sequences, const vector<unique_ptr<RegionWork> > &units)
+{
+    const string filename = settings.outputDir + "/" + sample.name + ".partial";
+    ofstream output(filename, ios::binary);
+    if (!output.is_open()) throw fileException("Unable to open partial state file: " + filename);
+    writeRunHeader(output, PARTIAL_MAGIC, describeRun(sample, options, settings, sequences));
+    saveRegions(output, units);
+    output.close();
+    if (output.fail()) throw fileException("Unable to write partial state file: " + filename);
+}
+
+void writeCheckpoint(const string &filename, const RunHeader &run, SampleState &state, int64_t offset)
+{
+    //Written to a temporary file first, so that a run killed while saving can still resume from the previous checkpoint
+    const string tmpFilename = filename + ".tmp";
+    ofstream output(tmpFilename, ios::binary);
+    if (!output.is_open()) throw fileException("Unable to open checkpoint file: " + tmpFilename);
+    writeRunHeader(output, CHECKPOINT_MAGIC, run);
+    writeBinary(output, offset);
+    state.checkpoint(output);
+    output.close();
+    if (output.fail()) throw fileException("Unable to write checkpoint file: " + tmpFilename);
+    if (rename(tmpFilename.c_str(), filename.c_str())) throw fileException("Unable to replace checkpoint file: " + filename);
+}
+
+int64_t restoreCheckpoint(const string &filename, const RunHeader &run, SampleState &state)
+{
+    ifstream input(filename, ios::binary);
+    if (!input.is_open()) throw fileException("Unable to open checkpoint file: " + filename);
+    if (!sameRun(readRunHeader(input, CHECKPOINT_MAGIC, filename), run)) throw ValidationError("The checkpoint " + filename + " was saved by a run with different inputs or options. Delete it to start over");
+    int64_t offset;
+    readBinary(input, offset);
+    state.restore(input);
+    return offset;
+}
+
+int mergeMain(int argc, char* argv[])
+{
+    ArgumentParser parser(VERSION + " merge", "Combines the partial results written by --region shards of one sample into the same reports as a single run");
+    parser.Prog("rnaseqc merge");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The GTF file which was used to run the shards");
+    Positional<string> outputDir(parser, "output", "Output directory");
+    PositionalList<string> partialFiles(parser, "partial", "The {sample}.partial files written by each shard");
+    CounterFlag verbosity(parser, "verbose", "Give some feedback about what's going on", {'v', "verbose"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!outputDir) throw ValidationError("No output directory provided");
+        if (!partialFiles) throw ValidationError("No partial state files provided");
+        const int VERBOSITY = verbosity ? verbosity.Get() : 0;
+        time_t t0, t1;
+        clock_t start_clock = clock();
+        time(&t0);
         
-        if (fragmentSizes.size())
+        //Read every header up front, so that mismatched shards are reported before the GTF is parsed
+        const vector<string> filenames = partialFiles.Get();
+        vector<unique_ptr<ifstream> > inputs;
+        RunHeader run;
+        for (auto filename = filenames.begin(); filename != filenames.end(); ++filename)
         {
-            //If any fragment size samples were taken, also generate a fragment size report
-            double fragmentAvg = 0.0, fragmentStd = 0.0, fragmentMedDev = 0.0;
-            // fragments stores {size -> count}
-            // But we need to unpack that into a regular list to get metrics
-            list<long long> dumb_fragment_expansion_list;
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-                for(unsigned long i = 0u; i < fragment->second; ++i) dumb_fragment_expansion_list.push_back(fragment->first);
-            dumb_fragment_expansion_list.sort();
-            double size = static_cast<double>(dumb_fragment_expansion_list.size());
-            vector<double> deviations; //list of recorded deviations from the median
-            fragmentMed = computeMedian(size, dumb_fragment_expansion_list.begin());
-            ofstream fragmentList(outputDir.Get()+"/"+SAMPLENAME+".fragmentSizes.txt"); //raw list of each fragment size recorded
-            fragmentList << "Fragment Size\tCount" << endl;
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-            {
-                fragmentList << fragment->first << "\t" << fragment->second << endl; //record the fragment size into the output list
-                fragmentAvg += static_cast<double>(fragment->first * fragment->second) / size; //add this fragment's size to the mean
-                double deviation = fabs(static_cast<double>(fragment->first) - fragmentMed);
-                for(unsigned long i = 0u; i < fragment->second; ++i) deviations.push_back(deviation); //record this fragment's deviation
-            }
-            fragmentList.close();
-            sort(deviations.begin(), deviations.end()); //for the next line to work, we have to sort
-            //now compute the median absolute deviation, an estimator for standard deviation
-            fragmentMedDev = computeMedian(deviations.size(), deviations.begin()) * MAD_FACTOR;
-            //we have to iterate again now for the standard deviation calculation, now that we know the mean
-            for(auto fragment = fragmentSizes.begin(); fragment != fragmentSizes.end(); ++fragment)
-            {
-                for(unsigned long i = 0u; i < fragment->second; ++i) fragmentStd += pow(static_cast<double>(fragment->first) - fragmentAvg, 2.0) / size;
-            }
-            fragmentStd = pow(fragmentStd, 0.5); //compute the standard deviation
-
-            output << "Average Fragment Length\t" << fragmentAvg << endl;
-            output << "Fragment Length Median\t" << fragmentMed << endl;
-            output << "Fragment Length Std\t" << fragmentStd << endl;
-            output << "Fragment Length MAD_Std\t" << fragmentMedDev << endl;
+            inputs.emplace_back(new ifstream(*filename, ios::binary));
+            if (!inputs.back()->is_open()) throw fileException("Unable to open partial state file: " + *filename);
+            RunHeader header = readRunHeader(*inputs.back(), PARTIAL_MAGIC, *filename);
+            if (filename == filenames.begin()) run = header;
+            else if (!sameRun(header, run)) throw ValidationError(*filename + " was not produced by the same run as " + filenames.front());
         }
-
+        if (run.version != VERSION) throw ValidationError("Partial state was written by " + run.version + " and can't be merged by " + VERSION);
+        
+        //Contig IDs are assigned as names are first seen, so the GTF and header are registered in the same order as the shards
+        map<chrom, ContigFeatures> features, bedFeatures; //Fragment sizes were already sampled by the shards, so no BED is needed
+        const int annotationStatus = loadAnnotation(gtfFile.Get(), "", run.options.legacy, VERBOSITY, 0u, features);
+        if (annotationStatus) return annotationStatus;
+        if (geneList.size() != run.genes || exonList.size() != run.exons || annotationChecksum(features) != run.annotation) throw ValidationError("The GTF does not match the one used to run the shards");
+        SeqLib::HeaderSequenceVector sequences;
+        for (auto contig = run.contigs.begin(); contig != run.contigs.end(); ++contig)
         {
-            list<double> means = baseCoverage.getGeneMeans(), stdDevs = baseCoverage.getGeneStds(), cvs = baseCoverage.getGeneCVs();
-            const unsigned long nTranscripts = means.size();
-            means.sort();
-            stdDevs.sort();
-            auto beg = cvs.begin();
-            auto end = cvs.end();
-            while (beg != end)
-            {
-                if (std::isnan(*beg) || std::isinf(*beg)) cvs.erase(beg++);
-                else ++beg;
-            }
-            cvs.sort();
-            //You may need to disable _GLIBCXX_USE_CXX11_ABI in order to compile this program, but that ends up
-            //using the old implimentation of list which has to walk the entire sequence to determine size
-            //so we just do it once and store it in a variable
-            const unsigned long nCVS = cvs.size();
-            output << "Median of Avg Transcript Coverage\t" << computeMedian(nTranscripts, means.begin()) << endl;
-            output << "Median of Transcript Coverage Std\t" << computeMedian(nTranscripts, stdDevs.begin()) << endl;
-            output << "Median of Transcript Coverage CV\t" << (nCVS ? computeMedian(nCVS, cvs.begin()) : 0.0) << endl;
-            list<double> totalExonCV = baseCoverage.getExonCVs();
-            totalExonCV.sort();
-            const unsigned long nExonCVs = totalExonCV.size();
-            double exonMedian = nExonCVs ? computeMedian(totalExonCV.size(), totalExonCV.begin()) : 0.0;
-            vector<double> exonDeviations;
-            for (auto cv = totalExonCV.begin(); cv != totalExonCV.end(); ++cv) exonDeviations.push_back(fabs((*cv) - exonMedian));
-            sort(exonDeviations.begin(), exonDeviations.end());
-            output << "Median Exon CV\t" << exonMedian << endl;
-            output << "Exon CV MAD\t" << (nExonCVs ? computeMedian(exonDeviations.size(), exonDeviations.begin()) * MAD_FACTOR : 0.0) << endl;
+            sequences.push_back(SeqLib::HeaderSequence(contig->first, static_cast<uint32_t>(contig->second)));
+            chromosomeMap(contig->first);
         }
-
-        output.close();
-	}
-    catch (args::Help)
+        
+        if (!boost::filesystem::exists(outputDir.Get())) boost::filesystem::create_directories(outputDir.Get());
+        rnaseqc::Options options = run.options;
+        options.verbosity = VERBOSITY;
+        RunSettings settings;
+        settings.outputDir = outputDir.Get();
+        settings.reference = "";
+        settings.rpkm = run.rpkm;
+        settings.writeCoverage = run.writeCoverage;
+        settings.threads = 0u;
+        settings.workers = 1u;
+        settings.readAhead = 0u;
+        settings.checkpoint = false;
+        settings.resume = false;
+        settings.checkpointInterval = 0u;
+        settings.annotation = run.annotation;
+        settings.start = t0;
+        settings.startClock = start_clock;
+        SampleState output(options, features, bedFeatures, settings.outputDir + "/" + run.sample.name + ".coverage.tsv", settings.writeCoverage);
+        vector<unique_ptr<RegionWork> > units;
+        for (auto input = inputs.begin(); input != inputs.end(); ++input) loadRegions(**input, options, sequences, features, units);
+        stable_sort(units.begin(), units.end(), [](const unique_ptr<RegionWork> &a, const unique_ptr<RegionWork> &b) {
+            return compRegions(a->region, b->region);
+        });
+        for (size_t i = 1; i < units.size(); ++i)
+            if (units[i]->region.tid == units[i-1]->region.tid && (units[i]->region.tid < 0 || units[i]->region.start < units[i-1]->region.end)) throw regionException("Shards overlap on " + (units[i]->region.tid >= 0 ? sequences[units[i]->region.tid].Name : "*"));
+        mergeRegions(units, features, output);
+        output.baseCoverage.close();
+        time(&t1);
+        if (VERBOSITY) cout << "Merged " << units.size() << " regions from " << filenames.size() << " shards in " << difftime(t1, t0) << " seconds; Alignments processed: " << output.alignmentCount << endl;
+        writeReport(output, run.sample, settings);
+        return 0;
+    }
+    catch (const args::Help&)
     {
         cout << parser;
         return 4;
@@ -651,10 +1136,10 @@ int main(int argc, char* argv[])
         cerr << "Argument validation error: " << e.what() << endl;
         return 6;
     }
-    catch (std::invalid_argument &e)
+    catch (regionException &e)
     {
-        cerr << "Invalid argument type provided: " << e.what() << endl;
-        return 7;
+        cerr << "Invalid region: " << e.error << endl;
+        return 6;
     }
     catch (boost::filesystem::filesystem_error &e)
     {
@@ -666,68 +1151,89 @@ int main(int argc, char* argv[])
         cerr << e.error << endl;
         return 10;
     }
-    catch (invalidContigException &e)
-    {
-        cerr << "GTF referenced a contig not present in the FASTA: " << e.error << endl;
-        return 11;
-    }
     catch (gtfException &e)
     {
         cerr << "Failed to parse the GTF: " << e.error << endl;
         return 11;
     }
-    catch (bedException &e)
+    catch (std::bad_alloc &e)
     {
-        cerr << "Failed to parse the BED: " << e.error << endl;
-        return 11;
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
     }
-    catch (std::length_error &e)
+    catch (...)
     {
-        cerr<<"Unable to parse the GFT lines"<<endl;
-        cerr<<e.what()<<endl;
-        return 1;
+        cerr << parser << endl;
+        cerr << "Unknown error" << endl;
+        return -1;
     }
-    catch (std::range_error &e)
+}
+
+int indexMain(int argc, char* argv[])
+{
+    ArgumentParser parser(VERSION + " index-annotation", "Parses a GTF into an annotation index, which can be given to rnaseqc in place of the GTF to skip parsing it on every run");
+    parser.Prog("rnaseqc index-annotation");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file. May be compressed with gzip or bgzip");
+    Positional<string> indexFile(parser, "index", "The annotation index to write");
+    ValueFlag<unsigned int> decompressionThreads(parser, "THREADS", "Number of additional threads used to parse the GTF. Default: 0", {"threads"});
+    CounterFlag verbosity(parser, "verbose", "Give some feedback about what's going on", {'v', "verbose"});
+    try
     {
-        cerr<<"Invalid range"<<endl;
-        cerr<<e.what()<<endl;
-        return 2;
+        parser.ParseCLI(argc, argv);
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!indexFile) throw ValidationError("No output file provided");
+        if (isAnnotationIndex(gtfFile.Get())) throw ValidationError(gtfFile.Get() + " is already an annotation index");
+        const int VERBOSITY = verbosity ? verbosity.Get() : 0;
+        time_t t0, t1;
+        time(&t0);
+        //Parsed without legacy filtering, which is applied when the index is loaded
+        map<chrom, ContigFeatures> features;
+        const int annotationStatus = loadAnnotation(gtfFile.Get(), "", false, VERBOSITY, decompressionThreads ? decompressionThreads.Get() : 0u, features);
+        if (annotationStatus) return annotationStatus;
+        writeAnnotationIndex(indexFile.Get(), features);
+        time(&t1);
+        if (VERBOSITY) cout << "Indexed " << geneList.size() << " genes and " << exonList.size() << " exons in " << difftime(t1, t0) << " seconds" << endl;
+        return 0;
     }
-    catch(std::domain_error &e)
+    catch (const args::Help&)
     {
-        cerr<<"Unable to perform string conversion"<<endl;
-        cerr<<e.what()<<endl;
-        return 3;
+        cout << parser;
+        return 4;
     }
-    catch(ios_base::failure &e)
+    catch (args::ParseError &e)
     {
-        cerr << "Encountered an IO failure" << endl;
-        cerr << e.what() << endl;
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
         return 10;
     }
-    catch(std::bad_alloc &e)
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (std::bad_alloc &e)
     {
         cerr << "Memory allocation failure. Out of memory" << endl;
         cerr << e.what() << endl;
         return 10;
     }
-	catch (...)
-	{
+    catch (...)
+    {
         cerr << parser << endl;
         cerr << "Unknown error" << endl;
         return -1;
-	}
-
-    return 0;
-}
-
-double reduceDeltaCV(list<double> &deltaCV)
-{
-    deltaCV.sort();
-    return computeMedian(deltaCV.size(), deltaCV.begin());
-}
-
-bool compGenes(const string &a, const string &b)
-{
-    return tpms[a] < tpms[b];
+    }
 }
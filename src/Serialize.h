@@ -0,0 +1,134 @@
+//
+//  Serialize.h
+//  RNA-SeQC
+//
+//
+
+#ifndef Serialize_h
+#define Serialize_h
+
+#include "Fasta.h"
+#include <iostream>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <unordered_set>
+#include <utility>
+#include <cstdint>
+#include <type_traits>
+
+namespace rnaseqc {
+    // Binary encoding for partial-state files. Values are written in native byte order,
+    // so shards must be merged on the same architecture that produced them
+    
+    template <typename T> void writeBinary(std::ostream &out, const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be written directly");
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    
+    template <typename T> void readBinary(std::istream &in, T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be read directly");
+        if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) throw fileException("Partial state file is truncated");
+    }
+    
+    inline void writeBinary(std::ostream &out, const std::string &value)
+    {
+        writeBinary(out, static_cast<uint64_t>(value.size()));
+        out.write(value.data(), value.size());
+    }
+    
+    inline void readBinary(std::istream &in, std::string &value)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        value.resize(size);
+        if (size && !in.read(&value[0], size)) throw fileException("Partial state file is truncated");
+    }
+    
+    template <typename K, typename V> void writeBinary(std::ostream &out, const std::pair<K, V> &value)
+    {
+        writeBinary(out, value.first);
+        writeBinary(out, value.second);
+    }
+    
+    template <typename K, typename V> void readBinary(std::istream &in, std::pair<K, V> &value)
+    {
+        readBinary(in, value.first);
+        readBinary(in, value.second);
+    }
+    
+    template <typename T> void writeBinary(std::ostream &out, const std::vector<T> &values)
+    {
+        writeBinary(out, static_cast<uint64_t>(values.size()));
+        for (auto value = values.begin(); value != values.end(); ++value) writeBinary(out, *value);
+    }
+    
+    template <typename T> void readBinary(std::istream &in, std::vector<T> &values)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        values.resize(size);
+        for (auto value = values.begin(); value != values.end(); ++value) readBinary(in, *value);
+    }
+    
+    template <typename T> void writeBinary(std::ostream &out, const std::list<T> &values)
+    {
+        writeBinary(out, static_cast<uint64_t>(values.size()));
+        for (auto value = values.begin(); value != values.end(); ++value) writeBinary(out, *value);
+    }
+    
+    template <typename T> void readBinary(std::istream &in, std::list<T> &values)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        values.resize(size);
+        for (auto value = values.begin(); value != values.end(); ++value) readBinary(in, *value);
+    }
+    
+    template <typename T> void writeBinary(std::ostream &out, const std::unordered_set<T> &values)
+    {
+        writeBinary(out, static_cast<uint64_t>(values.size()));
+        for (auto value = values.begin(); value != values.end(); ++value) writeBinary(out, *value);
+    }
+    
+    template <typename T> void readBinary(std::istream &in, std::unordered_set<T> &values)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            T value;
+            readBinary(in, value);
+            values.insert(std::move(value));
+        }
+    }
+    
+    template <typename K, typename V> void writeBinary(std::ostream &out, const std::map<K, V> &values)
+    {
+        writeBinary(out, static_cast<uint64_t>(values.size()));
+        for (auto entry = values.begin(); entry != values.end(); ++entry)
+        {
+            writeBinary(out, entry->first);
+            writeBinary(out, entry->second);
+        }
+    }
+    
+    template <typename K, typename V> void readBinary(std::istream &in, std::map<K, V> &values)
+    {
+        uint64_t size;
+        readBinary(in, size);
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i)
+        {
+            K key;
+            readBinary(in, key);
+            readBinary(in, values[key]);
+        }
+    }
+}
+
+#endif /* Serialize_h */
@@ -0,0 +1,125 @@
+//
+//  exon_metrics_bench.cpp
+//  RNA-SeQC
+//
+//  Times exonAlignmentMetrics alone on the reads of a bam. The reads are decoded and split into blocks up front,
+//  and each round runs them through fresh counters, so decoding and the other metrics aren't included.
+//  Usage: exon_metrics_bench <gtf> <bam> [rounds]
+//
+
+#include "src/Engine.h"
+#include "src/Expression.h"
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+using namespace rnaseqc;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "Usage: " << argv[0] << " <gtf> <bam> [rounds]" << endl;
+        return 1;
+    }
+    const int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    map<chrom, ContigFeatures> features, bedFeatures;
+    {
+        GTFReader reader(argv[1]);
+        if (!reader.is_open())
+        {
+            cerr << "Unable to open GTF file: " << argv[1] << endl;
+            return 10;
+        }
+        Feature line;
+        map<chrom, list<Feature> > parsed;
+        while ((reader >> line)) if (line.type == FeatureType::Gene || line.type == FeatureType::Exon) parsed[line.chromosome].push_back(line);
+        for (auto contig = parsed.begin(); contig != parsed.end(); ++contig)
+        {
+            contig->second.sort(compIntervalStart);
+            ContigFeatures &packed = features[contig->first];
+            packed.chromosome = contig->first;
+            for (auto feat = contig->second.begin(); feat != contig->second.end(); ++feat) packed.push_back(*feat);
+        }
+    }
+    vector<vector<featureID> > exons(featureNames.size());
+    for (auto contig = features.begin(); contig != features.end(); ++contig)
+    {
+        for (size_t i = 0; i < contig->second.starts.size(); ++i)
+            if (contig->second.type(i) == FeatureType::Exon) exons[contig->second.genes[i]].push_back(contig->second.ids[i]);
+        contig->second.index();
+    }
+    exonsForGene = MappedLists<featureID>(exons);
+    flagGlobins();
+    
+    SeqlibReader bam;
+    if (!bam.open(argv[2]))
+    {
+        cerr << "Unable to open BAM file: " << argv[2] << endl;
+        return 10;
+    }
+    SeqLib::HeaderSequenceVector sequences = bam.getHeader().GetHeaderSequenceVector();
+    vector<Alignment> reads;
+    vector<vector<Block> > readBlocks;
+    vector<unsigned int> lengths;
+    vector<chrom> contigs;
+    map<size_t, unsigned long> blockCounts;
+    Alignment alignment;
+    while (bam.next(alignment))
+    {
+        if (!alignment.MappedFlag() || alignment.SecondaryFlag() || alignment.ChrID() < 0 || static_cast<size_t>(alignment.ChrID()) >= sequences.size()) continue;
+        vector<Block> blocks;
+        lengths.push_back(extractBlocks(alignment, blocks, false));
+        ++blockCounts[blocks.size()];
+        readBlocks.push_back(blocks);
+        contigs.push_back(chromosomeMap(sequences[alignment.ChrID()].Name));
+        reads.push_back(std::move(alignment));
+        alignment = Alignment();
+    }
+    cout << reads.size() << " reads" << endl;
+    for (auto count = blockCounts.begin(); count != blockCounts.end(); ++count) cout << count->first << " blocks: " << count->second << " reads" << endl;
+    
+    Options options;
+    options.orientation = Strand::Unknown;
+    options.chimericDistance = 2000000;
+    options.fragmentSamples = 0u;
+    options.baseMismatchThreshold = 6u;
+    options.mappingQualityThreshold = 255u;
+    options.coverageMask = 500u;
+    options.biasOffset = 150;
+    options.biasWindow = 100;
+    options.biasLength = 600ul;
+    options.detectionThreshold = 5u;
+    options.legacy = options.excludeChimeric = options.unpaired = options.strictSort = false;
+    options.chimericTag = "mC";
+    options.verbosity = 0;
+    vector<double> times;
+    for (int round = 0; round < rounds; ++round)
+    {
+        map<chrom, ContigFeatures> window(features);
+        SampleState state(options, window, bedFeatures);
+        chrom current = 0;
+        chrono::steady_clock::duration elapsed(0);
+        for (size_t i = 0; i < reads.size(); ++i)
+        {
+            ContigFeatures &contig = window[contigs[i]];
+            if (contigs[i] != current)
+            {
+                if (current) dropFeatures(window[current], state.baseCoverage, state.counts);
+                current = contigs[i];
+            }
+            trimFeatures(reads[i], contig, state.baseCoverage, state.counts);
+            const auto start = chrono::steady_clock::now();
+            exonAlignmentMetrics<false, false>(contig, state.counter, readBlocks[i], state.hits, state.scratch, reads[i], lengths[i], options.orientation, state.baseCoverage, state.counts, true);
+            elapsed += chrono::steady_clock::now() - start;
+        }
+        times.push_back(chrono::duration<double>(elapsed).count());
+        cout << "Round " << round + 1 << ": " << times.back() << " s, " << 1e9 * times.back() / reads.size() << " ns per read" << endl;
+    }
+    if (times.size())
+    {
+        sort(times.begin(), times.end());
+        cout << "Median: " << times[times.size() / 2] << " s" << endl;
+    }
+    return 0;
+}
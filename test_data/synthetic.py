@@ -0,0 +1,111 @@
+import argparse
+import random
+
+READ_LENGTH = 76
+
+
+def genes(args):
+    # Collapsed gene models laid out along the contigs, each a gene, a transcript and its exons
+    rng = random.Random(args.seed)
+    lines = 0
+    gene = 0
+    while lines < args.lines and (args.genes is None or gene < args.genes):
+        contig = 1 + gene % args.contigs
+        start = 10000 + (gene // args.contigs) * 50000
+        strand = '+' if rng.random() < 0.5 else '-'
+        exons = []
+        position = start
+        for i in range(rng.randint(1, 15)):
+            length = rng.randint(*args.exon_length)
+            exons.append((position, position + length - 1))
+            position += length + rng.randint(100, 2000)
+        gene_id = 'ENSG{:011d}.1'.format(gene)
+        attributes = 'gene_id "{0}"; transcript_id "{0}"; gene_type "protein_coding"; gene_name "GENE{1}"; transcript_type "protein_coding";'.format(gene_id, gene)
+        yield gene, contig, strand, exons, attributes
+        lines += 2 + len(exons)
+        gene += 1
+
+
+def align(exons, offset, length):
+    # Places a read starting this far into the transcript. Returns its position and cigar
+    blocks = []
+    for start, end in exons:
+        if offset > end - start:
+            offset -= end - start + 1
+            continue
+        size = min(length, end - start + 1 - offset)
+        blocks.append((start + offset, size))
+        length -= size
+        offset = 0
+        if not length:
+            break
+    cigar = '{}M'.format(blocks[0][1])
+    for (start, size), (next_start, next_size) in zip(blocks, blocks[1:]):
+        cigar += '{}N{}M'.format(next_start - start - size, next_size)
+    return blocks[0][0], blocks[-1][0] + blocks[-1][1] - 1, cigar
+
+
+def write_header(args):
+    print('@HD\tVN:1.6\tSO:coordinate')
+    for i in range(args.contigs):
+        print('@SQ\tSN:chr{}\tLN:{}'.format(i + 1, 250000000))
+
+
+def write_gtf(args):
+    print('##description: synthetic annotation for benchmarks')
+    for gene, contig, strand, exons, attributes in genes(args):
+        contig = 'chr{}'.format(contig)
+        print('\t'.join([contig, 'SYN', 'gene', str(exons[0][0]), str(exons[-1][1]), '.', strand, '.', attributes]))
+        print('\t'.join([contig, 'SYN', 'transcript', str(exons[0][0]), str(exons[-1][1]), '.', strand, '.', attributes]))
+        for i, (start, end) in enumerate(exons):
+            print('\t'.join([contig, 'SYN', 'exon', str(start), str(end), '.', strand, '.', '{} exon_id "ENSE{:011d}.{}"; exon_number "{}";'.format(attributes, gene, i + 1, i + 1)]))
+
+
+def write_sam(args):
+    # Read pairs drawn uniformly from the transcript of each gene, so most reads are spliced
+    rng = random.Random(args.seed)
+    read_length = args.read_length
+    sequence = ('ACGT' * read_length)[:read_length]
+    records = []
+    for gene, contig, strand, exons, attributes in genes(args):
+        length = sum(end - start + 1 for start, end in exons)
+        if length < read_length:
+            continue
+        for i in range(max(1, args.depth * length // (2 * read_length))):
+            fragment = rng.randint(min(length, 2 * read_length), min(length, max(400, 2 * read_length)))
+            offset = rng.randint(0, length - fragment)
+            start1, end1, cigar1 = align(exons, offset, read_length)
+            start2, end2, cigar2 = align(exons, offset + fragment - read_length, read_length)
+            name = 'read{}_{}'.format(gene, i)
+            span = end2 - start1 + 1
+            records.append((contig, start1, [name, '99', 'chr{}'.format(contig), str(start1), '255', cigar1, '=', str(start2), str(span)]))
+            records.append((contig, start2, [name, '147', 'chr{}'.format(contig), str(start2), '255', cigar2, '=', str(start1), str(-span)]))
+    write_header(args)
+    records.sort(key=lambda record: (record[0], record[1]))
+    for contig, start, fields in records:
+        print('\t'.join(fields + [sequence, '*', 'NH:i:1', 'NM:i:0']))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser('synthetic')
+    parser.add_argument('--seed', type=int, default=1, help='Random seed')
+    parser.add_argument('--contigs', type=int, default=22, help='Number of contigs')
+    parser.add_argument('--genes', type=int, default=None, help='Stop after this many genes')
+    parser.add_argument('--exon-length', type=int, nargs=2, default=[50, 400], metavar=('MIN', 'MAX'), help='Range of exon lengths')
+    parser.add_argument('--read-length', type=int, default=READ_LENGTH, help='Length of each read. Reads longer than the exons span several of them')
+    subparsers = parser.add_subparsers(dest='output')
+    gtf = subparsers.add_parser('gtf', help='Write a GTF of about this many lines to stdout')
+    gtf.add_argument('lines', type=int)
+    sam = subparsers.add_parser('sam', help='Write a coordinate sorted SAM of read pairs from the genes of the GTF with this many lines to stdout')
+    sam.add_argument('lines', type=int)
+    sam.add_argument('--depth', type=int, default=30, help='Mean coverage of each transcript')
+    subparsers.add_parser('header', help='Write the SAM header of the synthetic contigs to stdout')
+    args = parser.parse_args()
+    if args.output == 'gtf':
+        write_gtf(args)
+    elif args.output == 'sam':
+        write_sam(args)
+    elif args.output == 'header':
+        write_header(args)
+    else:
+        parser.print_usage()